@@ -0,0 +1,407 @@
+#include "CLI/CLI.hpp"
+#include "tins/ethernetII.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "flowmeter/dissector.h"
+#include "flowmeter/features.h"
+#include "flowmeter/flow.h"
+#include "flowmeter/flow_table.h"
+#include "synthetic_traffic.h"
+
+using steady_clock = std::chrono::steady_clock;
+
+namespace Net {
+
+// Keeps the compiler from discarding a result that is otherwise unused.
+template <typename T>
+inline void keep(const T &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// Flow table sink that only counts, so the table is measured without any output.
+struct CountingSink {
+    uint64_t records{0};
+    uint64_t creations{0};
+
+    inline void on_record(const NetworkFlow &, const ExportPosition &) { records++; }
+
+    inline void on_create(const NetworkFlow &, const ExportPosition &) { creations++; }
+
+    inline void on_retire(const NetworkFlow &, const ExportPosition &) {}
+};
+
+// Sink that keeps a copy of every exported record, for the formatting benchmarks.
+struct CollectingSink {
+    std::vector<NetworkFlow> records;
+
+    inline void on_record(const NetworkFlow &flow, const ExportPosition &) {
+        records.push_back(flow);
+    }
+
+    inline void on_create(const NetworkFlow &, const ExportPosition &) {}
+
+    inline void on_retire(const NetworkFlow &, const ExportPosition &) {}
+};
+
+struct BenchResult {
+    std::string name;
+    uint64_t ops;
+    double ns_per_op;
+};
+
+// Runs each benchmark `repetitions` times after one warm-up run and keeps the fastest
+// run, which is the least disturbed by the rest of the system. `setup` runs untimed
+// before every run, `run` performs `ops` operations.
+class Bench {
+  public:
+    Bench(uint32_t repetitions, const std::string &filter)
+        : repetitions_(std::max<uint32_t>(repetitions, 1)), filter_(filter) {}
+
+    template <typename Setup, typename Run>
+    void measure(const std::string &name, uint64_t ops, Setup &&setup, Run &&run) {
+        if (name.find(filter_) == std::string::npos || !ops) {
+            return;
+        }
+        double best = 0;
+        for (uint32_t i = 0; i <= repetitions_; i++) {
+            setup();
+            auto start = steady_clock::now();
+            run();
+            auto elapsed = std::chrono::duration<double, std::nano>(steady_clock::now() -
+                                                                    start)
+                               .count();
+            if (i > 0 && (best == 0 || elapsed < best)) {
+                best = elapsed;
+            }
+        }
+        results_.push_back(BenchResult{name, ops, best / static_cast<double>(ops)});
+        const auto &result = results_.back();
+        std::cout << std::left << std::setw(28) << result.name << std::right
+                  << std::setw(12) << std::fixed << std::setprecision(2)
+                  << result.ns_per_op << " ns/op" << std::setw(12)
+                  << 1e3 / result.ns_per_op << " Mops/s" << std::endl;
+    }
+
+    template <typename Run>
+    void measure(const std::string &name, uint64_t ops, Run &&run) {
+        measure(name, ops, [] {}, std::forward<Run>(run));
+    }
+
+    const std::vector<BenchResult> &results() const { return results_; }
+
+  private:
+    uint32_t repetitions_;
+    std::string filter_;
+    std::vector<BenchResult> results_;
+};
+
+// The stages of metering, each over the whole synthetic capture.
+void run_benchmarks(Bench &bench, const SyntheticTraffic &traffic, double active_timeout,
+                    double idle_timeout, double timer_resolution) {
+    const auto &packets = traffic.packets();
+    const auto count = packets.size();
+
+    // Inputs of the later stages, prepared whichever benchmarks are selected.
+    Dissector dissector(LINKTYPE_ETHERNET);
+    std::vector<PacketDescriptor> descriptors(count);
+    std::vector<PacketFeatures> features(count);
+    for (size_t i = 0; i < count; i++) {
+        dissector.dissect(packets[i], descriptors[i]);
+        features[i] = PacketFeatures(descriptors[i]);
+    }
+
+    // Parsing: the fast path used by the meters, and the libtins path it falls back to.
+    bench.measure("dissect", count, [&] {
+        for (size_t i = 0; i < count; i++) {
+            dissector.dissect(packets[i], descriptors[i]);
+        }
+    });
+    auto pdu_count = std::min<size_t>(count, 20'000);
+    bench.measure("service_pair_libtins", pdu_count, [&] {
+        for (size_t i = 0; i < pdu_count; i++) {
+            Tins::EthernetII frame(packets[i].data, packets[i].caplen);
+            ServicePair pair(frame);
+            keep(pair);
+        }
+    });
+    bench.measure("service_pair_canonical", count, [&] {
+        for (const auto &desc : descriptors) {
+            keep(desc.pair.canonical().hash());
+        }
+    });
+
+    bench.measure("packet_features", count, [&] {
+        for (size_t i = 0; i < count; i++) {
+            features[i] = PacketFeatures(descriptors[i]);
+        }
+    });
+
+    // Flow::update on its own, spread over a fixed set of records that stay in cache.
+    std::vector<NetworkFlow> flows(1024, NetworkFlow(ServicePair(), 0, 0));
+    bench.measure("flow_update", count, [&] {
+        for (size_t i = 0; i < count; i++) {
+            auto &flow = flows[descriptors[i].pair.hash() & 1023];
+            flow.update(features[i], descriptors[i].pair);
+        }
+        keep(flows[0]);
+    });
+
+    // Flow table: creating every flow, then updating flows that are all present. The
+    // clock is never advanced, so nothing expires in between.
+    std::vector<size_t> first_packets;
+    {
+        absl::flat_hash_map<ServicePair, bool> seen;
+        for (size_t i = 0; i < count; i++) {
+            if (seen.try_emplace(descriptors[i].pair.canonical(), true).second) {
+                first_packets.push_back(i);
+            }
+        }
+    }
+    CountingSink sink;
+    std::unique_ptr<FlowTable<CountingSink>> table;
+    auto fresh_table = [&] {
+        table = std::make_unique<FlowTable<CountingSink>>(sink, active_timeout,
+                                                          idle_timeout, timer_resolution);
+    };
+    bench.measure("table_insert", first_packets.size(), fresh_table, [&] {
+        for (auto i : first_packets) {
+            table->process(descriptors[i].pair, features[i], i);
+        }
+    });
+    auto filled_table = [&] {
+        if (!table || table->size() != first_packets.size()) {
+            fresh_table();
+            for (auto i : first_packets) {
+                table->process(descriptors[i].pair, features[i], i);
+            }
+        }
+    };
+    bench.measure("table_lookup_update", count, filled_table, [&] {
+        for (size_t i = 0; i < count; i++) {
+            table->process(descriptors[i].pair, features[i], i);
+        }
+    });
+    // The same with the keys of each burst hashed once and their flows prefetched first,
+    // as Meter does.
+    auto process_bursts = [&](bool advance) {
+        std::array<HashedKey, PREFETCH_BURST> keys;
+        for (size_t begin = 0; begin < count; begin += PREFETCH_BURST) {
+            auto end = std::min(count, begin + PREFETCH_BURST);
+            for (size_t i = begin; i < end; i++) {
+                keys[i - begin] = HashedKey(descriptors[i].pair);
+                table->prefetch(keys[i - begin]);
+            }
+            for (size_t i = begin; i < end; i++) {
+                table->prefetch_flow(keys[i - begin]);
+            }
+            for (size_t i = begin; i < end; i++) {
+                if (advance) {
+                    table->advance(packets[i].timestamp);
+                }
+                table->process(descriptors[i].pair, keys[i - begin], features[i], i);
+            }
+        }
+    };
+    bench.measure("table_lookup_update_burst", count, filled_table,
+                  [&] { process_bursts(false); });
+
+    // Timeout sweep: with timeouts longer than the capture every flow is still live
+    // when the clock jumps past all deadlines, and each one is exported.
+    auto horizon = packets.back().timestamp - packets.front().timestamp + 1;
+    auto fill_table = [&] {
+        table = std::make_unique<FlowTable<CountingSink>>(sink, horizon, horizon,
+                                                          timer_resolution);
+        for (size_t i = 0; i < count; i++) {
+            table->advance(packets[i].timestamp);
+            table->process(descriptors[i].pair, features[i], i);
+        }
+    };
+    bench.measure("timeout_sweep", first_packets.size(), fill_table, [&] {
+        table->advance(packets.back().timestamp + 2 * horizon + 1);
+    });
+
+    // Metering without output: the table with expiration as the meters drive it.
+    bench.measure("meter_no_output", count, fresh_table, [&] {
+        for (size_t i = 0; i < count; i++) {
+            table->advance(packets[i].timestamp);
+            table->process(descriptors[i].pair, features[i], i);
+        }
+        table->finish();
+    });
+    bench.measure("meter_no_output_burst", count, fresh_table, [&] {
+        process_bursts(true);
+        table->finish();
+    });
+    table.reset();
+
+    // Record formatting, on the records the capture actually exports.
+    CollectingSink collected;
+    {
+        FlowTable<CollectingSink> exporter(collected, active_timeout, idle_timeout,
+                                           timer_resolution);
+        for (size_t i = 0; i < count; i++) {
+            exporter.advance(packets[i].timestamp);
+            exporter.process(descriptors[i].pair, features[i], i);
+        }
+        exporter.finish();
+    }
+    const auto &records = collected.records;
+    bench.measure("network_flow_to_string", records.size(), [&] {
+        for (const auto &record : records) {
+            keep(record.to_string());
+        }
+    });
+    fmt::memory_buffer buffer;
+    bench.measure("network_flow_format_to", records.size(), [&] {
+        for (const auto &record : records) {
+            buffer.clear();
+            record.format_to(std::back_inserter(buffer));
+            keep(buffer.size());
+        }
+    });
+}
+
+// Baselines are plain "name ns_per_op" lines, as written by --save.
+std::map<std::string, double> read_baseline(const std::string &path) {
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("Unable to open baseline " + path);
+    }
+    std::map<std::string, double> baseline;
+    std::string name;
+    double ns_per_op;
+    while (in >> name >> ns_per_op) {
+        baseline[name] = ns_per_op;
+    }
+    return baseline;
+}
+
+void save_results(const std::string &path, const std::vector<BenchResult> &results) {
+    std::ofstream out(path, std::ios::trunc);
+    for (const auto &result : results) {
+        out << result.name << ' ' << std::setprecision(6) << result.ns_per_op << '\n';
+    }
+    if (!out.flush()) {
+        throw std::runtime_error("Unable to write " + path);
+    }
+}
+
+// Number of benchmarks more than `tolerance` slower than the baseline.
+int compare(const std::map<std::string, double> &baseline,
+            const std::vector<BenchResult> &results, double tolerance) {
+    int regressions = 0;
+    for (const auto &result : results) {
+        auto it = baseline.find(result.name);
+        if (it == baseline.end()) {
+            continue;
+        }
+        auto ratio = result.ns_per_op / it->second;
+        if (ratio > 1 + tolerance) {
+            std::cout << "REGRESSION " << result.name << ": " << std::setprecision(2)
+                      << result.ns_per_op << " ns/op against " << it->second << " ("
+                      << (ratio - 1) * 100 << "% slower)" << std::endl;
+            regressions++;
+        }
+    }
+    return regressions;
+}
+
+} // end namespace Net
+
+auto main(int argc, char **argv) -> int {
+    CLI::App app{"Microbenchmarks of the flowmeter stages on synthetic traffic"};
+
+    Net::TrafficProfile profile;
+    std::string pcap_path;
+    uint32_t repetitions{5};
+    std::string filter;
+    std::string save_path;
+    std::string baseline_path;
+    double tolerance{0.10};
+    double active_timeout{120};
+    double idle_timeout{5};
+    double timer_resolution{0.01};
+    app.add_option("--flows", profile.flows, "Number of flows")->capture_default_str();
+    app.add_option("--min-packets", profile.min_packets, "Fewest packets in a flow")
+        ->capture_default_str();
+    app.add_option("--max-packets", profile.max_packets, "Most packets in a flow")
+        ->capture_default_str();
+    app.add_option("--min-size", profile.min_size, "Smallest frame in bytes")
+        ->capture_default_str();
+    app.add_option("--max-size", profile.max_size, "Largest frame in bytes")
+        ->capture_default_str();
+    app.add_option("--ipv6-share", profile.ipv6_share, "Share of IPv6 flows")
+        ->capture_default_str()
+        ->check(CLI::Range(0.0, 1.0));
+    app.add_option("--udp-share", profile.udp_share, "Share of UDP flows")
+        ->capture_default_str()
+        ->check(CLI::Range(0.0, 1.0));
+    app.add_option("--min-lifetime", profile.min_lifetime, "Shortest flow in seconds")
+        ->capture_default_str();
+    app.add_option("--max-lifetime", profile.max_lifetime, "Longest flow in seconds")
+        ->capture_default_str();
+    app.add_option("--span", profile.span, "Seconds over which flows start")
+        ->capture_default_str();
+    app.add_option("--skew-share", profile.skew_share,
+                   "Share of packets stamped earlier than the packet before them")
+        ->capture_default_str()
+        ->check(CLI::Range(0.0, 1.0));
+    app.add_option("--max-skew", profile.max_skew,
+                   "Most seconds a skewed packet is stamped early by")
+        ->capture_default_str();
+    app.add_option("--seed", profile.seed, "Seed of the traffic generator")
+        ->capture_default_str();
+    app.add_option("--write-pcap", pcap_path,
+                   "Write the synthetic traffic to this pcap file and exit");
+    app.add_option("--repetitions", repetitions, "Timed runs per benchmark")
+        ->capture_default_str();
+    app.add_option("--filter", filter, "Only run benchmarks whose name contains this");
+    app.add_option("--save", save_path, "Write the results to this baseline file");
+    app.add_option("--baseline", baseline_path,
+                   "Compare against this baseline file and fail on regressions");
+    app.add_option("--tolerance", tolerance,
+                   "Slowdown against the baseline that counts as a regression")
+        ->capture_default_str();
+    app.add_option("--active-timeout", active_timeout, "Active timeout in seconds")
+        ->capture_default_str();
+    app.add_option("--idle-timeout", idle_timeout, "Idle timeout in seconds")
+        ->capture_default_str();
+    app.add_option("--timer-resolution", timer_resolution,
+                   "Granularity of flow expiration in seconds")
+        ->capture_default_str();
+    CLI11_PARSE(app, argc, argv);
+
+    Net::SyntheticTraffic traffic(profile);
+    std::cout << "Generated " << traffic.packets().size() << " packets in "
+              << traffic.flow_count() << " flows, " << traffic.frame_bytes() << " bytes"
+              << std::endl;
+    if (!pcap_path.empty()) {
+        traffic.write_pcap(pcap_path);
+        std::cout << "Wrote " << pcap_path << std::endl;
+        return 0;
+    }
+
+    Net::Bench bench(repetitions, filter);
+    Net::run_benchmarks(bench, traffic, active_timeout, idle_timeout, timer_resolution);
+    if (!save_path.empty()) {
+        Net::save_results(save_path, bench.results());
+    }
+    if (!baseline_path.empty()) {
+        auto regressions =
+            Net::compare(Net::read_baseline(baseline_path), bench.results(), tolerance);
+        if (regressions) {
+            std::cout << regressions << " benchmarks regressed" << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,299 @@
+#ifndef FLOWMETER_SYNTHETIC_TRAFFIC_H
+#define FLOWMETER_SYNTHETIC_TRAFFIC_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "flowmeter/dissector.h"
+#include "flowmeter/distinct_sketch.h"
+
+namespace Net {
+
+// Shape of the generated traffic. Every range is inclusive and drawn from uniformly.
+struct TrafficProfile {
+    uint64_t flows{10'000};
+    uint32_t min_packets{2};
+    uint32_t max_packets{64};
+    // Frame sizes, raised where needed to fit the headers.
+    uint32_t min_size{64};
+    uint32_t max_size{1500};
+    double ipv6_share{0.2};
+    double udp_share{0.3};
+    // Seconds from a flow's first packet to its last.
+    double min_lifetime{0.1};
+    double max_lifetime{30};
+    // Seconds over which the flow start times are spread.
+    double span{60};
+    // Share of packets stamped up to `max_skew` seconds earlier than the packet before
+    // them, as in captures merged from several interfaces. The packets stay in order.
+    double skew_share{0};
+    double max_skew{0};
+    uint64_t seed{1};
+};
+
+// Deterministic synthetic Ethernet traffic of TCP and UDP flows over IPv4 and IPv6,
+// built in memory in timestamp order apart from any skew the profile asks for.
+// Everything is derived from the profile with a fixed mixing function instead of the
+// standard distributions, whose output differs between standard libraries, so a
+// profile yields the same bytes on every platform.
+class SyntheticTraffic {
+  public:
+    static constexpr double BASE_TIME = 1'600'000'000;
+    static constexpr uint32_t ETHERNET_SIZE = 14;
+    static constexpr uint32_t IPV4_SIZE = 20;
+    static constexpr uint32_t IPV6_SIZE = 40;
+    static constexpr uint32_t TCP_SIZE = 20;
+    static constexpr uint32_t UDP_SIZE = 8;
+    static constexpr uint32_t SNAPLEN = 65535;
+
+    explicit SyntheticTraffic(const TrafficProfile &profile) : profile_(profile) {
+        if (profile.min_packets == 0 || profile.min_packets > profile.max_packets ||
+            profile.min_size > profile.max_size ||
+            profile.min_lifetime > profile.max_lifetime) {
+            throw std::invalid_argument("Invalid traffic profile");
+        }
+        generate();
+    }
+
+    const TrafficProfile &profile() const { return profile_; }
+
+    // Views into the generated frames, valid for the lifetime of this object.
+    const std::vector<RawPacket> &packets() const { return packets_; }
+
+    uint64_t flow_count() const { return profile_.flows; }
+
+    size_t frame_bytes() const { return frames_.size(); }
+
+    // Writes the frames as a classic microsecond pcap file.
+    void write_pcap(const std::string &path) const {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error("Unable to open " + path);
+        }
+        uint32_t header[6] = {0xA1B2C3D4, 0x00040002, 0, 0, SNAPLEN, LINKTYPE_ETHERNET};
+        out.write(reinterpret_cast<const char *>(header), sizeof(header));
+        for (const auto &raw : packets_) {
+            auto seconds = static_cast<uint32_t>(raw.timestamp);
+            auto micros = static_cast<uint32_t>((raw.timestamp - seconds) * 1e6 + 0.5);
+            if (micros >= 1'000'000) {
+                seconds++;
+                micros -= 1'000'000;
+            }
+            uint32_t record[4] = {seconds, micros, raw.caplen, raw.len};
+            out.write(reinterpret_cast<const char *>(record), sizeof(record));
+            out.write(reinterpret_cast<const char *>(raw.data), raw.caplen);
+        }
+        if (!out.flush()) {
+            throw std::runtime_error("Unable to write " + path);
+        }
+    }
+
+  private:
+    // Stream of draws for the skew, apart from the per-flow ones.
+    static constexpr uint64_t SKEW_KEY = ~uint64_t{0};
+
+    struct FlowSpec {
+        uint32_t client;
+        uint32_t server;
+        uint16_t client_port;
+        uint16_t server_port;
+        bool ipv6;
+        bool udp;
+        uint32_t packets;
+        double start;
+        double lifetime;
+    };
+
+    struct Event {
+        double timestamp;
+        uint32_t flow;
+        uint32_t index;
+    };
+
+    // Pseudo-random value number `n` of stream `key`, independent of generation order.
+    inline uint64_t draw(uint64_t key, uint64_t n) const {
+        return mix64(mix64(profile_.seed ^ mix64(key)) + n);
+    }
+
+    inline double unit(uint64_t key, uint64_t n) const {
+        return static_cast<double>(draw(key, n) >> 11) * 0x1p-53;
+    }
+
+    inline uint64_t between(uint64_t key, uint64_t n, uint64_t lo, uint64_t hi) const {
+        return lo + draw(key, n) % (hi - lo + 1);
+    }
+
+    FlowSpec flow_spec(uint32_t flow) const {
+        static constexpr uint16_t services[] = {80, 443, 53, 22, 25, 123, 8080, 3306};
+        FlowSpec spec;
+        // Many clients talking to a smaller set of servers.
+        spec.client = static_cast<uint32_t>(draw(flow, 0)) & 0x00FFFFFF;
+        spec.server = static_cast<uint32_t>(between(flow, 1, 1, 4096));
+        spec.client_port = static_cast<uint16_t>(between(flow, 2, 1024, 65535));
+        spec.server_port = services[draw(flow, 3) % std::size(services)];
+        spec.ipv6 = unit(flow, 4) < profile_.ipv6_share;
+        spec.udp = unit(flow, 5) < profile_.udp_share;
+        spec.packets = static_cast<uint32_t>(
+            between(flow, 6, profile_.min_packets, profile_.max_packets));
+        spec.start = BASE_TIME + unit(flow, 7) * profile_.span;
+        spec.lifetime = profile_.min_lifetime +
+                        unit(flow, 8) * (profile_.max_lifetime - profile_.min_lifetime);
+        return spec;
+    }
+
+    void generate() {
+        std::vector<FlowSpec> specs;
+        std::vector<Event> events;
+        specs.reserve(profile_.flows);
+        for (uint32_t flow = 0; flow < profile_.flows; flow++) {
+            auto spec = flow_spec(flow);
+            // Packets are spaced evenly over the lifetime.
+            double gap = spec.packets > 1 ? spec.lifetime / (spec.packets - 1) : 0;
+            for (uint32_t i = 0; i < spec.packets; i++) {
+                events.push_back(Event{spec.start + gap * i, flow, i});
+            }
+            specs.push_back(spec);
+        }
+        std::sort(events.begin(), events.end(), [](const Event &lhs, const Event &rhs) {
+            if (lhs.timestamp != rhs.timestamp) {
+                return lhs.timestamp < rhs.timestamp;
+            }
+            return lhs.flow != rhs.flow ? lhs.flow < rhs.flow : lhs.index < rhs.index;
+        });
+
+        std::vector<size_t> offsets;
+        offsets.reserve(events.size());
+        packets_.reserve(events.size());
+        for (size_t i = 0; i < events.size(); i++) {
+            const auto &event = events[i];
+            offsets.push_back(frames_.size());
+            auto size = append_frame(specs[event.flow], event);
+            auto timestamp = event.timestamp;
+            if (unit(SKEW_KEY, 2 * i) < profile_.skew_share) {
+                timestamp -= unit(SKEW_KEY, 2 * i + 1) * profile_.max_skew;
+            }
+            packets_.push_back(RawPacket{nullptr, size, size, timestamp, 0});
+        }
+        // The buffer has stopped growing, so the views can be pointed into it.
+        for (size_t i = 0; i < packets_.size(); i++) {
+            packets_[i].data = frames_.data() + offsets[i];
+        }
+    }
+
+    uint32_t append_frame(const FlowSpec &spec, const Event &event) {
+        auto key = (static_cast<uint64_t>(event.flow) << 32) | event.index;
+        // The client opens the flow; later packets go either way.
+        bool reply = event.index > 0 && (draw(key, 0) & 1);
+        uint32_t headers = ETHERNET_SIZE + (spec.ipv6 ? IPV6_SIZE : IPV4_SIZE) +
+                           (spec.udp ? UDP_SIZE : TCP_SIZE);
+        auto size = static_cast<uint32_t>(std::max<uint64_t>(
+            headers, between(key, 1, profile_.min_size, profile_.max_size)));
+        size = std::min(size, SNAPLEN);
+
+        auto start = frames_.size();
+        frames_.resize(start + size);
+        auto *frame = frames_.data() + start;
+        std::memset(frame, 0, headers);
+
+        static constexpr uint8_t client_mac[] = {0x02, 0, 0, 0, 0, 0x01};
+        static constexpr uint8_t server_mac[] = {0x02, 0, 0, 0, 0, 0x02};
+        std::memcpy(frame, reply ? client_mac : server_mac, 6);
+        std::memcpy(frame + 6, reply ? server_mac : client_mac, 6);
+        frame[12] = spec.ipv6 ? 0x86 : 0x08;
+        frame[13] = spec.ipv6 ? 0xDD : 0x00;
+
+        auto *ip = frame + ETHERNET_SIZE;
+        auto transport_size = size - ETHERNET_SIZE - (spec.ipv6 ? IPV6_SIZE : IPV4_SIZE);
+        uint8_t proto = spec.udp ? 17 : 6;
+        auto src = reply ? spec.server : spec.client;
+        auto dst = reply ? spec.client : spec.server;
+        if (spec.ipv6) {
+            ip[0] = 0x60;
+            put16(ip + 4, static_cast<uint16_t>(transport_size));
+            ip[6] = proto;
+            ip[7] = 64;
+            put_ipv6(ip + 8, src, reply);
+            put_ipv6(ip + 24, dst, !reply);
+        } else {
+            ip[0] = 0x45;
+            put16(ip + 2, static_cast<uint16_t>(size - ETHERNET_SIZE));
+            put16(ip + 4, static_cast<uint16_t>(event.index));
+            ip[8] = 64;
+            ip[9] = proto;
+            put32(ip + 12, (reply ? 0xAC100000 : 0x0A000000) | src);
+            put32(ip + 16, (reply ? 0x0A000000 : 0xAC100000) | dst);
+            put16(ip + 10, ipv4_checksum(ip));
+        }
+
+        auto *l4 = ip + (spec.ipv6 ? IPV6_SIZE : IPV4_SIZE);
+        put16(l4, reply ? spec.server_port : spec.client_port);
+        put16(l4 + 2, reply ? spec.client_port : spec.server_port);
+        if (spec.udp) {
+            put16(l4 + 4, static_cast<uint16_t>(transport_size));
+        } else {
+            put32(l4 + 4, static_cast<uint32_t>(draw(key, 2)));
+            l4[12] = 0x50;
+            l4[13] = tcp_flags(spec, event, size > headers);
+            put16(l4 + 14, 65535);
+        }
+
+        // Payload bytes, so that the byte statistics have something to chew on.
+        for (uint32_t i = headers; i < size; i += 8) {
+            uint64_t word = draw(key, 3 + i / 8);
+            std::memcpy(frame + i, &word, std::min<uint32_t>(8, size - i));
+        }
+        return size;
+    }
+
+    static uint8_t tcp_flags(const FlowSpec &spec, const Event &event, bool payload) {
+        constexpr uint8_t FIN = 0x01, SYN = 0x02, PSH = 0x08, ACK = 0x10;
+        if (event.index == 0) {
+            return SYN;
+        }
+        if (event.index + 1 == spec.packets) {
+            return FIN | ACK;
+        }
+        return payload ? PSH | ACK : ACK;
+    }
+
+    // 2001:db8::/32, with servers and clients in separate /64s.
+    static void put_ipv6(uint8_t *out, uint32_t host, bool server) {
+        put32(out, 0x20010DB8);
+        out[7] = server ? 2 : 1;
+        put32(out + 12, host);
+    }
+
+    static inline void put16(uint8_t *out, uint16_t value) {
+        out[0] = static_cast<uint8_t>(value >> 8);
+        out[1] = static_cast<uint8_t>(value);
+    }
+
+    static inline void put32(uint8_t *out, uint32_t value) {
+        put16(out, static_cast<uint16_t>(value >> 16));
+        put16(out + 2, static_cast<uint16_t>(value));
+    }
+
+    static uint16_t ipv4_checksum(const uint8_t *header) {
+        uint32_t sum = 0;
+        for (uint32_t i = 0; i < IPV4_SIZE; i += 2) {
+            sum += static_cast<uint32_t>(header[i] << 8 | header[i + 1]);
+        }
+        while (sum >> 16) {
+            sum = (sum & 0xFFFF) + (sum >> 16);
+        }
+        return static_cast<uint16_t>(~sum);
+    }
+
+    TrafficProfile profile_;
+    std::vector<uint8_t> frames_;
+    std::vector<RawPacket> packets_;
+};
+
+} // end namespace Net
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef FLOWMETER_BLOCK_QUEUE_H
+#define FLOWMETER_BLOCK_QUEUE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+namespace Net {
+
+// Bounded queue of large work items, such as megabyte blocks of file data, between two
+// threads. Unlike SpscRing it puts a waiting thread to sleep, since a wait here lasts as
+// long as a disk write or a codec call rather than a few packets.
+template <typename T>
+class BlockQueue {
+  public:
+    BlockQueue(size_t capacity) : capacity_(capacity ? capacity : 1) {}
+
+    BlockQueue(const BlockQueue &) = delete;
+    BlockQueue &operator=(const BlockQueue &) = delete;
+
+    // Blocks until there is room; returns false, dropping `value`, once closed.
+    bool push(T &&value) {
+        std::unique_lock lock(mutex_);
+        not_full_.wait(lock, [this]() { return closed_ || items_.size() < capacity_; });
+        if (closed_) {
+            return false;
+        }
+        items_.push_back(std::move(value));
+        not_empty_.notify_one();
+        return true;
+    }
+
+    // Blocks until there is an item; returns false once closed and drained.
+    bool pop(T &value) {
+        std::unique_lock lock(mutex_);
+        not_empty_.wait(lock, [this]() { return closed_ || !items_.empty(); });
+        if (items_.empty()) {
+            return false;
+        }
+        value = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    // Refuses further pushes and wakes both sides; items already queued can still be
+    // popped.
+    void close() {
+        std::lock_guard lock(mutex_);
+        closed_ = true;
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+
+  private:
+    size_t capacity_;
+    bool closed_{false};
+    std::deque<T> items_;
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+};
+
+} // end namespace Net
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef FLOWMETER_BUFFER_METER_H
+#define FLOWMETER_BUFFER_METER_H
+
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "flowmeter/columnar.h"
+#include "flowmeter/dissector.h"
+#include "flowmeter/features.h"
+#include "flowmeter/flow_table.h"
+#include "flowmeter/meter.h"
+
+namespace Net {
+
+// Push-style meter for packets that are already in memory, such as frames taken off a
+// message queue. Each call meters one batch of packets laid out in a single buffer and
+// appends the records that expired meanwhile to a RowBuffer; flow state carries over
+// from one batch to the next, as if the batches were one capture.
+class BufferMeter {
+  public:
+    BufferMeter(const double &active_timeout, const double &idle_timeout,
+                const double &timer_resolution = Meter::default_timer_resolution_,
+                uint32_t link_type = LINKTYPE_ETHERNET)
+        : timer_resolution_(timer_resolution),
+          table_(*this, active_timeout, idle_timeout, timer_resolution),
+          specs_(column_specs(NetworkFlow(ServicePair(), 0, 0))), dissector_(link_type) {}
+
+    BufferMeter(const BufferMeter &) = delete;
+    BufferMeter &operator=(const BufferMeter &) = delete;
+
+    // Schema of the records ingest() and finish() produce.
+    const std::vector<ColumnSpec> &columns() const { return specs_; }
+
+    // Meters `count` packets from the `size` bytes at `data`: packet i is the
+    // `lengths[i]` bytes at `offsets[i]`, captured at `timestamps[i]` seconds. The whole
+    // batch is checked before any of it is metered, so a bad one changes nothing: every
+    // packet must lie inside the buffer and every timestamp must be a finite,
+    // non-negative time whose tick fits the timer wheel.
+    void ingest(const uint8_t *data, size_t size, const uint64_t *offsets,
+                const uint32_t *lengths, const double *timestamps, size_t count,
+                RowBuffer &rows) {
+        if (finished_) {
+            throw std::logic_error("BufferMeter has already been finished");
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (offsets[i] > size || lengths[i] > size - offsets[i]) {
+                throw std::invalid_argument("Packet " + std::to_string(i) +
+                                            " runs past the end of the buffer");
+            }
+            if (!std::isfinite(timestamps[i]) || timestamps[i] < 0 ||
+                timestamps[i] / timer_resolution_ >= MAX_TICK) {
+                throw std::invalid_argument("Packet " + std::to_string(i) +
+                                            " has an invalid timestamp");
+            }
+        }
+        rows_ = &rows;
+        RawPacket raw;
+        for (size_t i = 0; i < count; i++) {
+            raw.data = data + offsets[i];
+            raw.caplen = lengths[i];
+            raw.len = lengths[i];
+            raw.timestamp = timestamps[i];
+            auto seq = pkt_count_++;
+            table_.advance(raw.timestamp);
+            if (dissector_.dissect(raw, packet_)) {
+                table_.process(packet_.pair, PacketFeatures(packet_), seq);
+            }
+        }
+        rows_ = nullptr;
+    }
+
+    // Exports every flow still live, as at the end of a capture. Nothing can be
+    // ingested afterwards.
+    void finish(RowBuffer &rows) {
+        if (finished_) {
+            return;
+        }
+        rows_ = &rows;
+        table_.finish();
+        rows_ = nullptr;
+        finished_ = true;
+    }
+
+    uint64_t packet_count() const { return pkt_count_; }
+
+    size_t flow_count() const { return table_.size(); }
+
+    bool finished() const { return finished_; }
+
+    // FlowTable sink interface.
+    inline void on_record(const NetworkFlow &flow, const ExportPosition &) {
+        rows_->append(flow);
+    }
+
+    inline void on_create(const NetworkFlow &, const ExportPosition &) {}
+
+    inline void on_retire(const NetworkFlow &, const ExportPosition &) {}
+
+  private:
+    // Ticks at or past 2^63 do not convert to uint64_t safely.
+    static constexpr double MAX_TICK = 0x1p63;
+
+    double timer_resolution_;
+    FlowTable<BufferMeter> table_;
+    std::vector<ColumnSpec> specs_;
+    Dissector dissector_;
+    PacketDescriptor packet_;
+    RowBuffer *rows_{nullptr};
+    uint64_t pkt_count_{0};
+    bool finished_{false};
+};
+
+} // end namespace Net
+
+#endif
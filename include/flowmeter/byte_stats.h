@@ -0,0 +1,205 @@
+#ifndef FLOWMETER_BYTE_STATS_H
+#define FLOWMETER_BYTE_STATS_H
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+// The SIMD kernels use 64-bit intrinsics, so 32-bit x86 gets the scalar kernel.
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define FLOWMETER_X86_KERNELS 1
+#endif
+
+#include "flowmeter/constants.h"
+
+namespace Net {
+
+enum ByteClass { NULL_BYTE, LOW_BYTE, CHAR_BYTE, HIGH_BYTE, BYTE_CLASS_COUNT };
+
+// Result of a single pass over a buffer: the number of set bits and how many bytes
+// fall in each ByteClass (0x00, 0x01-0x20, 0x21-0x7E, 0x7F-0xFF).
+struct ByteStats {
+    uint64_t bit_count{0};
+    std::array<uint32_t, BYTE_CLASS_COUNT> byte_classes{};
+};
+
+namespace Kernel {
+
+// Running totals shared by every implementation. Bytes <= ASCII_END include those
+// <= ASCII_START - 1, which include the null bytes, so the classes fall out as
+// differences once the buffer has been consumed.
+struct Totals {
+    uint64_t bits{0};
+    uint64_t null_bytes{0};
+    uint64_t low_or_null{0};
+    uint64_t not_high{0};
+
+    inline void add_scalar(const uint8_t *data, size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            auto byte = data[i];
+            bits += std::popcount(byte);
+            null_bytes += byte == BYTE_00;
+            low_or_null += byte < ASCII_START;
+            not_high += byte <= ASCII_END;
+        }
+    }
+
+    inline ByteStats finish(size_t size) const {
+        ByteStats stats;
+        stats.bit_count = bits;
+        stats.byte_classes[NULL_BYTE] = static_cast<uint32_t>(null_bytes);
+        stats.byte_classes[LOW_BYTE] = static_cast<uint32_t>(low_or_null - null_bytes);
+        stats.byte_classes[CHAR_BYTE] = static_cast<uint32_t>(not_high - low_or_null);
+        stats.byte_classes[HIGH_BYTE] = static_cast<uint32_t>(size - not_high);
+        return stats;
+    }
+};
+
+inline ByteStats scalar(const uint8_t *data, size_t size) {
+    Totals totals;
+    totals.add_scalar(data, size);
+    return totals.finish(size);
+}
+
+#ifdef FLOWMETER_X86_KERNELS
+
+// Bit counts use the nibble lookup table trick: two shuffles per vector, then a sum of
+// absolute differences to fold the per-byte counts into 64-bit lanes.
+__attribute__((target("sse4.2,popcnt"))) inline ByteStats sse42(const uint8_t *data,
+                                                                 size_t size) {
+    const __m128i lut = _mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m128i nibble_mask = _mm_set1_epi8(0x0F);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i low_bound = _mm_set1_epi8(static_cast<char>(ASCII_START - 1));
+    const __m128i char_bound = _mm_set1_epi8(static_cast<char>(ASCII_END));
+    __m128i bit_acc = _mm_setzero_si128();
+    Totals totals;
+
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        __m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(v, nibble_mask));
+        __m128i shifted = _mm_srli_epi16(v, 4);
+        __m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(shifted, nibble_mask));
+        bit_acc = _mm_add_epi64(bit_acc, _mm_sad_epu8(_mm_add_epi8(lo, hi), zero));
+
+        auto null_bits = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+        auto low_bits =
+            _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, low_bound), v));
+        auto char_bits =
+            _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, char_bound), v));
+        totals.null_bytes += _mm_popcnt_u32(null_bits);
+        totals.low_or_null += _mm_popcnt_u32(low_bits);
+        totals.not_high += _mm_popcnt_u32(char_bits);
+    }
+
+    totals.bits += static_cast<uint64_t>(_mm_cvtsi128_si64(bit_acc)) +
+                   static_cast<uint64_t>(_mm_extract_epi64(bit_acc, 1));
+    totals.add_scalar(data + i, size - i);
+    return totals.finish(size);
+}
+
+__attribute__((target("avx2,popcnt"))) inline ByteStats avx2(const uint8_t *data,
+                                                              size_t size) {
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0,
+                                         1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i nibble_mask = _mm256_set1_epi8(0x0F);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i low_bound = _mm256_set1_epi8(static_cast<char>(ASCII_START - 1));
+    const __m256i char_bound = _mm256_set1_epi8(static_cast<char>(ASCII_END));
+    __m256i bit_acc = _mm256_setzero_si256();
+    Totals totals;
+
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+        __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, nibble_mask));
+        __m256i shifted = _mm256_srli_epi16(v, 4);
+        __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(shifted, nibble_mask));
+        bit_acc =
+            _mm256_add_epi64(bit_acc, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), zero));
+
+        uint32_t null_bits = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+        uint32_t low_bits =
+            _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(v, low_bound), v));
+        uint32_t char_bits =
+            _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(v, char_bound), v));
+        totals.null_bytes += _mm_popcnt_u32(null_bits);
+        totals.low_or_null += _mm_popcnt_u32(low_bits);
+        totals.not_high += _mm_popcnt_u32(char_bits);
+    }
+
+    alignas(32) uint64_t lanes[4];
+    _mm256_store_si256(reinterpret_cast<__m256i *>(lanes), bit_acc);
+    totals.bits += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    totals.add_scalar(data + i, size - i);
+    return totals.finish(size);
+}
+
+__attribute__((target("avx512f,avx512bw,popcnt"))) inline ByteStats
+avx512(const uint8_t *data, size_t size) {
+    const __m512i lut = _mm512_set4_epi32(0x04030302, 0x03020201, 0x03020201, 0x02010100);
+    const __m512i nibble_mask = _mm512_set1_epi8(0x0F);
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i low_bound = _mm512_set1_epi8(static_cast<char>(ASCII_START - 1));
+    const __m512i char_bound = _mm512_set1_epi8(static_cast<char>(ASCII_END));
+    __m512i bit_acc = _mm512_setzero_si512();
+    Totals totals;
+
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        __m512i v = _mm512_loadu_si512(data + i);
+        __m512i lo = _mm512_shuffle_epi8(lut, _mm512_and_si512(v, nibble_mask));
+        __m512i shifted = _mm512_srli_epi16(v, 4);
+        __m512i hi = _mm512_shuffle_epi8(lut, _mm512_and_si512(shifted, nibble_mask));
+        bit_acc =
+            _mm512_add_epi64(bit_acc, _mm512_sad_epu8(_mm512_add_epi8(lo, hi), zero));
+
+        totals.null_bytes += _mm_popcnt_u64(_mm512_cmpeq_epi8_mask(v, zero));
+        totals.low_or_null += _mm_popcnt_u64(_mm512_cmple_epu8_mask(v, low_bound));
+        totals.not_high += _mm_popcnt_u64(_mm512_cmple_epu8_mask(v, char_bound));
+    }
+
+    alignas(64) uint64_t lanes[8];
+    _mm512_store_si512(lanes, bit_acc);
+    for (auto lane : lanes) {
+        totals.bits += lane;
+    }
+    totals.add_scalar(data + i, size - i);
+    return totals.finish(size);
+}
+
+#endif
+
+typedef ByteStats (*ByteStatsFn)(const uint8_t *, size_t);
+
+inline ByteStatsFn select() {
+#ifdef FLOWMETER_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw")) {
+        return avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return avx2;
+    }
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt")) {
+        return sse42;
+    }
+#endif
+    return scalar;
+}
+
+} // end namespace Kernel
+
+// Counts set bits and byte classes of `data` in one pass, using the widest vector
+// extension the running CPU supports.
+inline ByteStats byte_stats(const uint8_t *data, size_t size) {
+    static const Kernel::ByteStatsFn kernel = Kernel::select();
+    return kernel(data, size);
+}
+
+} // end namespace Net
+
+#endif
@@ -0,0 +1,202 @@
+#ifndef FLOWMETER_CHECKPOINT_H
+#define FLOWMETER_CHECKPOINT_H
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "flowmeter/service.h"
+
+namespace Net {
+
+// What a checkpoint records besides the flows, and what it must agree with to be
+// resumed: the records only make sense under the timeouts and sampling rates they were
+// metered with.
+struct CheckpointState {
+    double active_timeout{0};
+    double idle_timeout{0};
+    double timer_resolution{0};
+    uint32_t packet_sampling_rate{1};
+    uint32_t flow_sampling_rate{1};
+    // Packets metered before the checkpoint, across every run that led up to it.
+    uint64_t packets{0};
+    // The last input file that was read to the end.
+    std::string last_input;
+};
+
+// Flow state of a FlowTable saved between runs, so that a stream of capture files can
+// be metered one run at a time without splitting the flows that cross from one file to
+// the next. The layout is a fixed header, the last input path, then every flow as the
+// tick its timer is due on followed by the raw record bytes. Records are copied as
+// plain bytes, so a checkpoint is only read back by a build with the same record
+// layout on a machine of the same byte order; both are checked.
+class Checkpoint {
+  public:
+    static constexpr char MAGIC[8] = {'F', 'L', 'O', 'W', 'C', 'K', 'P', 'T'};
+    static constexpr uint32_t VERSION = 2;
+    static constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+    // Writes the flows of `table` to `path`, through a rename so that an interrupted
+    // write never leaves a truncated checkpoint behind.
+    template <typename Record, typename Table>
+    static void save(const std::string &path, const Table &table,
+                     const CheckpointState &state) {
+        static_assert(std::is_trivially_copyable_v<Record>);
+        // A flow with two timers is kept once, due on the earlier one.
+        struct Entry {
+            const Record *flow;
+            uint64_t tick;
+        };
+        std::vector<Entry> entries;
+        entries.reserve(table.size());
+        table.for_each([&entries](const Record &flow, uint64_t tick) {
+            entries.push_back(Entry{&flow, tick});
+        });
+        std::sort(entries.begin(), entries.end(), [](const auto &lhs, const auto &rhs) {
+            return lhs.flow->init_id != rhs.flow->init_id
+                       ? lhs.flow->init_id < rhs.flow->init_id
+                       : lhs.tick < rhs.tick;
+        });
+        entries.erase(std::unique(entries.begin(), entries.end(),
+                                  [](const auto &lhs, const auto &rhs) {
+                                      return lhs.flow == rhs.flow;
+                                  }),
+                      entries.end());
+
+        Header header = make_header<Record>(state);
+        header.tick = table.current_tick();
+        header.next_id = table.next_id();
+        header.flow_count = entries.size();
+        header.path_size = state.last_input.size();
+
+        auto temporary = path + ".tmp";
+        {
+            std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+            if (!out) {
+                throw std::runtime_error("Unable to open " + temporary);
+            }
+            out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            out.write(state.last_input.data(),
+                      static_cast<std::streamsize>(state.last_input.size()));
+            for (const auto &entry : entries) {
+                out.write(reinterpret_cast<const char *>(&entry.tick), sizeof(entry.tick));
+                out.write(reinterpret_cast<const char *>(entry.flow), sizeof(Record));
+            }
+            if (!out.flush()) {
+                throw std::runtime_error("Unable to write " + temporary);
+            }
+        }
+        if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+            throw std::runtime_error("Unable to replace " + path);
+        }
+    }
+
+    // Loads the flows saved in `path` into `table`, which must not have seen a packet
+    // yet, and returns the saved state. `state` supplies the settings of this run,
+    // which have to match those of the checkpoint.
+    template <typename Record, typename Table>
+    static CheckpointState load(const std::string &path, Table &table,
+                                const CheckpointState &state) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            throw std::runtime_error("Unable to open checkpoint " + path);
+        }
+        Header header;
+        if (!in.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+            std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+            throw std::runtime_error(path + " is not a flowmeter checkpoint");
+        }
+        auto expected = make_header<Record>(state);
+        if (header.version != expected.version ||
+            header.byte_order != expected.byte_order ||
+            header.record_size != expected.record_size ||
+            header.features != expected.features) {
+            throw std::runtime_error(path +
+                                     " was written by a different build or feature set");
+        }
+        if (header.active_timeout != expected.active_timeout ||
+            header.idle_timeout != expected.idle_timeout ||
+            header.timer_resolution != expected.timer_resolution) {
+            throw std::runtime_error(path + " was written with different timeouts");
+        }
+        if (header.packet_sampling_rate != expected.packet_sampling_rate ||
+            header.flow_sampling_rate != expected.flow_sampling_rate) {
+            throw std::runtime_error(path + " was written with different sampling rates");
+        }
+
+        CheckpointState saved = state;
+        saved.packets = header.packets;
+        if (header.path_size > PATH_MAX) {
+            throw std::runtime_error("Checkpoint " + path + " is corrupt");
+        }
+        saved.last_input.resize(header.path_size);
+        if (!in.read(saved.last_input.data(),
+                     static_cast<std::streamsize>(header.path_size))) {
+            throw std::runtime_error("Checkpoint " + path + " is truncated");
+        }
+
+        // The clock has to be running before flows are put back on it.
+        table.advance_tick(header.tick);
+        table.resume_ids(header.next_id);
+        alignas(Record) unsigned char bytes[sizeof(Record)];
+        for (uint64_t i = 0; i < header.flow_count; i++) {
+            uint64_t tick;
+            in.read(reinterpret_cast<char *>(&tick), sizeof(tick));
+            in.read(reinterpret_cast<char *>(bytes), sizeof(Record));
+            if (!in) {
+                throw std::runtime_error("Checkpoint " + path + " is truncated");
+            }
+            Record flow(ServicePair(), 0, 0);
+            std::memcpy(static_cast<void *>(&flow), bytes, sizeof(Record));
+            table.adopt(flow, tick);
+        }
+        return saved;
+    }
+
+  private:
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+        uint32_t record_size;
+        uint32_t features;
+        double active_timeout;
+        double idle_timeout;
+        double timer_resolution;
+        uint32_t packet_sampling_rate;
+        uint32_t flow_sampling_rate;
+        uint64_t tick;
+        int64_t next_id;
+        uint64_t packets;
+        uint64_t flow_count;
+        uint64_t path_size;
+    };
+
+    template <typename Record>
+    static Header make_header(const CheckpointState &state) {
+        Header header{};
+        std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = VERSION;
+        header.byte_order = BYTE_ORDER_MARK;
+        header.record_size = sizeof(Record);
+        header.features = Record::FEATURES;
+        header.active_timeout = state.active_timeout;
+        header.idle_timeout = state.idle_timeout;
+        header.timer_resolution = state.timer_resolution;
+        header.packet_sampling_rate = state.packet_sampling_rate;
+        header.flow_sampling_rate = state.flow_sampling_rate;
+        header.packets = state.packets;
+        return header;
+    }
+};
+
+} // end namespace Net
+
+#endif
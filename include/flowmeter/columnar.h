@@ -0,0 +1,437 @@
+#ifndef FLOWMETER_COLUMNAR_H
+#define FLOWMETER_COLUMNAR_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <type_traits>
+#include <unistd.h>
+#include <vector>
+
+#include "flowmeter/csv_writer.h"
+#include "flowmeter/tins_ext.h"
+
+namespace Net {
+
+// Self-contained columnar file layout, in host byte order:
+//
+//   header   "FLOWCOL" NUL, u32 version, u32 column count, then per column
+//            u8 type, u8 reserved, u16 element width, u16 name length, name bytes
+//   chunk    u64 row count, padding to COLUMNAR_ALIGNMENT, then for each column
+//            row count * width bytes, padded to COLUMNAR_ALIGNMENT
+//
+// Everything after the header is a sequence of chunks. Every column of every chunk
+// starts on an aligned offset, so a reader that maps the file can use the bytes in
+// place as typed arrays. A reader on a machine of the other byte order sees a wrong
+// version number and rejects the file.
+inline constexpr char COLUMNAR_MAGIC[8] = {'F', 'L', 'O', 'W', 'C', 'O', 'L', '\0'};
+inline constexpr uint32_t COLUMNAR_VERSION = 1;
+inline constexpr size_t COLUMNAR_ALIGNMENT = 64;
+
+enum class ColumnType : uint8_t {
+    UINT8 = 1,
+    UINT16,
+    UINT32,
+    UINT64,
+    INT64,
+    FLOAT64,
+    BYTES
+};
+
+struct ColumnSpec {
+    std::string name;
+    ColumnType type;
+    uint16_t width;
+};
+
+// Column type and element width of every value type a record visits.
+template <typename T>
+struct ColumnTraits;
+
+template <>
+struct ColumnTraits<uint8_t> {
+    static constexpr ColumnType type = ColumnType::UINT8;
+};
+
+template <>
+struct ColumnTraits<uint16_t> {
+    static constexpr ColumnType type = ColumnType::UINT16;
+};
+
+template <>
+struct ColumnTraits<uint32_t> {
+    static constexpr ColumnType type = ColumnType::UINT32;
+};
+
+template <>
+struct ColumnTraits<uint64_t> {
+    static constexpr ColumnType type = ColumnType::UINT64;
+};
+
+template <>
+struct ColumnTraits<int64_t> {
+    static constexpr ColumnType type = ColumnType::INT64;
+};
+
+template <>
+struct ColumnTraits<double> {
+    static constexpr ColumnType type = ColumnType::FLOAT64;
+};
+
+template <>
+struct ColumnTraits<IpAddress> {
+    static constexpr ColumnType type = ColumnType::BYTES;
+};
+
+template <>
+struct ColumnTraits<MacAddress> {
+    static constexpr ColumnType type = ColumnType::BYTES;
+};
+
+template <typename T>
+inline constexpr uint16_t column_width() {
+    if constexpr (std::is_same_v<T, MacAddress>) {
+        return MacAddress::address_size;
+    } else {
+        return sizeof(T);
+    }
+}
+
+inline size_t columnar_padding(size_t offset) {
+    return (COLUMNAR_ALIGNMENT - offset % COLUMNAR_ALIGNMENT) % COLUMNAR_ALIGNMENT;
+}
+
+// Derives the schema of `Row` from a prototype: names from its column_names(), types
+// from the values its visit() produces.
+template <typename Row>
+std::vector<ColumnSpec> column_specs(const Row &prototype) {
+    std::vector<ColumnSpec> specs;
+    std::stringstream names(prototype.column_names());
+    std::string name;
+    while (std::getline(names, name, ',')) {
+        specs.push_back(ColumnSpec{name, ColumnType::UINT8, 0});
+    }
+    size_t column = 0;
+    prototype.visit([&specs, &column](const auto &value) {
+        using T = std::decay_t<decltype(value)>;
+        if (column < specs.size()) {
+            specs[column].type = ColumnTraits<T>::type;
+            specs[column].width = column_width<T>();
+        }
+        column++;
+    });
+    if (column != specs.size()) {
+        throw std::logic_error("Record visits " + std::to_string(column) +
+                               " values but names " + std::to_string(specs.size()) +
+                               " columns");
+    }
+    return specs;
+}
+
+// Buffers `chunk_rows` records column by column and writes them out as one chunk. A path
+// ending in .gz or .zst compresses the whole file, which ColumnarReader cannot map; it
+// has to be decompressed first.
+class ColumnarWriter {
+  public:
+    static constexpr size_t DEFAULT_CHUNK_ROWS = 16384;
+
+    template <typename Row>
+    ColumnarWriter(const std::string &path, const Row &prototype,
+                   size_t chunk_rows = DEFAULT_CHUNK_ROWS)
+        : specs_(column_specs(prototype)), chunk_rows_(chunk_rows),
+          columns_(specs_.size()), file_(path) {
+        for (size_t i = 0; i < specs_.size(); i++) {
+            columns_[i].resize(chunk_rows_ * specs_[i].width + COLUMNAR_ALIGNMENT);
+        }
+        write_header();
+    }
+
+    ColumnarWriter(const ColumnarWriter &) = delete;
+    ColumnarWriter &operator=(const ColumnarWriter &) = delete;
+
+    ~ColumnarWriter() {
+        if (!closed_) {
+            flush();
+        }
+    }
+
+    const std::vector<ColumnSpec> &columns() const { return specs_; }
+
+    template <typename Row>
+    inline void write_row(const Row &row) {
+        size_t column = 0;
+        row.visit([this, &column](const auto &value) {
+            using T = std::decay_t<decltype(value)>;
+            auto *dst = columns_[column].data() + rows_ * specs_[column].width;
+            if constexpr (std::is_same_v<T, MacAddress>) {
+                std::copy(value.begin(), value.end(), dst);
+            } else {
+                std::memcpy(dst, &value, sizeof(T));
+            }
+            column++;
+        });
+        if (++rows_ == chunk_rows_) {
+            flush();
+        }
+    }
+
+    // Writes the buffered rows as a chunk.
+    void flush() {
+        if (!rows_) {
+            return;
+        }
+        std::vector<char> chunk_header(COLUMNAR_ALIGNMENT, 0);
+        uint64_t rows = rows_;
+        std::memcpy(chunk_header.data(), &rows, sizeof(rows));
+        write(chunk_header.data(), chunk_header.size());
+
+        for (size_t i = 0; i < specs_.size(); i++) {
+            size_t size = rows_ * specs_[i].width;
+            size_t padded = size + columnar_padding(size);
+            std::fill(columns_[i].begin() + size, columns_[i].begin() + padded, 0);
+            write(reinterpret_cast<const char *>(columns_[i].data()), padded);
+        }
+        file_.flush();
+        rows_written_ += rows_;
+        rows_ = 0;
+    }
+
+    void close() {
+        if (!closed_) {
+            flush();
+            file_.close();
+            closed_ = true;
+        }
+    }
+
+    uint64_t rows_written() const { return rows_written_ + rows_; }
+
+    uint64_t bytes_written() const { return bytes_written_; }
+
+  private:
+    inline void write(const char *data, size_t size) {
+        file_.write(data, size);
+        bytes_written_ += size;
+    }
+
+    void write_header() {
+        std::vector<char> header(COLUMNAR_MAGIC, COLUMNAR_MAGIC + sizeof(COLUMNAR_MAGIC));
+        auto append = [&header](const auto &value) {
+            auto *bytes = reinterpret_cast<const char *>(&value);
+            header.insert(header.end(), bytes, bytes + sizeof(value));
+        };
+        append(COLUMNAR_VERSION);
+        append(static_cast<uint32_t>(specs_.size()));
+        for (const auto &spec : specs_) {
+            append(static_cast<uint8_t>(spec.type));
+            append(uint8_t{0});
+            append(spec.width);
+            append(static_cast<uint16_t>(spec.name.size()));
+            header.insert(header.end(), spec.name.begin(), spec.name.end());
+        }
+        header.resize(header.size() + columnar_padding(header.size()), 0);
+        write(header.data(), header.size());
+    }
+
+    std::vector<ColumnSpec> specs_;
+    size_t chunk_rows_;
+    size_t rows_{0};
+    uint64_t rows_written_{0};
+    uint64_t bytes_written_{0};
+    std::vector<std::vector<uint8_t>> columns_;
+    OutputFile file_;
+    bool closed_{false};
+};
+
+// Row-major counterpart of ColumnarWriter: records are packed one after another with
+// every field at a naturally aligned offset, which is the memory layout of a NumPy
+// structured array with the same fields.
+class RowBuffer {
+  public:
+    RowBuffer(const std::vector<ColumnSpec> &specs) : specs_(specs) {
+        size_t alignment = 1;
+        for (const auto &spec : specs_) {
+            size_t field_alignment = spec.type == ColumnType::BYTES ? 1 : spec.width;
+            itemsize_ += (field_alignment - itemsize_ % field_alignment) % field_alignment;
+            offsets_.push_back(itemsize_);
+            itemsize_ += spec.width;
+            alignment = std::max(alignment, field_alignment);
+        }
+        itemsize_ += (alignment - itemsize_ % alignment) % alignment;
+    }
+
+    template <typename Row>
+    inline void append(const Row &row) {
+        size_t start = data_.size();
+        data_.resize(start + itemsize_);
+        auto *record = data_.data() + start;
+        size_t column = 0;
+        row.visit([this, record, &column](const auto &value) {
+            using T = std::decay_t<decltype(value)>;
+            auto *dst = record + offsets_[column];
+            if constexpr (std::is_same_v<T, MacAddress>) {
+                std::copy(value.begin(), value.end(), dst);
+            } else {
+                std::memcpy(dst, &value, sizeof(T));
+            }
+            column++;
+        });
+        rows_++;
+    }
+
+    const std::vector<ColumnSpec> &columns() const { return specs_; }
+
+    const std::vector<size_t> &offsets() const { return offsets_; }
+
+    size_t itemsize() const { return itemsize_; }
+
+    size_t size() const { return rows_; }
+
+    uint8_t *data() { return data_.data(); }
+
+    void reserve(size_t rows) { data_.reserve(rows * itemsize_); }
+
+  private:
+    std::vector<ColumnSpec> specs_;
+    std::vector<size_t> offsets_;
+    size_t itemsize_{0};
+    size_t rows_{0};
+    std::vector<uint8_t> data_;
+};
+
+// Maps a columnar file and locates every column of every chunk. Nothing is copied; the
+// pointers stay valid while the reader is alive.
+class ColumnarReader {
+  public:
+    struct Chunk {
+        uint64_t rows;
+        std::vector<const uint8_t *> columns;
+    };
+
+    ColumnarReader(const std::string &path) : path_(path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Unable to open " + path + ": " +
+                                     std::strerror(errno));
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0 || st.st_size == 0) {
+            ::close(fd);
+            throw std::runtime_error(path + " is not a columnar flow file");
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        void *mapping = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED) {
+            throw std::runtime_error("Unable to map " + path + ": " +
+                                     std::strerror(errno));
+        }
+        base_ = static_cast<const uint8_t *>(mapping);
+        try {
+            parse();
+        } catch (...) {
+            munmap(const_cast<uint8_t *>(base_), size_);
+            throw;
+        }
+    }
+
+    ColumnarReader(const ColumnarReader &) = delete;
+    ColumnarReader &operator=(const ColumnarReader &) = delete;
+
+    ~ColumnarReader() { munmap(const_cast<uint8_t *>(base_), size_); }
+
+    const std::vector<ColumnSpec> &columns() const { return specs_; }
+
+    const std::vector<Chunk> &chunks() const { return chunks_; }
+
+    uint64_t rows() const { return rows_; }
+
+    // Index of the column called `name`, or columns().size() if there is none.
+    size_t find(const std::string &name) const {
+        for (size_t i = 0; i < specs_.size(); i++) {
+            if (specs_[i].name == name) {
+                return i;
+            }
+        }
+        return specs_.size();
+    }
+
+  private:
+    template <typename T>
+    T read(size_t &offset) const {
+        if (size_ - offset < sizeof(T)) {
+            throw std::runtime_error(path_ + " has a truncated header");
+        }
+        T value;
+        std::memcpy(&value, base_ + offset, sizeof(T));
+        offset += sizeof(T);
+        return value;
+    }
+
+    void parse() {
+        size_t offset = sizeof(COLUMNAR_MAGIC);
+        if (size_ < offset || std::memcmp(base_, COLUMNAR_MAGIC, offset)) {
+            throw std::runtime_error(path_ + " is not a columnar flow file");
+        }
+        if (read<uint32_t>(offset) != COLUMNAR_VERSION) {
+            throw std::runtime_error(path_ + " has an unsupported version or byte order");
+        }
+        auto count = read<uint32_t>(offset);
+        for (uint32_t i = 0; i < count; i++) {
+            ColumnSpec spec;
+            spec.type = static_cast<ColumnType>(read<uint8_t>(offset));
+            read<uint8_t>(offset);
+            spec.width = read<uint16_t>(offset);
+            auto length = read<uint16_t>(offset);
+            if (size_ - offset < length) {
+                throw std::runtime_error(path_ + " has a truncated header");
+            }
+            spec.name.assign(reinterpret_cast<const char *>(base_ + offset), length);
+            offset += length;
+            specs_.push_back(std::move(spec));
+        }
+        offset += columnar_padding(offset);
+
+        // A chunk cut short by an interrupted writer is ignored.
+        while (size_ > offset && size_ - offset >= COLUMNAR_ALIGNMENT) {
+            Chunk chunk;
+            std::memcpy(&chunk.rows, base_ + offset, sizeof(chunk.rows));
+            size_t position = offset + COLUMNAR_ALIGNMENT;
+            bool complete = true;
+            for (const auto &spec : specs_) {
+                size_t size = chunk.rows * spec.width;
+                size += columnar_padding(size);
+                if (size_ - position < size) {
+                    complete = false;
+                    break;
+                }
+                chunk.columns.push_back(base_ + position);
+                position += size;
+            }
+            if (!complete) {
+                break;
+            }
+            rows_ += chunk.rows;
+            chunks_.push_back(std::move(chunk));
+            offset = position;
+        }
+    }
+
+    std::string path_;
+    const uint8_t *base_{nullptr};
+    size_t size_{0};
+    std::vector<ColumnSpec> specs_;
+    std::vector<Chunk> chunks_;
+    uint64_t rows_{0};
+};
+
+} // end namespace Net
+
+#endif
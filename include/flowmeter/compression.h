@@ -0,0 +1,377 @@
+#ifndef FLOWMETER_COMPRESSION_H
+#define FLOWMETER_COMPRESSION_H
+
+// Each codec is compiled in only when the build found its library and set FLOWMETER_ZLIB
+// or FLOWMETER_ZSTD to non-zero.
+#ifndef FLOWMETER_ZLIB
+#define FLOWMETER_ZLIB 0
+#endif
+#ifndef FLOWMETER_ZSTD
+#define FLOWMETER_ZSTD 0
+#endif
+
+#if FLOWMETER_ZLIB
+#include <zlib.h>
+#endif
+#if FLOWMETER_ZSTD
+#include <zstd.h>
+#endif
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "flowmeter/block_queue.h"
+
+namespace Net {
+
+enum class Compression { NONE, GZIP, ZSTD };
+
+inline constexpr bool GZIP_ENABLED = FLOWMETER_ZLIB != 0;
+inline constexpr bool ZSTD_ENABLED = FLOWMETER_ZSTD != 0;
+
+inline const char *compression_name(Compression compression) {
+    return compression == Compression::GZIP ? "gzip"
+           : compression == Compression::ZSTD ? "zstd"
+                                              : "none";
+}
+
+// Compression of a file from its first bytes.
+inline Compression compression_of_data(const uint8_t *data, size_t size) {
+    if (size >= 2 && data[0] == 0x1F && data[1] == 0x8B) {
+        return Compression::GZIP;
+    }
+    if (size >= 4 && data[0] == 0x28 && data[1] == 0xB5 && data[2] == 0x2F &&
+        data[3] == 0xFD) {
+        return Compression::ZSTD;
+    }
+    return Compression::NONE;
+}
+
+// Compression an output file gets from its extension: .gz or .zst.
+inline Compression compression_of_path(std::string_view path) {
+    if (path.ends_with(".gz")) {
+        return Compression::GZIP;
+    }
+    if (path.ends_with(".zst")) {
+        return Compression::ZSTD;
+    }
+    return Compression::NONE;
+}
+
+inline void require_codec(Compression compression, const std::string &path) {
+    if ((compression == Compression::GZIP && !GZIP_ENABLED) ||
+        (compression == Compression::ZSTD && !ZSTD_ENABLED)) {
+        throw std::runtime_error(path + " needs " + compression_name(compression) +
+                                 ", which this build does not support");
+    }
+}
+
+// Streaming decompressor. Concatenated gzip members and zstd frames are read as one
+// stream.
+class Inflater {
+  public:
+    // Output grows by this much whenever the codec runs out of room.
+    static constexpr size_t OUTPUT_STEP = 256 << 10;
+
+    Inflater(Compression compression, const std::string &path)
+        : compression_(compression), path_(path) {
+        require_codec(compression_, path_);
+#if FLOWMETER_ZLIB
+        if (compression_ == Compression::GZIP) {
+            std::memset(&zlib_, 0, sizeof(zlib_));
+            // 32 lets zlib take either a gzip or a zlib header.
+            if (inflateInit2(&zlib_, MAX_WBITS + 32) != Z_OK) {
+                throw std::runtime_error("Unable to start decompressing " + path_);
+            }
+        }
+#endif
+#if FLOWMETER_ZSTD
+        if (compression_ == Compression::ZSTD) {
+            zstd_ = ZSTD_createDStream();
+            if (!zstd_) {
+                throw std::runtime_error("Unable to start decompressing " + path_);
+            }
+        }
+#endif
+    }
+
+    Inflater(const Inflater &) = delete;
+    Inflater &operator=(const Inflater &) = delete;
+
+    ~Inflater() {
+#if FLOWMETER_ZLIB
+        if (compression_ == Compression::GZIP) {
+            inflateEnd(&zlib_);
+        }
+#endif
+#if FLOWMETER_ZSTD
+        if (zstd_) {
+            ZSTD_freeDStream(zstd_);
+        }
+#endif
+    }
+
+    // Decompresses all of `data`, appending the result to `output`.
+    void inflate(const uint8_t *data, size_t size, std::vector<uint8_t> &output) {
+#if FLOWMETER_ZLIB
+        if (compression_ == Compression::GZIP) {
+            zlib_.next_in = const_cast<Bytef *>(data);
+            zlib_.avail_in = static_cast<uInt>(size);
+            do {
+                size_t used = output.size();
+                output.resize(used + OUTPUT_STEP);
+                zlib_.next_out = output.data() + used;
+                zlib_.avail_out = OUTPUT_STEP;
+                int status = ::inflate(&zlib_, Z_NO_FLUSH);
+                output.resize(used + OUTPUT_STEP - zlib_.avail_out);
+                if (status == Z_STREAM_END) {
+                    ended_ = true;
+                    inflateReset(&zlib_);
+                } else if (status == Z_OK) {
+                    ended_ = false;
+                } else if (status != Z_BUF_ERROR) {
+                    throw std::runtime_error(path_ + " is not a valid gzip stream: " +
+                                             (zlib_.msg ? zlib_.msg : "corrupt data"));
+                }
+            } while (zlib_.avail_in || !zlib_.avail_out);
+        }
+#endif
+#if FLOWMETER_ZSTD
+        if (compression_ == Compression::ZSTD) {
+            ZSTD_inBuffer in{data, size, 0};
+            ZSTD_outBuffer out;
+            do {
+                size_t used = output.size();
+                output.resize(used + OUTPUT_STEP);
+                out = ZSTD_outBuffer{output.data() + used, OUTPUT_STEP, 0};
+                size_t status = ZSTD_decompressStream(zstd_, &out, &in);
+                output.resize(used + out.pos);
+                if (ZSTD_isError(status)) {
+                    throw std::runtime_error(path_ + " is not a valid zstd stream: " +
+                                             ZSTD_getErrorName(status));
+                }
+                ended_ = status == 0;
+            } while (in.pos < in.size || out.pos == out.size);
+        }
+#endif
+        (void)data;
+        (void)size;
+        (void)output;
+    }
+
+    // Whether the input so far ends at the end of a gzip member or zstd frame.
+    bool ended() const { return ended_; }
+
+  private:
+    Compression compression_;
+    std::string path_;
+    bool ended_{true};
+#if FLOWMETER_ZLIB
+    z_stream zlib_;
+#endif
+#if FLOWMETER_ZSTD
+    ZSTD_DStream *zstd_{nullptr};
+#endif
+};
+
+// Streaming compressor for output files. gzip runs at its fastest level so that the
+// writer thread keeps up with metering; zstd's default level is faster than that already.
+class Deflater {
+  public:
+    static constexpr size_t OUTPUT_STEP = 256 << 10;
+
+    Deflater(Compression compression, const std::string &path)
+        : compression_(compression), path_(path) {
+        require_codec(compression_, path_);
+#if FLOWMETER_ZLIB
+        if (compression_ == Compression::GZIP) {
+            std::memset(&zlib_, 0, sizeof(zlib_));
+            // 16 asks for a gzip header and trailer instead of zlib's.
+            if (deflateInit2(&zlib_, Z_BEST_SPEED, Z_DEFLATED, MAX_WBITS + 16, 8,
+                             Z_DEFAULT_STRATEGY) != Z_OK) {
+                throw std::runtime_error("Unable to start compressing " + path_);
+            }
+        }
+#endif
+#if FLOWMETER_ZSTD
+        if (compression_ == Compression::ZSTD) {
+            zstd_ = ZSTD_createCStream();
+            if (!zstd_) {
+                throw std::runtime_error("Unable to start compressing " + path_);
+            }
+        }
+#endif
+    }
+
+    Deflater(const Deflater &) = delete;
+    Deflater &operator=(const Deflater &) = delete;
+
+    ~Deflater() {
+#if FLOWMETER_ZLIB
+        if (compression_ == Compression::GZIP) {
+            deflateEnd(&zlib_);
+        }
+#endif
+#if FLOWMETER_ZSTD
+        if (zstd_) {
+            ZSTD_freeCStream(zstd_);
+        }
+#endif
+    }
+
+    // Compresses all of `data`, replacing the contents of `output` with whatever the
+    // codec has ready. `finish` ends the stream, flushing everything out.
+    void deflate(const char *data, size_t size, std::vector<char> &output, bool finish) {
+        output.clear();
+#if FLOWMETER_ZLIB
+        if (compression_ == Compression::GZIP) {
+            zlib_.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+            zlib_.avail_in = static_cast<uInt>(size);
+            do {
+                size_t used = output.size();
+                output.resize(used + OUTPUT_STEP);
+                zlib_.next_out = reinterpret_cast<Bytef *>(output.data() + used);
+                zlib_.avail_out = OUTPUT_STEP;
+                int status = ::deflate(&zlib_, finish ? Z_FINISH : Z_NO_FLUSH);
+                output.resize(used + OUTPUT_STEP - zlib_.avail_out);
+                if (status == Z_STREAM_ERROR) {
+                    throw std::runtime_error("Unable to compress " + path_);
+                }
+            } while (!zlib_.avail_out);
+        }
+#endif
+#if FLOWMETER_ZSTD
+        if (compression_ == Compression::ZSTD) {
+            ZSTD_inBuffer in{data, size, 0};
+            size_t remaining = 0;
+            do {
+                size_t used = output.size();
+                output.resize(used + OUTPUT_STEP);
+                ZSTD_outBuffer out{output.data() + used, OUTPUT_STEP, 0};
+                remaining = ZSTD_compressStream2(zstd_, &out, &in,
+                                                 finish ? ZSTD_e_end : ZSTD_e_continue);
+                output.resize(used + out.pos);
+                if (ZSTD_isError(remaining)) {
+                    throw std::runtime_error("Unable to compress " + path_ + ": " +
+                                             ZSTD_getErrorName(remaining));
+                }
+            } while (in.pos < in.size || (finish && remaining));
+        }
+#endif
+        (void)data;
+        (void)size;
+        (void)finish;
+    }
+
+  private:
+    Compression compression_;
+    std::string path_;
+#if FLOWMETER_ZLIB
+    z_stream zlib_;
+#endif
+#if FLOWMETER_ZSTD
+    ZSTD_CStream *zstd_{nullptr};
+#endif
+};
+
+// Decompresses a file on a background thread, a chunk at a time, into a bounded queue
+// that the reading thread drains with next().
+class DecompressThread {
+  public:
+    static constexpr size_t READ_SIZE = 1 << 20;
+    // Decompressed bytes per chunk handed over, and chunks queued at most.
+    static constexpr size_t CHUNK_SIZE = 4 << 20;
+    static constexpr size_t QUEUE_CHUNKS = 4;
+
+    DecompressThread(const std::string &path, Compression compression)
+        : path_(path), inflater_(compression, path), chunks_(QUEUE_CHUNKS) {
+        fd_ = open(path.c_str(), O_RDONLY);
+        if (fd_ < 0) {
+            throw std::runtime_error("Unable to open " + path + ": " +
+                                     std::strerror(errno));
+        }
+        posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+        thread_ = std::thread([this]() { run(); });
+    }
+
+    DecompressThread(const DecompressThread &) = delete;
+    DecompressThread &operator=(const DecompressThread &) = delete;
+
+    ~DecompressThread() {
+        // Stops the thread early if the reader is abandoned before the end.
+        chunks_.close();
+        thread_.join();
+        ::close(fd_);
+    }
+
+    // Replaces `chunk` with the next decompressed bytes; false at the end of the file.
+    // Rethrows a read or decompression error.
+    bool next(std::vector<uint8_t> &chunk) {
+        if (chunks_.pop(chunk)) {
+            return true;
+        }
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+        return false;
+    }
+
+  private:
+    std::string path_;
+    int fd_{-1};
+    Inflater inflater_;
+    BlockQueue<std::vector<uint8_t>> chunks_;
+    std::exception_ptr error_;
+    std::thread thread_;
+
+    void run() {
+        try {
+            std::vector<uint8_t> input(READ_SIZE);
+            std::vector<uint8_t> chunk;
+            chunk.reserve(CHUNK_SIZE + Inflater::OUTPUT_STEP);
+            while (true) {
+                auto got = ::read(fd_, input.data(), input.size());
+                if (got < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::runtime_error("Unable to read " + path_ + ": " +
+                                             std::strerror(errno));
+                }
+                if (!got) {
+                    break;
+                }
+                inflater_.inflate(input.data(), static_cast<size_t>(got), chunk);
+                if (chunk.size() >= CHUNK_SIZE) {
+                    if (!chunks_.push(std::move(chunk))) {
+                        return;
+                    }
+                    chunk = std::vector<uint8_t>();
+                    chunk.reserve(CHUNK_SIZE + Inflater::OUTPUT_STEP);
+                }
+            }
+            if (!inflater_.ended()) {
+                throw std::runtime_error(path_ + " ends in the middle of a compressed "
+                                                 "stream");
+            }
+            if (!chunk.empty()) {
+                chunks_.push(std::move(chunk));
+            }
+        } catch (...) {
+            error_ = std::current_exception();
+        }
+        chunks_.close();
+    }
+};
+
+} // end namespace Net
+
+#endif
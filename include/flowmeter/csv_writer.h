@@ -0,0 +1,214 @@
+#ifndef FLOWMETER_CSV_WRITER_H
+#define FLOWMETER_CSV_WRITER_H
+
+#include "fmt/format.h"
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "flowmeter/block_queue.h"
+#include "flowmeter/compression.h"
+
+namespace Net {
+
+// Writes all of `data` to `fd`, retrying short and interrupted writes.
+inline void write_fully(int fd, const char *data, size_t size, const std::string &path) {
+    while (size) {
+        auto written = ::write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("Unable to write " + path + ": " +
+                                     std::strerror(errno));
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
+    }
+}
+
+// Output file written by a background thread, so that the thread producing the output
+// never waits for the disk or the compressor. Writes are gathered into blocks of
+// BLOCK_SIZE bytes, which queue up to QUEUE_BLOCKS deep before write() blocks. A path
+// ending in .gz or .zst is compressed with gzip or zstd.
+class OutputFile {
+  public:
+    static constexpr size_t BLOCK_SIZE = 1 << 20;
+    static constexpr size_t QUEUE_BLOCKS = 8;
+
+    OutputFile(const std::string &path)
+        : path_(path), compression_(compression_of_path(path)),
+          deflater_(compression_, path), blocks_(QUEUE_BLOCKS) {
+        fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd_ < 0) {
+            throw std::runtime_error("Unable to open " + path + ": " +
+                                     std::strerror(errno));
+        }
+        thread_ = std::thread([this]() { run(); });
+    }
+
+    OutputFile(const OutputFile &) = delete;
+    OutputFile &operator=(const OutputFile &) = delete;
+
+    // Writes out whatever is left; errors are only reported by close().
+    ~OutputFile() {
+        if (fd_ >= 0) {
+            finish();
+        }
+    }
+
+    inline void write(const char *data, size_t size) {
+        block_.insert(block_.end(), data, data + size);
+        if (block_.size() >= BLOCK_SIZE) {
+            flush();
+        }
+    }
+
+    // Hands the data written so far to the writer thread.
+    void flush() {
+        if (block_.empty()) {
+            return;
+        }
+        if (!blocks_.push(std::move(block_))) {
+            finish();
+            std::rethrow_exception(error_);
+        }
+        block_ = std::vector<char>();
+        block_.reserve(BLOCK_SIZE);
+    }
+
+    // Waits for everything to reach the file, rethrowing a write or compression error.
+    void close() {
+        if (fd_ < 0) {
+            return;
+        }
+        flush();
+        finish();
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+    }
+
+  private:
+    std::string path_;
+    Compression compression_;
+    Deflater deflater_;
+    int fd_{-1};
+    std::vector<char> block_;
+    BlockQueue<std::vector<char>> blocks_;
+    std::exception_ptr error_;
+    std::thread thread_;
+
+    void finish() {
+        if (!block_.empty()) {
+            blocks_.push(std::move(block_));
+            block_.clear();
+        }
+        blocks_.close();
+        thread_.join();
+        ::close(fd_);
+        fd_ = -1;
+    }
+
+    void run() {
+        try {
+            std::vector<char> block;
+            std::vector<char> compressed;
+            while (blocks_.pop(block)) {
+                if (compression_ == Compression::NONE) {
+                    write_fully(fd_, block.data(), block.size(), path_);
+                    continue;
+                }
+                deflater_.deflate(block.data(), block.size(), compressed, false);
+                write_fully(fd_, compressed.data(), compressed.size(), path_);
+            }
+            if (compression_ != Compression::NONE) {
+                deflater_.deflate(nullptr, 0, compressed, true);
+                write_fully(fd_, compressed.data(), compressed.size(), path_);
+            }
+        } catch (...) {
+            error_ = std::current_exception();
+            // Makes the next flush() fail instead of waiting for room.
+            blocks_.close();
+        }
+    }
+};
+
+// Buffered CSV output. Rows are formatted straight into one reusable buffer and handed
+// to an OutputFile whenever the buffer passes `flush_size`, so formatting allocates
+// nothing and the writing and any compression happen on the file's own thread.
+class CsvWriter {
+  public:
+    static constexpr size_t DEFAULT_FLUSH_SIZE = 1 << 20;
+
+    CsvWriter(const std::string &path, size_t flush_size = DEFAULT_FLUSH_SIZE)
+        : file_(path), flush_size_(flush_size) {
+        // Leave headroom for the row that crosses the threshold.
+        buffer_.reserve(flush_size_ + flush_size_ / 4);
+    }
+
+    CsvWriter(const CsvWriter &) = delete;
+    CsvWriter &operator=(const CsvWriter &) = delete;
+
+    ~CsvWriter() {
+        if (!closed_) {
+            file_.write(buffer_.data(), buffer_.size());
+        }
+    }
+
+    inline void write_line(std::string_view line) {
+        buffer_.append(line);
+        buffer_.push_back('\n');
+        maybe_flush();
+    }
+
+    // Appends `row.format_to(...)` followed by a line break.
+    template <typename Row>
+    inline void write_row(const Row &row) {
+        row.format_to(std::back_inserter(buffer_));
+        buffer_.push_back('\n');
+        maybe_flush();
+    }
+
+    void flush() {
+        file_.write(buffer_.data(), buffer_.size());
+        file_.flush();
+        bytes_written_ += buffer_.size();
+        buffer_.clear();
+    }
+
+    void close() {
+        if (!closed_) {
+            flush();
+            file_.close();
+            closed_ = true;
+        }
+    }
+
+    uint64_t bytes_written() const { return bytes_written_; }
+
+  private:
+    inline void maybe_flush() {
+        if (buffer_.size() >= flush_size_) {
+            flush();
+        }
+    }
+
+    OutputFile file_;
+    bool closed_{false};
+    size_t flush_size_;
+    uint64_t bytes_written_{0};
+    fmt::memory_buffer buffer_;
+};
+
+} // end namespace Net
+
+#endif
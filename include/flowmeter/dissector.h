@@ -0,0 +1,252 @@
+#ifndef FLOWMETER_DISSECTOR_H
+#define FLOWMETER_DISSECTOR_H
+
+#include "tins/ethernetII.h"
+#include "tins/exceptions.h"
+#include "tins/pdu.h"
+#include "tins/tcp.h"
+#include <cstdint>
+#include <cstring>
+
+#include "flowmeter/service.h"
+
+namespace Net {
+
+// pcap link-layer header types handled by the fast path. DLT_RAW is reported as 12 by
+// most libpcap builds and as 14 by OpenBSD; both are accepted.
+enum LinkType : uint32_t {
+    LINKTYPE_ETHERNET = 1,
+    LINKTYPE_DLT_RAW = 12,
+    LINKTYPE_DLT_RAW_OPENBSD = 14,
+    LINKTYPE_RAW = 101,
+    LINKTYPE_LINUX_SLL = 113,
+    LINKTYPE_IPV4 = 228,
+    LINKTYPE_IPV6 = 229
+};
+
+// A captured frame as handed out by a packet source. The bytes are borrowed from the
+// source and only valid until the next read. `interface` indexes the source's capture
+// interfaces, which may differ in link type.
+struct RawPacket {
+    const uint8_t *data{nullptr};
+    uint32_t caplen{0};
+    uint32_t len{0};
+    double timestamp{0};
+    uint32_t interface{0};
+};
+
+// Everything the flow table needs from a packet, filled in without leaving the stack.
+struct PacketDescriptor {
+    ServicePair pair;
+    const uint8_t *data{nullptr};
+    uint32_t size{0};
+    double timestamp{0};
+    uint16_t l3_offset{0};
+    uint16_t l4_offset{0};
+    uint8_t tcp_flags{0};
+};
+
+class Dissector {
+  public:
+    static constexpr uint16_t ETHERTYPE_IPV4 = 0x0800;
+    static constexpr uint16_t ETHERTYPE_IPV6 = 0x86DD;
+    static constexpr uint16_t ETHERTYPE_VLAN = 0x8100;
+    static constexpr uint16_t ETHERTYPE_QINQ = 0x88A8;
+    static constexpr uint16_t ETHERNET_HEADER_SIZE = 14;
+    static constexpr uint16_t VLAN_TAG_SIZE = 4;
+    static constexpr uint16_t SLL_HEADER_SIZE = 16;
+    static constexpr uint16_t IPV4_MIN_HEADER_SIZE = 20;
+    static constexpr uint16_t IPV6_HEADER_SIZE = 40;
+    static constexpr uint16_t TCP_MIN_HEADER_SIZE = 20;
+    static constexpr uint16_t UDP_HEADER_SIZE = 8;
+    static constexpr uint32_t MAX_VLAN_TAGS = 2;
+
+    enum Result { ACCEPT, SKIP, FALLBACK };
+
+    Dissector(uint32_t link_type) : link_type_(link_type) {}
+
+    // Fills `desc` from `raw`. Returns false when the frame does not carry a TCP or UDP
+    // flow. Frames the fast path cannot decode are handed to libtins.
+    inline bool dissect(const RawPacket &raw, PacketDescriptor &desc) {
+        desc.pair.reset();
+        desc.data = raw.data;
+        desc.size = raw.caplen;
+        desc.timestamp = raw.timestamp;
+        desc.tcp_flags = 0;
+
+        auto result = fast_path(raw, desc);
+        if (result == FALLBACK) {
+            fallback_count_++;
+            return slow_path(raw, desc);
+        }
+        return result == ACCEPT;
+    }
+
+    uint32_t link_type() const { return link_type_; }
+
+    uint64_t fallback_count() const { return fallback_count_; }
+
+  private:
+    uint32_t link_type_;
+    uint64_t fallback_count_{0};
+
+    static inline uint16_t load_be16(const uint8_t *ptr) {
+        return static_cast<uint16_t>((ptr[0] << 8) | ptr[1]);
+    }
+
+    static inline bool is_ipv6_extension(uint8_t next_header) {
+        switch (next_header) {
+        case 0:   // hop-by-hop options
+        case 43:  // routing
+        case 44:  // fragment
+        case 60:  // destination options
+        case 135: // mobility
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    inline Result fast_path(const RawPacket &raw, PacketDescriptor &desc) const {
+        const uint8_t *data = raw.data;
+        const uint32_t caplen = raw.caplen;
+        uint32_t offset = 0;
+        uint16_t ether_type = 0;
+
+        switch (link_type_) {
+        case LINKTYPE_ETHERNET: {
+            if (caplen < ETHERNET_HEADER_SIZE) {
+                return SKIP;
+            }
+            desc.pair.dst_service.mac_addr = MacAddress(data);
+            desc.pair.src_service.mac_addr = MacAddress(data + 6);
+            ether_type = load_be16(data + 12);
+            offset = ETHERNET_HEADER_SIZE;
+
+            uint32_t tags = 0;
+            while (ether_type == ETHERTYPE_VLAN || ether_type == ETHERTYPE_QINQ) {
+                if (++tags > MAX_VLAN_TAGS || caplen < offset + VLAN_TAG_SIZE) {
+                    return FALLBACK;
+                }
+                if (tags == 1) {
+                    desc.pair.vlan_id = load_be16(data + offset) & 0x0FFF;
+                }
+                ether_type = load_be16(data + offset + 2);
+                offset += VLAN_TAG_SIZE;
+            }
+            break;
+        }
+        case LINKTYPE_LINUX_SLL: {
+            if (caplen < SLL_HEADER_SIZE) {
+                return SKIP;
+            }
+            auto addr_len = load_be16(data + 4);
+            if (addr_len == MacAddress::address_size) {
+                desc.pair.src_service.mac_addr = MacAddress(data + 6);
+            }
+            ether_type = load_be16(data + 14);
+            offset = SLL_HEADER_SIZE;
+            break;
+        }
+        case LINKTYPE_DLT_RAW:
+        case LINKTYPE_DLT_RAW_OPENBSD:
+        case LINKTYPE_RAW:
+        case LINKTYPE_IPV4:
+        case LINKTYPE_IPV6:
+            if (!caplen) {
+                return SKIP;
+            }
+            ether_type = (data[0] >> 4) == 6 ? ETHERTYPE_IPV6 : ETHERTYPE_IPV4;
+            break;
+        default:
+            return FALLBACK;
+        }
+
+        desc.l3_offset = static_cast<uint16_t>(offset);
+        uint8_t protocol = 0;
+
+        if (ether_type == ETHERTYPE_IPV4) {
+            if (caplen < offset + IPV4_MIN_HEADER_SIZE || (data[offset] >> 4) != 4) {
+                return SKIP;
+            }
+            uint32_t header_size = (data[offset] & 0x0F) * 4u;
+            if (header_size < IPV4_MIN_HEADER_SIZE) {
+                return SKIP;
+            }
+            // Every fragment is skipped, the first one included, since libtins leaves
+            // a fragmented datagram's payload as a RawPDU and never meters it either;
+            // the mask covers MF on purpose.
+            if (load_be16(data + offset + 6) & 0x3FFF) {
+                return SKIP;
+            }
+            protocol = data[offset + 9];
+            std::memcpy(desc.pair.src_service.ip_addr.data(), data + offset + 12, 4);
+            std::memcpy(desc.pair.dst_service.ip_addr.data(), data + offset + 16, 4);
+            desc.pair.ip_version = ServicePair::IPv4;
+            offset += header_size;
+        } else if (ether_type == ETHERTYPE_IPV6) {
+            if (caplen < offset + IPV6_HEADER_SIZE || (data[offset] >> 4) != 6) {
+                return SKIP;
+            }
+            protocol = data[offset + 6];
+            std::memcpy(desc.pair.src_service.ip_addr.data(), data + offset + 8,
+                        ADDR_SIZE);
+            std::memcpy(desc.pair.dst_service.ip_addr.data(), data + offset + 24,
+                        ADDR_SIZE);
+            desc.pair.ip_version = ServicePair::IPv6;
+            offset += IPV6_HEADER_SIZE;
+        } else {
+            return SKIP;
+        }
+
+        desc.l4_offset = static_cast<uint16_t>(offset);
+
+        if (protocol == Tins::Constants::IP::e::PROTO_TCP) {
+            if (caplen < offset + TCP_MIN_HEADER_SIZE) {
+                return SKIP;
+            }
+            desc.tcp_flags = data[offset + 13];
+        } else if (protocol == Tins::Constants::IP::e::PROTO_UDP) {
+            if (caplen < offset + UDP_HEADER_SIZE) {
+                return SKIP;
+            }
+        } else if (desc.pair.ip_version == ServicePair::IPv6 &&
+                   is_ipv6_extension(protocol)) {
+            // Extension header chains are rare enough to leave to libtins.
+            return FALLBACK;
+        } else {
+            return SKIP;
+        }
+
+        desc.pair.src_service.port = load_be16(data + offset);
+        desc.pair.dst_service.port = load_be16(data + offset + 2);
+        desc.pair.transport_proto = protocol;
+        return ACCEPT;
+    }
+
+    inline bool slow_path(const RawPacket &raw, PacketDescriptor &desc) const {
+        desc.pair.reset();
+        if (link_type_ != LINKTYPE_ETHERNET) {
+            return false;
+        }
+
+        try {
+            Tins::EthernetII eth_pdu(raw.data, raw.caplen);
+            desc.pair = ServicePair(eth_pdu);
+            if (!desc.pair) {
+                return false;
+            }
+            if (auto *tcp_pdu_ptr = eth_pdu.find_pdu<Tins::TCP>()) {
+                desc.tcp_flags = static_cast<uint8_t>(tcp_pdu_ptr->flags() & 0xFF);
+            }
+        } catch (Tins::malformed_packet &) {
+            desc.pair.reset();
+            return false;
+        }
+        return true;
+    }
+};
+
+} // end namespace Net
+
+#endif
@@ -0,0 +1,158 @@
+#ifndef FLOWMETER_DISTINCT_SKETCH_H
+#define FLOWMETER_DISTINCT_SKETCH_H
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+
+// Number of keys a host keeps per peer or port set, overridable at build time.
+#ifndef FLOWMETER_HOST_SAMPLE
+#define FLOWMETER_HOST_SAMPLE 32
+#endif
+
+namespace Net {
+
+// Seed-free 64-bit mixer (the splitmix64 finalizer), for hashing small keys into a
+// DistinctSketch the same way on every run.
+constexpr uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// HyperLogLog over 2^P one-byte registers; counts distinct 64-bit hashes to within
+// about 1.04 / sqrt(2^P).
+template <uint32_t P = 8>
+struct HyperLogLog {
+    static_assert(P >= 4 && P <= 16, "HyperLogLog needs between 2^4 and 2^16 registers");
+    static constexpr uint32_t M = 1U << P;
+
+    std::array<uint8_t, M> registers{};
+
+    inline void clear() { registers = {}; }
+
+    inline void add(uint64_t hash) {
+        auto &reg = registers[hash >> (64 - P)];
+        // The marker bit caps the rank once the remaining bits run out.
+        auto rest = (hash << P) | (1ULL << (P - 1));
+        reg = std::max(reg, static_cast<uint8_t>(std::countl_zero(rest) + 1));
+    }
+
+    double estimate() const {
+        constexpr double alpha = 0.7213 / (1 + 1.079 / M);
+        double sum = 0;
+        uint32_t zeros = 0;
+        for (auto reg : registers) {
+            sum += std::ldexp(1.0, -reg);
+            zeros += reg == 0;
+        }
+        double estimate = alpha * M * M / sum;
+        // Linear counting is more accurate while many registers are still empty.
+        if (estimate <= 2.5 * M && zeros) {
+            return M * std::log(static_cast<double>(M) / zeros);
+        }
+        return estimate;
+    }
+};
+
+// Bounded set of keys with occurrence counts. Keys are identified by a 64-bit hash and
+// kept in a small vector sorted by it. Up to `K` distinct keys everything is exact.
+// Past that only the `K` smallest hashes are kept, a uniform sample of the distinct
+// keys, and their number is estimated by a HyperLogLog. Plain data of fixed size, so a
+// scanner that touches millions of peers costs no more than a host with `K` of them.
+template <typename T, uint32_t K = FLOWMETER_HOST_SAMPLE>
+struct DistinctSketch {
+    static_assert(K >= 3, "A distinct sketch needs at least three keys");
+
+    struct Entry {
+        uint64_t hash;
+        T value;
+        uint32_t count;
+    };
+
+    std::array<Entry, K> entries;
+    uint32_t size = 0;
+    // Whether a key was ever left out, which turns the entries into a sample.
+    bool sampled = false;
+    // Occurrences of every key, sampled or not.
+    uint64_t total = 0;
+    HyperLogLog<> counter;
+
+    inline void clear() {
+        size = 0;
+        sampled = false;
+        total = 0;
+        counter.clear();
+    }
+
+    inline void add(uint64_t hash, const T &value, uint32_t n = 1) {
+        total += n;
+        counter.add(hash);
+        auto *end = entries.data() + size;
+        auto *it = std::lower_bound(entries.data(), end, hash,
+                                    [](const Entry &entry, uint64_t key) {
+                                        return entry.hash < key;
+                                    });
+        if (it != end && it->hash == hash) {
+            it->count += n;
+            return;
+        }
+        if (size == K) {
+            sampled = true;
+            if (it == end) {
+                return;
+            }
+            // Make room by dropping the largest hash.
+            end--;
+        } else {
+            size++;
+        }
+        std::move_backward(it, end, end + 1);
+        *it = Entry{hash, value, n};
+    }
+
+    inline const Entry *find(uint64_t hash) const {
+        auto *end = entries.data() + size;
+        auto *it = std::lower_bound(entries.data(), end, hash,
+                                    [](const Entry &entry, uint64_t key) {
+                                        return entry.hash < key;
+                                    });
+        return it != end && it->hash == hash ? it : nullptr;
+    }
+
+    const Entry *begin() const { return entries.data(); }
+
+    const Entry *end() const { return entries.data() + size; }
+
+    // Number of distinct keys added; exact until the sketch starts sampling.
+    double distinct() const {
+        if (!sampled) {
+            return size;
+        }
+        return std::max<double>(counter.estimate(), K + 1);
+    }
+
+    // Shannon entropy in bits of the key distribution. Each sampled key stands in for
+    // distinct() / size keys with the same share, which is exact without sampling.
+    double entropy() const {
+        if (!total) {
+            return 0;
+        }
+        double weight = size ? distinct() / size : 0;
+        double entropy = 0;
+        for (const auto &entry : *this) {
+            double share = static_cast<double>(entry.count) / static_cast<double>(total);
+            entropy -= weight * share * std::log2(share);
+        }
+        return entropy;
+    }
+};
+
+} // end namespace Net
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef FLOWMETER_FEATURES_H
+#define FLOWMETER_FEATURES_H
+
+#include <array>
+#include <cstdint>
+
+#include "flowmeter/byte_stats.h"
+#include "flowmeter/dissector.h"
+
+namespace Net {
+
+// Per-packet values shared by every Flow a packet updates. Built once per packet so
+// the frame bytes are only walked a single time no matter how many directions consume
+// the result.
+struct PacketFeatures {
+    double timestamp{0};
+    double entropy{0};
+    uint32_t size{0};
+    uint32_t bit_count{0};
+    std::array<uint32_t, BYTE_CLASS_COUNT> byte_classes{};
+    uint8_t tcp_flags{0};
+
+    PacketFeatures() = default;
+
+    // Without `payload` the packet bytes are not read and the byte statistics stay
+    // zero, for records that do not use them.
+    explicit PacketFeatures(const PacketDescriptor &packet, bool payload = true)
+        : timestamp(packet.timestamp), size(packet.size), tcp_flags(packet.tcp_flags) {
+        if (!payload) {
+            return;
+        }
+        auto stats = byte_stats(packet.data, size);
+        bit_count = static_cast<uint32_t>(stats.bit_count);
+        byte_classes = stats.byte_classes;
+
+        // Gini impurity of the bit distribution.
+        double one_prob = static_cast<double>(bit_count) / (size * 8.0);
+        double zero_prob = 1 - one_prob;
+        entropy = 1.0 - ((one_prob * one_prob) + (zero_prob * zero_prob));
+    }
+};
+
+} // end namespace Net
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef FLOWMETER_FLOW_H
 #define FLOWMETER_FLOW_H
 
+#include "fmt/format.h"
 #include "tins/hw_address.h"
 #include "tins/ip.h"
 #include "tins/ip_address.h"
@@ -9,16 +10,20 @@
 #include "tins/packet.h"
 #include "tins/tcp.h"
 #include "tins/udp.h"
+#include <algorithm>
+#include <array>
 #include <bit>
 #include <cstdint>
-#include <iomanip>
+#include <iterator>
 #include <limits>
-#include <sstream>
+#include <string>
 #include <string_view>
+#include <type_traits>
 
+#include "flowmeter/features.h"
+#include "flowmeter/quantile_sketch.h"
 #include "flowmeter/service.h"
 #include "flowmeter/statistic.h"
-#include "flowmeter/utils.h"
 
 namespace Net {
 
@@ -31,21 +36,94 @@ enum ExpirationCode {
     USER_SPECIFIED
 };
 
-struct Flow {
-    const Tins::Constants::IP::e transport_proto{};
-    std::string direction{"DEFAULT"};
-    double first_seen_ms = std::numeric_limits<double>::max();
-    double last_seen_ms = std::numeric_limits<double>::min();
-    double duration_ms = 0;
-    uint64_t pkt_count = 0;
-    uint64_t byte_count = 0;
-    Statistic<uint64_t> packet_size{direction, "ps"};   // packet size
-    Statistic<double> packet_iat{direction, "piat"};    // packet inter-arrival time
-    Statistic<double> packet_entropy{direction, "ent"}; // packet entropy
+// Optional per-direction features, combined into the `Features` bitmask of BasicFlow.
+// Timestamps and packet and byte counts are always kept since expiration needs them.
+enum Feature : uint32_t {
+    PACKET_SIZE = 1 << 0,
+    PACKET_IAT = 1 << 1,
+    PACKET_ENTROPY = 1 << 2,
+    BYTE_CLASSES = 1 << 3,
+    TCP_FLAGS = 1 << 4,
+    PACKET_SIZE_QUANTILES = 1 << 5,
+    PACKET_IAT_QUANTILES = 1 << 6,
+};
+
+// Features of the default record. The quantile sketches cost several hundred bytes per
+// direction, so they are only kept when asked for.
+inline constexpr uint32_t DEFAULT_FEATURES =
+    PACKET_SIZE | PACKET_IAT | PACKET_ENTROPY | BYTE_CLASSES | TCP_FLAGS;
+inline constexpr uint32_t QUANTILE_FEATURES = PACKET_SIZE_QUANTILES | PACKET_IAT_QUANTILES;
+inline constexpr uint32_t ALL_FEATURES = DEFAULT_FEATURES | QUANTILE_FEATURES;
+// Features computed from the packet bytes rather than from the headers.
+inline constexpr uint32_t PAYLOAD_FEATURES = PACKET_ENTROPY | BYTE_CLASSES;
+
+constexpr bool has_feature(uint32_t features, uint32_t feature) {
+    return (features & feature) != 0;
+}
+
+// Placeholder for the members of a disabled feature; occupies no space.
+template <uint32_t F>
+struct Disabled {};
+
+template <uint32_t Features, uint32_t F, typename T>
+using FeatureMember = std::conditional_t<has_feature(Features, F), T, Disabled<F>>;
+
+template <size_t... N>
+constexpr auto concat_columns(const std::array<std::string_view, N> &...parts) {
+    std::array<std::string_view, (N + ... + 0)> columns{};
+    size_t i = 0;
+    ((std::copy(parts.begin(), parts.end(), columns.begin() + i), i += N), ...);
+    return columns;
+}
+
+template <bool Enabled, size_t N>
+constexpr auto columns_if(const std::array<std::string_view, N> &columns) {
+    if constexpr (Enabled) {
+        return columns;
+    } else {
+        return std::array<std::string_view, 0>{};
+    }
+}
+
+// Quantile sketch of one per-packet feature. Its columns are the sketch's quantile
+// names followed by the feature suffix of the matching Statistic, e.g. "p50_ps".
+using FeatureQuantiles = QuantileSketch<>;
+
+template <size_t N>
+constexpr auto quantile_columns(const std::array<std::string_view, N> &names) {
+    static_assert(N == FeatureQuantiles::COLUMNS.size());
+    return names;
+}
+
+struct ByteClassCounts {
     uint64_t null_byte_count = 0;
     uint64_t low_byte_count = 0;
     uint64_t char_byte_count = 0;
     uint64_t high_byte_count = 0;
+
+    inline void update(const PacketFeatures &packet) {
+        null_byte_count += packet.byte_classes[NULL_BYTE];
+        low_byte_count += packet.byte_classes[LOW_BYTE];
+        char_byte_count += packet.byte_classes[CHAR_BYTE];
+        high_byte_count += packet.byte_classes[HIGH_BYTE];
+    }
+
+    template <typename F>
+    void visit(F &&f) const {
+        f(null_byte_count);
+        f(low_byte_count);
+        f(char_byte_count);
+        f(high_byte_count);
+    }
+
+    template <typename OutputIt>
+    OutputIt format_to(OutputIt out) const {
+        return fmt::format_to(out, "{},{},{},{}", null_byte_count, low_byte_count,
+                              char_byte_count, high_byte_count);
+    }
+};
+
+struct TcpFlagCounts {
     uint64_t syn_count = 0;
     uint64_t cwr_count = 0;
     uint64_t ece_count = 0;
@@ -55,117 +133,261 @@ struct Flow {
     uint64_t rst_count = 0;
     uint64_t fin_count = 0;
 
-    inline void reset() {
-        first_seen_ms = std::numeric_limits<double>::max();
-        last_seen_ms = std::numeric_limits<double>::min();
-        duration_ms = 0;
-        pkt_count = 0;
-        byte_count = 0;
-        packet_size.reset();    // packet size
-        packet_iat.reset();     // packet inter-arrival time
-        packet_entropy.reset(); // packet entropy
-        syn_count = 0;
-        cwr_count = 0;
-        ece_count = 0;
-        urg_count = 0;
-        ack_count = 0;
-        psh_count = 0;
-        rst_count = 0;
-        fin_count = 0;
-    }
-
-    Flow(const std::string direction_str, const Tins::Constants::IP::e transport_protocol)
-        : direction(direction_str), transport_proto(transport_protocol) {}
-
-    Flow(const Flow &flow) = default;
-
-    inline void update(Tins::Packet &packet, const double pkt_timestamp) {
-        if (!pkt_count) {
-            first_seen_ms = pkt_timestamp;
-        }
+    inline void update(uint8_t flags) {
+        syn_count += (flags & Tins::TCP::SYN) != 0;
+        cwr_count += (flags & Tins::TCP::CWR) != 0;
+        ece_count += (flags & Tins::TCP::ECE) != 0;
+        urg_count += (flags & Tins::TCP::URG) != 0;
+        ack_count += (flags & Tins::TCP::ACK) != 0;
+        psh_count += (flags & Tins::TCP::PSH) != 0;
+        rst_count += (flags & Tins::TCP::RST) != 0;
+        fin_count += (flags & Tins::TCP::FIN) != 0;
+    }
 
-        pkt_count++;
+    template <typename F>
+    void visit(F &&f) const {
+        f(syn_count);
+        f(cwr_count);
+        f(ece_count);
+        f(urg_count);
+        f(ack_count);
+        f(psh_count);
+        f(rst_count);
+        f(fin_count);
+    }
+
+    template <typename OutputIt>
+    OutputIt format_to(OutputIt out) const {
+        return fmt::format_to(out, "{},{},{},{},{},{},{},{}", syn_count, cwr_count,
+                              ece_count, urg_count, ack_count, psh_count, rst_count,
+                              fin_count);
+    }
+};
+
+// Teardown of a TCP connection as its flags show it: closed once an RST is seen, or
+// once both sides have sent a FIN and the side that sent the first one acknowledges the
+// second. Sequence numbers are not checked.
+struct TcpSession {
+    static constexpr uint8_t FIN_FORWARD = 1 << 0;
+    static constexpr uint8_t FIN_BACKWARD = 1 << 1;
+    // Set when the backward direction sent the later of the two FINs.
+    static constexpr uint8_t LAST_FIN_BACKWARD = 1 << 2;
+    static constexpr uint8_t CLOSED = 1 << 3;
+
+    uint8_t state{0};
 
-        auto total_bytes = packet.pdu()->size();
+    inline bool closed() const { return state & CLOSED; }
 
-        uint32_t bit_count = 0;
-        auto pkt_bytes = packet.pdu()->serialize();
-        for (auto byte : pkt_bytes) {
-            bit_count += std::popcount(byte);
+    // `forward` is whether the packet travels in the direction of the flow's first one.
+    inline void update(uint8_t flags, bool forward) {
+        if (closed()) {
+            return;
         }
-        double one_prob = static_cast<double>(bit_count) / (total_bytes * 8.0);
-        double zero_prob = 1 - one_prob;
-        double gini = 1.0 - ((one_prob * one_prob) + (zero_prob * zero_prob));
-        packet_entropy.update(gini);
+        if (flags & Tins::TCP::RST) {
+            state |= CLOSED;
+            return;
+        }
+        constexpr uint8_t BOTH = FIN_FORWARD | FIN_BACKWARD;
+        if ((state & BOTH) == BOTH) {
+            bool last_backward = state & LAST_FIN_BACKWARD;
+            if ((flags & Tins::TCP::ACK) && !(flags & Tins::TCP::FIN) &&
+                forward == last_backward) {
+                state |= CLOSED;
+            }
+            return;
+        }
+        if (flags & Tins::TCP::FIN) {
+            state |= forward ? FIN_FORWARD : FIN_BACKWARD;
+            if ((state & BOTH) == BOTH && !forward) {
+                state |= LAST_FIN_BACKWARD;
+            }
+        }
+    }
+};
+
+// Features of one direction of a flow. Which optional features are kept is fixed at
+// compile time by `Features`: a disabled feature has no storage, no per-packet work
+// and no columns. Plain data only, so that a flow can be copied with memcpy and kept in
+// a slab pool.
+template <uint32_t Features>
+struct BasicFlow {
+    // Column order of visit() and format_to(); each name is prefixed by the direction.
+    static constexpr auto COLUMNS = concat_columns(
+        std::to_array<std::string_view>(
+            {"first_seen_ms", "last_seen_ms", "duration_ms", "packet_count", "bytes"}),
+        columns_if<has_feature(Features, PACKET_SIZE)>(
+            std::to_array<std::string_view>({"min_ps", "max_ps", "mean_ps", "stddev_ps"})),
+        columns_if<has_feature(Features, PACKET_IAT)>(std::to_array<std::string_view>(
+            {"min_piat", "max_piat", "mean_piat", "stddev_piat"})),
+        columns_if<has_feature(Features, PACKET_ENTROPY)>(std::to_array<std::string_view>(
+            {"min_ent", "max_ent", "mean_ent", "stddev_ent"})),
+        columns_if<has_feature(Features, BYTE_CLASSES)>(std::to_array<std::string_view>(
+            {"null_byte_count", "low_byte_count", "char_byte_count", "high_byte_count"})),
+        columns_if<has_feature(Features, TCP_FLAGS)>(std::to_array<std::string_view>(
+            {"syn_count", "cwr_count", "ece_count", "urg_count", "ack_count", "psh_count",
+             "rst_count", "fin_count"})),
+        columns_if<has_feature(Features, PACKET_SIZE_QUANTILES)>(quantile_columns(
+            std::to_array<std::string_view>({"p25_ps", "p50_ps", "p75_ps", "p90_ps",
+                                             "p99_ps"}))),
+        columns_if<has_feature(Features, PACKET_IAT_QUANTILES)>(quantile_columns(
+            std::to_array<std::string_view>({"p25_piat", "p50_piat", "p75_piat",
+                                             "p90_piat", "p99_piat"}))));
 
-        byte_count += total_bytes;
+    double first_seen_ms = std::numeric_limits<double>::max();
+    double last_seen_ms = std::numeric_limits<double>::min();
+    double duration_ms = 0;
+    uint64_t pkt_count = 0;
+    uint64_t byte_count = 0;
+    [[no_unique_address]] FeatureMember<Features, PACKET_SIZE, Statistic<uint64_t>>
+        packet_size; // packet size
+    [[no_unique_address]] FeatureMember<Features, PACKET_IAT, Statistic<double>>
+        packet_iat; // packet inter-arrival time
+    [[no_unique_address]] FeatureMember<Features, PACKET_ENTROPY, Statistic<double>>
+        packet_entropy; // packet entropy
+    [[no_unique_address]] FeatureMember<Features, BYTE_CLASSES, ByteClassCounts>
+        byte_counts;
+    [[no_unique_address]] FeatureMember<Features, TCP_FLAGS, TcpFlagCounts> flag_counts;
+    [[no_unique_address]] FeatureMember<Features, PACKET_SIZE_QUANTILES, FeatureQuantiles>
+        packet_size_quantiles;
+    [[no_unique_address]] FeatureMember<Features, PACKET_IAT_QUANTILES, FeatureQuantiles>
+        packet_iat_quantiles;
+
+    inline void reset() { *this = BasicFlow(); }
+
+    // TCP flags are only counted when `tcp` is set.
+    inline void update(const PacketFeatures &packet, bool tcp) {
+        const double pkt_timestamp = packet.timestamp;
+        if (!pkt_count) {
+            first_seen_ms = pkt_timestamp;
+        }
 
-        packet_size.update(total_bytes);
+        pkt_count++;
+        byte_count += packet.size;
 
+        if constexpr (has_feature(Features, PACKET_ENTROPY)) {
+            packet_entropy.update(packet.entropy);
+        }
+        if constexpr (has_feature(Features, BYTE_CLASSES)) {
+            byte_counts.update(packet);
+        }
+        if constexpr (has_feature(Features, PACKET_SIZE)) {
+            packet_size.update(packet.size);
+        }
+        if constexpr (has_feature(Features, PACKET_SIZE_QUANTILES)) {
+            packet_size_quantiles.update(static_cast<double>(packet.size));
+        }
         if (pkt_count > 1) {
-            packet_iat.update(pkt_timestamp - last_seen_ms);
+            if constexpr (has_feature(Features, PACKET_IAT)) {
+                packet_iat.update(pkt_timestamp - last_seen_ms);
+            }
+            if constexpr (has_feature(Features, PACKET_IAT_QUANTILES)) {
+                packet_iat_quantiles.update(pkt_timestamp - last_seen_ms);
+            }
         }
         last_seen_ms = pkt_timestamp;
         duration_ms = last_seen_ms - first_seen_ms;
 
-        if (transport_proto == Tins::Constants::IP::e::PROTO_TCP) {
-            auto *tcp_pdu = packet.pdu()->find_pdu<Tins::TCP>();
-
-            if (tcp_pdu->get_flag(Tins::TCP::SYN)) {
-                syn_count++;
-            }
-            if (tcp_pdu->get_flag(Tins::TCP::CWR)) {
-                cwr_count++;
-            }
-            if (tcp_pdu->get_flag(Tins::TCP::ECE)) {
-                ece_count++;
-            }
-            if (tcp_pdu->get_flag(Tins::TCP::URG)) {
-                urg_count++;
-            }
-            if (tcp_pdu->get_flag(Tins::TCP::ACK)) {
-                ack_count++;
-            }
-            if (tcp_pdu->get_flag(Tins::TCP::PSH)) {
-                psh_count++;
-            }
-            if (tcp_pdu->get_flag(Tins::TCP::RST)) {
-                rst_count++;
-            }
-            if (tcp_pdu->get_flag(Tins::TCP::FIN)) {
-                fin_count++;
+        if constexpr (has_feature(Features, TCP_FLAGS)) {
+            if (tcp) {
+                flag_counts.update(packet.tcp_flags);
             }
         }
     }
 
     inline void finalize() { duration_ms = last_seen_ms - first_seen_ms; }
 
+    template <typename F>
+    void visit(F &&f) const {
+        f(first_seen_ms);
+        f(last_seen_ms);
+        f(duration_ms);
+        f(pkt_count);
+        f(byte_count);
+        if constexpr (has_feature(Features, PACKET_SIZE)) {
+            packet_size.visit(f);
+        }
+        if constexpr (has_feature(Features, PACKET_IAT)) {
+            packet_iat.visit(f);
+        }
+        if constexpr (has_feature(Features, PACKET_ENTROPY)) {
+            packet_entropy.visit(f);
+        }
+        if constexpr (has_feature(Features, BYTE_CLASSES)) {
+            byte_counts.visit(f);
+        }
+        if constexpr (has_feature(Features, TCP_FLAGS)) {
+            flag_counts.visit(f);
+        }
+        if constexpr (has_feature(Features, PACKET_SIZE_QUANTILES)) {
+            packet_size_quantiles.visit(f);
+        }
+        if constexpr (has_feature(Features, PACKET_IAT_QUANTILES)) {
+            packet_iat_quantiles.visit(f);
+        }
+    }
+
+    template <typename OutputIt>
+    OutputIt format_to(OutputIt out) const {
+        out = fmt::format_to(out, "{},{},{},{},{}", first_seen_ms, last_seen_ms,
+                             duration_ms, pkt_count, byte_count);
+        if constexpr (has_feature(Features, PACKET_SIZE)) {
+            *out++ = ',';
+            out = packet_size.format_to(out);
+        }
+        if constexpr (has_feature(Features, PACKET_IAT)) {
+            *out++ = ',';
+            out = packet_iat.format_to(out);
+        }
+        if constexpr (has_feature(Features, PACKET_ENTROPY)) {
+            *out++ = ',';
+            out = packet_entropy.format_to(out);
+        }
+        if constexpr (has_feature(Features, BYTE_CLASSES)) {
+            *out++ = ',';
+            out = byte_counts.format_to(out);
+        }
+        if constexpr (has_feature(Features, TCP_FLAGS)) {
+            *out++ = ',';
+            out = flag_counts.format_to(out);
+        }
+        if constexpr (has_feature(Features, PACKET_SIZE_QUANTILES)) {
+            *out++ = ',';
+            out = packet_size_quantiles.format_to(out);
+        }
+        if constexpr (has_feature(Features, PACKET_IAT_QUANTILES)) {
+            *out++ = ',';
+            out = packet_iat_quantiles.format_to(out);
+        }
+        return out;
+    }
+
     const std::string to_string() const {
-        std::stringstream ss;
-        ss << std::setprecision(MAX_DOUBLE_PRECISION) << first_seen_ms << ","
-           << std::setprecision(MAX_DOUBLE_PRECISION) << last_seen_ms << ","
-           << std::setprecision(MAX_DOUBLE_PRECISION) << duration_ms << "," << pkt_count
-           << "," << byte_count << "," << packet_size.to_string() << ","
-           << packet_iat.to_string() << "," << packet_entropy.to_string() << ","
-           << syn_count << "," << cwr_count << "," << ece_count << "," << urg_count << ","
-           << ack_count << "," << psh_count << "," << rst_count << "," << fin_count;
-        return ss.str();
-    }
-
-    const std::string column_names() const {
-        std::stringstream ss;
-        ss << direction << "_first_seen_ms," << direction << "_last_seen_ms," << direction
-           << "_duration_ms," << direction << "_packet_count," << direction << "_bytes,"
-           << packet_size.column_names() << "," << packet_iat.column_names() << ","
-           << packet_entropy.column_names() << "," << direction << "_syn_count,"
-           << direction << "_cwr_count," << direction << "_ece_count," << direction
-           << "_urg_count," << direction << "_ack_count," << direction << "_psh_count,"
-           << direction << "_rst_count," << direction << "_fin_count";
-        return ss.str();
+        fmt::memory_buffer buffer;
+        format_to(std::back_inserter(buffer));
+        return fmt::to_string(buffer);
+    }
+
+    static const std::string column_names(std::string_view direction) {
+        std::string names;
+        for (auto column : COLUMNS) {
+            fmt::format_to(std::back_inserter(names), "{}{}_{}", names.empty() ? "" : ",",
+                           direction, column);
+        }
+        return names;
     }
 };
 
-struct NetworkFlow {
+// One flow record. Trivially copyable and free of heap storage: column names come from
+// the static schema, so a record costs only its own bytes.
+template <uint32_t Features>
+struct BasicNetworkFlow {
+    static constexpr uint32_t FEATURES = Features;
+    // Whether PacketFeatures must scan the packet bytes for this record type.
+    static constexpr bool PAYLOAD = has_feature(Features, PAYLOAD_FEATURES);
+    // Order in which the directions appear in a record.
+    static constexpr auto DIRECTIONS =
+        std::to_array<std::string_view>({"bidirectional", "src2dst", "dst2src"});
+
     ServicePair service_pair;
 
     int64_t init_id{};
@@ -173,16 +395,24 @@ struct NetworkFlow {
 
     ExpirationCode exp_code{ExpirationCode::UNINITIALIZED};
 
-    Flow src2dst;
-    Flow dst2src;
-    Flow bidirectional;
+    // Not exported; like last_activity_ms it survives reset().
+    TcpSession session;
+
+    // The meter saw one packet in `packet_sampling_rate` and one flow in
+    // `flow_sampling_rate`; see Sampler.
+    uint32_t packet_sampling_rate{1};
+    uint32_t flow_sampling_rate{1};
 
-    NetworkFlow(const ServicePair pair, const uint32_t init_id_val,
-                const uint32_t sub_init_id_val)
+    // Time of the latest packet; unlike the Flow timestamps it survives reset().
+    double last_activity_ms{0};
+
+    BasicFlow<Features> src2dst;
+    BasicFlow<Features> dst2src;
+    BasicFlow<Features> bidirectional;
+
+    BasicNetworkFlow(const ServicePair pair, const uint32_t init_id_val,
+                     const uint32_t sub_init_id_val)
         : service_pair(pair), init_id(init_id_val), sub_init_id(sub_init_id_val),
-          src2dst("src2dst", pair.transport_proto),
-          dst2src("dst2src", pair.transport_proto),
-          bidirectional("bidirectional", pair.transport_proto),
           exp_code(ExpirationCode::ALIVE) {}
 
     inline void reset() {
@@ -191,46 +421,114 @@ struct NetworkFlow {
         bidirectional.reset();
     }
 
-    void finalize() { 
+    void finalize() {
         bidirectional.finalize();
         src2dst.finalize();
         dst2src.finalize();
     }
 
-    NetworkFlow(const NetworkFlow &net_flow) = default;
-
-    // NetworkFlow operator=(const NetworkFlow rhs) { return rhs; };
+    inline void update(const PacketFeatures &features, const ServicePair &pair) {
+        last_activity_ms = features.timestamp;
+        bool tcp = service_pair.transport_proto == Tins::Constants::IP::e::PROTO_TCP;
+        bidirectional.update(features, tcp);
 
-    // NetworkFlow operator=(NetworkFlow rhs) { return rhs; };
+        bool forward = pair.src_service == service_pair.src_service;
+        if (forward) {
+            src2dst.update(features, tcp);
+        } else {
+            dst2src.update(features, tcp);
+        }
+        if (tcp) {
+            session.update(features.tcp_flags, forward);
+        }
+    }
 
-    inline void update(Tins::Packet &pkt, ServicePair &pair, double &timestamp) {
-        bidirectional.update(pkt, timestamp);
+    double last_update_ts() const { return last_activity_ms; }
 
-        if (pair.src_service == service_pair.src_service) {
-            src2dst.update(pkt, timestamp);
-        } else {
-            dst2src.update(pkt, timestamp);
+    static const std::string column_names() {
+        std::string names = "init_id,sub_init_id,expiration_reason,";
+        names += ServicePair::column_names();
+        for (auto direction : DIRECTIONS) {
+            names += ',';
+            names += BasicFlow<Features>::column_names(direction);
         }
+        names += ",packet_sampling_rate,flow_sampling_rate";
+        return names;
+    }
+
+    // Calls `f` with the value of every column, in the order of column_names(), for
+    // writers that store typed values rather than text.
+    template <typename F>
+    void visit(F &&f) const {
+        f(init_id);
+        f(sub_init_id);
+        f(static_cast<uint8_t>(exp_code));
+        service_pair.visit(f);
+        bidirectional.visit(f);
+        src2dst.visit(f);
+        dst2src.visit(f);
+        f(packet_sampling_rate);
+        f(flow_sampling_rate);
     }
 
-    double last_update_ts() const { return bidirectional.last_seen_ms; }
-    const std::string column_names() const {
-        std::stringstream ss;
-        ss << "init_id,sub_init_id,expiration_reason," << service_pair.column_names()
-           << "," << bidirectional.column_names() << "," << src2dst.column_names() << ","
-           << dst2src.column_names();
-        return ss.str();
+    // Appends one CSV row, without the line break, to `out`.
+    template <typename OutputIt>
+    OutputIt format_to(OutputIt out) const {
+        out = fmt::format_to(out, "{},{},{},", init_id, sub_init_id,
+                             static_cast<int>(exp_code));
+        out = service_pair.format_to(out);
+        *out++ = ',';
+        out = bidirectional.format_to(out);
+        *out++ = ',';
+        out = src2dst.format_to(out);
+        *out++ = ',';
+        out = dst2src.format_to(out);
+        return fmt::format_to(out, ",{},{}", packet_sampling_rate, flow_sampling_rate);
     }
 
     const std::string to_string() const {
-        std::stringstream ss;
-        ss << init_id << "," << sub_init_id << "," << exp_code << ","
-           << service_pair.to_string() << "," << bidirectional.to_string() << ","
-           << src2dst.to_string() << "," << dst2src.to_string();
-        return ss.str();
+        fmt::memory_buffer buffer;
+        format_to(std::back_inserter(buffer));
+        return fmt::to_string(buffer);
     }
 };
 
+using Flow = BasicFlow<DEFAULT_FEATURES>;
+using NetworkFlow = BasicNetworkFlow<DEFAULT_FEATURES>;
+
+static_assert(std::is_trivially_copyable_v<NetworkFlow>,
+              "NetworkFlow is kept in a slab pool and copied as plain bytes");
+
+// Feature sets the meters are instantiated for, chosen at run time:
+//   FULL       the default features
+//   HEADERS    everything that does not need the packet bytes
+//   TIMING     inter-arrival times only
+//   COUNTS     timestamps and packet and byte counts only
+//   QUANTILES  the default features plus packet size and inter-arrival time quantiles
+enum class FeatureProfile { FULL, HEADERS, TIMING, COUNTS, QUANTILES };
+
+inline constexpr uint32_t HEADER_FEATURES = PACKET_SIZE | PACKET_IAT | TCP_FLAGS;
+inline constexpr uint32_t TIMING_FEATURES = PACKET_IAT;
+inline constexpr uint32_t COUNT_FEATURES = 0;
+
+// Calls `f` with std::type_identity of the record type of `profile`, so that one
+// generic lambda instantiates a meter for every profile.
+template <typename F>
+auto with_profile(FeatureProfile profile, F &&f) {
+    switch (profile) {
+    case FeatureProfile::HEADERS:
+        return f(std::type_identity<BasicNetworkFlow<HEADER_FEATURES>>{});
+    case FeatureProfile::TIMING:
+        return f(std::type_identity<BasicNetworkFlow<TIMING_FEATURES>>{});
+    case FeatureProfile::COUNTS:
+        return f(std::type_identity<BasicNetworkFlow<COUNT_FEATURES>>{});
+    case FeatureProfile::QUANTILES:
+        return f(std::type_identity<BasicNetworkFlow<ALL_FEATURES>>{});
+    default:
+        return f(std::type_identity<NetworkFlow>{});
+    }
+}
+
 } // end namespace Net
 
 #endif
@@ -0,0 +1,92 @@
+#ifndef FLOWMETER_FLOW_STREAM_H
+#define FLOWMETER_FLOW_STREAM_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "flowmeter/columnar.h"
+#include "flowmeter/dissector.h"
+#include "flowmeter/features.h"
+#include "flowmeter/flow_table.h"
+#include "flowmeter/meter.h"
+#include "flowmeter/pcap_reader.h"
+
+namespace Net {
+
+// Pull-style meter. Rather than writing a file, it meters just enough of the input to
+// hand the caller the next batch of exported records, packed into a RowBuffer.
+class FlowStream {
+  public:
+    FlowStream(const std::string &input_file, const double &active_timeout,
+               const double &idle_timeout,
+               const double &timer_resolution = Meter::default_timer_resolution_)
+        : reader_(input_file),
+          table_(*this, active_timeout, idle_timeout, timer_resolution),
+          specs_(column_specs(NetworkFlow(ServicePair(), 0, 0))) {}
+
+    FlowStream(const FlowStream &) = delete;
+    FlowStream &operator=(const FlowStream &) = delete;
+
+    // Schema of the records next_batch() produces.
+    const std::vector<ColumnSpec> &columns() const { return specs_; }
+
+    // Meters packets until at least `min_records` records have been appended to `rows`
+    // or the input is exhausted. Records expiring together are never split, so a batch
+    // may run over. Returns false once there is nothing left to export.
+    bool next_batch(RowBuffer &rows, size_t min_records) {
+        size_t start = rows.size();
+        rows_ = &rows;
+        while (!finished_ && rows.size() - start < min_records) {
+            if (cursor_ == batch_.size()) {
+                cursor_ = 0;
+                if (!reader_.next_batch(batch_)) {
+                    table_.finish();
+                    finished_ = true;
+                    break;
+                }
+                while (dissectors_.size() < reader_.interface_count()) {
+                    dissectors_.emplace_back(reader_.link_type(dissectors_.size()));
+                }
+            }
+
+            const auto &raw = batch_[cursor_++];
+            auto seq = pkt_count_++;
+            table_.advance(raw.timestamp);
+            if (dissectors_[raw.interface].dissect(raw, packet_)) {
+                table_.process(packet_.pair, PacketFeatures(packet_), seq);
+            }
+        }
+        rows_ = nullptr;
+        return rows.size() > start;
+    }
+
+    uint64_t packet_count() const { return pkt_count_; }
+
+    bool finished() const { return finished_; }
+
+    // FlowTable sink interface.
+    inline void on_record(const NetworkFlow &flow, const ExportPosition &) {
+        rows_->append(flow);
+    }
+
+    inline void on_create(const NetworkFlow &, const ExportPosition &) {}
+
+    inline void on_retire(const NetworkFlow &, const ExportPosition &) {}
+
+  private:
+    PcapReader reader_;
+    FlowTable<FlowStream> table_;
+    std::vector<ColumnSpec> specs_;
+    std::vector<Dissector> dissectors_;
+    std::vector<RawPacket> batch_;
+    size_t cursor_{0};
+    PacketDescriptor packet_;
+    RowBuffer *rows_{nullptr};
+    uint64_t pkt_count_{0};
+    bool finished_{false};
+};
+
+} // end namespace Net
+
+#endif
@@ -0,0 +1,511 @@
+#ifndef FLOWMETER_FLOW_TABLE_H
+#define FLOWMETER_FLOW_TABLE_H
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/hash/hash.h"
+#include <algorithm>
+#include <bit>
+#include <compare>
+#include <cstdint>
+#include <limits>
+#include <tuple>
+#include <vector>
+
+#include "flowmeter/features.h"
+#include "flowmeter/flow.h"
+#include "flowmeter/sampler.h"
+#include "flowmeter/service.h"
+#include "flowmeter/slab_pool.h"
+#include "flowmeter/stats.h"
+#include "flowmeter/timer_wheel.h"
+
+namespace Net {
+
+// Where an event falls in the global output order. Timer expirations are ordered by
+// the tick they fire on, packet-driven events by the packet that caused them, and
+// everything still alive at the end of the input comes last. Within a tick, timer
+// events precede packet events, matching the order in which the table processes them.
+struct ExportPosition {
+    static constexpr uint32_t TIMER = 0;
+    static constexpr uint32_t PACKET = 1;
+    static constexpr uint64_t END_OF_INPUT = std::numeric_limits<uint64_t>::max();
+
+    uint64_t tick{0};
+    uint32_t phase{TIMER};
+    uint64_t seq{0};
+
+    auto operator<=>(const ExportPosition &) const = default;
+};
+
+// Packets to look ahead when prefetching with FlowTable::prefetch and prefetch_flow:
+// enough to cover a memory access with work, few enough to stay in the L1 cache.
+inline constexpr size_t PREFETCH_BURST = 32;
+
+// Caps on the size of a FlowTable; zero leaves a dimension uncapped.
+struct FlowLimits {
+    size_t max_flows{0};
+    size_t max_bytes{0};
+
+    // Limits for each of `parts` tables that share these between them.
+    FlowLimits split(size_t parts) const {
+        return FlowLimits{(max_flows + parts - 1) / parts, max_bytes / parts};
+    }
+};
+
+// A packet's flow key in its canonical form, hashed once so that prefetching, looking up
+// and inserting the flow all reuse the hash.
+struct HashedKey {
+    ServicePair key;
+    size_t hash{0};
+
+    HashedKey() = default;
+    explicit HashedKey(const ServicePair &pair)
+        : key(pair.canonical()), hash(absl::Hash<ServicePair>{}(key)) {}
+};
+
+// Hash and equality of the flow index, which also accept a HashedKey and take its hash
+// as it is.
+struct FlowKeyHash {
+    using is_transparent = void;
+
+    size_t operator()(const ServicePair &key) const {
+        return absl::Hash<ServicePair>{}(key);
+    }
+    size_t operator()(const HashedKey &key) const { return key.hash; }
+};
+
+struct FlowKeyEq {
+    using is_transparent = void;
+
+    bool operator()(const ServicePair &lhs, const ServicePair &rhs) const {
+        return lhs == rhs;
+    }
+    bool operator()(const ServicePair &lhs, const HashedKey &rhs) const {
+        return lhs == rhs.key;
+    }
+    bool operator()(const HashedKey &lhs, const ServicePair &rhs) const {
+        return lhs.key == rhs;
+    }
+};
+
+// Wheel entry for a flow. `init_id` tells a stale entry apart from a newer flow that
+// reuses the same key after the original was expired.
+struct FlowTimer {
+    ServicePair key;
+    int64_t init_id;
+};
+
+// Flow cache plus its expiration index. Exported records, flow creations and flows that
+// are dropped without a record are reported to `Sink` through
+//   on_record(const Record &, const ExportPosition &)
+//   on_create(const Record &, const ExportPosition &)
+//   on_retire(const Record &, const ExportPosition &)
+// so that the same table can write straight to a file or feed a merge stage. `Record`
+// is a BasicNetworkFlow and fixes the feature set.
+template <typename Sink, typename Record = NetworkFlow>
+class FlowTable {
+  public:
+    // With `sequence_ids` set, a flow's init_id is the sequence number of the packet
+    // that created it rather than a dense counter; sharded tables use this so that ids
+    // are unique across shards and can be renumbered when the shards are merged.
+    FlowTable(Sink &sink, double active_timeout, double idle_timeout,
+              double timer_resolution, bool sequence_ids = false)
+        : sink_(sink), active_timeout_(active_timeout), idle_timeout_(idle_timeout),
+          sequence_ids_(sequence_ids), timers_(timer_resolution) {}
+
+    inline uint64_t tick_of(double timestamp) const { return timers_.tick_of(timestamp); }
+
+    inline uint64_t current_tick() const { return timers_.current_tick(); }
+
+    // Counts table events and charges lookup, update, expiration and export cycles to
+    // `stats`; a no-op unless built with FLOWMETER_STATS.
+    void set_stats(RuntimeStats *stats) {
+        if constexpr (STATS_ENABLED) {
+            stats_ = stats;
+        }
+    }
+
+    // Caps the table at `limits.max_flows` flows and at about `limits.max_bytes` of
+    // memory_bytes(), zero meaning no cap, and allocates all of it up front so that a
+    // burst of new flows never waits on a rehash. A new flow that would go over the cap
+    // evicts the flow due to expire first, which is exported as USER_SPECIFIED.
+    void set_limits(const FlowLimits &limits) {
+        size_t max_flows = limits.max_flows ? limits.max_flows : SIZE_MAX;
+        if (limits.max_bytes) {
+            size_t lo = 1;
+            size_t hi = std::max<size_t>(limits.max_bytes / sizeof(Record), 1);
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo + 1) / 2;
+                if (bytes_for(mid) <= limits.max_bytes) {
+                    lo = mid;
+                } else {
+                    hi = mid - 1;
+                }
+            }
+            max_flows = std::min(max_flows, lo);
+        }
+        if (max_flows == SIZE_MAX) {
+            max_flows_ = 0;
+            return;
+        }
+        max_flows_ = max_flows;
+        // The index briefly holds one flow more while it evicts.
+        flows_.reserve(max_flows_);
+        flow_cache_.reserve(max_flows_ + 1);
+    }
+
+    // Ends a TCP flow as SESSION_END `linger` seconds after its connection closed with
+    // FINs or an RST, or after the last straggler since, instead of at a timeout. A
+    // negative linger, the default, leaves closed connections to the timeouts.
+    void set_session_linger(double linger) { session_linger_ = linger; }
+
+    // Stamps the rates of `sampler` on every flow created from now on. The sampling
+    // itself is up to the caller, which only hands the table the packets it keeps.
+    void set_sampling(const Sampler &sampler) { sampler_ = sampler; }
+
+    // Id the next flow gets when ids are not packet sequence numbers.
+    int64_t next_id() const { return next_id_; }
+
+    // Continues the ids of the table this one takes over from, with adopt().
+    void resume_ids(int64_t next_id) { next_id_ = next_id; }
+
+    // Flows evicted to stay within the limits.
+    uint64_t evicted() const { return evicted_; }
+
+    // Moves capture time forward, expiring every flow whose deadline has passed.
+    inline void advance(double timestamp) { advance_tick(timers_.tick_of(timestamp)); }
+
+    inline void advance_tick(uint64_t tick) {
+        ScopedStage stage(stats_, Stage::EXPIRE);
+        timers_.start(tick);
+        timers_.advance(tick, [this](uint64_t fired, auto &due) { expire(fired, due); });
+    }
+
+    inline void process(const ServicePair &pair, const PacketFeatures &features,
+                        uint64_t seq) {
+        process(pair, HashedKey(pair), features, seq);
+    }
+
+    // As above for a packet whose key is already hashed, as in a prefetched burst.
+    inline void process(const ServicePair &pair, const HashedKey &key,
+                        const PacketFeatures &features, uint64_t seq) {
+        // Flows are keyed on the direction-independent form of the pair; the record
+        // itself keeps the orientation of the packet that created it.
+        auto id = sequence_ids_ ? static_cast<int64_t>(seq) : next_id_;
+        typename FlowIndex::iterator it;
+        bool success = false;
+        {
+            ScopedStage stage(stats_, Stage::LOOKUP);
+            it = flow_cache_.lazy_emplace(key, [&key, &success](const auto &construct) {
+                construct(key.key, nullptr);
+                success = true;
+            });
+            if (success) {
+                if (max_flows_ && flow_cache_.size() > max_flows_) {
+                    evict(seq);
+                }
+                it->second = flows_.create(pair, id, default_sub_id_);
+                it->second->packet_sampling_rate = sampler_.packet_rate;
+                it->second->flow_sampling_rate = sampler_.flow_rate;
+            }
+        }
+
+        ScopedStage stage(stats_, Stage::UPDATE);
+        auto &flow = *it->second;
+        bool was_closed = flow.session.closed();
+        flow.update(features, pair);
+        // Closing brings the deadline forward, which the flow's timer cannot follow.
+        if (!success && !was_closed && session_ends(flow)) {
+            timers_.schedule(next_deadline(flow), FlowTimer{it->first, flow.init_id});
+        }
+
+        if (success) {
+            count_created();
+            next_id_++;
+            peak_size_ = std::max(peak_size_, flow_cache_.size());
+            timers_.schedule(next_deadline(flow), FlowTimer{it->first, id});
+            sink_.on_create(flow, packet_position(seq));
+        }
+    }
+
+    // Starts loading the index slot of the flow of `key`. Called for a burst of
+    // packets before any of them is processed, so that their cache misses overlap.
+    inline void prefetch(const HashedKey &key) const { flow_cache_.prefetch(key); }
+
+    // Starts loading the record of the flow of `key`, if there is one, at the parts a
+    // packet updates. Looks the flow up, so it is best called once prefetch() has had
+    // time to bring in the slot.
+    inline void prefetch_flow(const HashedKey &key) const {
+        auto it = flow_cache_.find(key);
+        if (it != flow_cache_.end()) {
+            const auto *flow = it->second;
+            __builtin_prefetch(flow, 1);
+            __builtin_prefetch(&flow->bidirectional, 1);
+            __builtin_prefetch(&flow->src2dst, 1);
+            __builtin_prefetch(&flow->dst2src, 1);
+        }
+    }
+
+    // Takes over a flow from another table, such as one that metered the preceding part
+    // of the capture, with its state, its ids and the tick its timer was due on. No
+    // creation is reported for it.
+    void adopt(const Record &flow, uint64_t tick) {
+        auto key = flow.service_pair.canonical();
+        auto *copy = flows_.create(flow);
+        flow_cache_[key] = copy;
+        peak_size_ = std::max(peak_size_, flow_cache_.size());
+        timers_.schedule_tick(tick, FlowTimer{key, flow.init_id});
+    }
+
+    // Whether the flow `init_id` is still in the table under the canonical pair `key`.
+    inline bool contains(const ServicePair &key, int64_t init_id) const {
+        auto it = flow_cache_.find(key);
+        return it != flow_cache_.end() && it->second->init_id == init_id;
+    }
+
+    // Calls `fn(flow, tick)` with every flow in the table and the tick its timer is due
+    // on, in no particular order. A connection that closed under set_session_linger has
+    // a second timer and is visited once for each; the earlier tick is the one to keep.
+    template <typename F>
+    void for_each(F &&fn) const {
+        timers_.for_each([this, &fn](const auto &entry) {
+            auto it = flow_cache_.find(entry.value.key);
+            if (it != flow_cache_.end() && it->second->init_id == entry.value.init_id) {
+                fn(*it->second, entry.tick);
+            }
+        });
+    }
+
+    // Exports everything still in the table as SESSION_END, in creation order.
+    void finish() {
+        std::vector<Record *> remaining;
+        remaining.reserve(flow_cache_.size());
+        for (auto &[key, flow] : flow_cache_) {
+            remaining.push_back(flow);
+        }
+        std::sort(remaining.begin(), remaining.end(),
+                  [](auto *lhs, auto *rhs) { return lhs->init_id < rhs->init_id; });
+
+        for (auto *flow : remaining) {
+            ExportPosition position{ExportPosition::END_OF_INPUT, ExportPosition::TIMER,
+                                    static_cast<uint64_t>(flow->init_id)};
+            if (flow->bidirectional.pkt_count) {
+                flow->exp_code = ExpirationCode::SESSION_END;
+                flow->finalize();
+                export_record(*flow, position);
+            } else {
+                retire(*flow, position);
+            }
+        }
+        flow_cache_.clear();
+        flows_.clear();
+        timers_.drain([](auto &) {});
+    }
+
+    size_t size() const { return flow_cache_.size(); }
+
+    size_t peak_size() const { return peak_size_; }
+
+    // Slots of the index, occupied or not; size() / capacity() is its load factor.
+    size_t capacity() const { return flow_cache_.capacity(); }
+
+    // Bytes held by the flow records and the index over them. Neither shrinks before
+    // finish(), so this is also the peak.
+    size_t memory_bytes() const {
+        return flows_.memory_bytes() +
+               flow_cache_.capacity() * (sizeof(typename FlowIndex::value_type) + 1);
+    }
+
+  private:
+    // Estimate of memory_bytes() once `count` flows are reserved; the index keeps its
+    // load factor under 7/8 with a power of two of slots.
+    static size_t bytes_for(size_t count) {
+        size_t slots = std::bit_ceil(count + count / 7 + 1);
+        size_t records = (count + POOL_SLAB - 1) / POOL_SLAB * POOL_SLAB;
+        return records * sizeof(Record) +
+               slots * (sizeof(typename FlowIndex::value_type) + 1);
+    }
+
+    // Uses the clock rather than the packet's own tick so that a packet stamped earlier
+    // than its predecessors does not sort ahead of events already reported.
+    inline ExportPosition packet_position(uint64_t seq) const {
+        return ExportPosition{timers_.current_tick(), ExportPosition::PACKET, seq};
+    }
+
+    inline void export_record(const Record &flow, const ExportPosition &position) {
+        if constexpr (STATS_ENABLED) {
+            if (stats_) {
+                stats_->count_expired(flow.exp_code);
+            }
+        }
+        ScopedStage stage(stats_, Stage::EXPORT);
+        sink_.on_record(flow, position);
+    }
+
+    inline void retire(const Record &flow, const ExportPosition &position) {
+        if constexpr (STATS_ENABLED) {
+            if (stats_) {
+                stats_->count_retired();
+            }
+        }
+        sink_.on_retire(flow, position);
+    }
+
+    inline void count_created() {
+        if constexpr (STATS_ENABLED) {
+            if (stats_) {
+                stats_->count_created();
+            }
+        }
+    }
+
+    // When the timer of `flow` should fire, as of `tick`. An empty flow is due one
+    // active timeout after its next packet, which arrives no earlier than now. Packets
+    // never bring a timer forward, so it has to fire by then for every flow to expire
+    // exactly at its deadline, however its timer was scheduled before.
+    inline double timer_deadline(const Record &flow, uint64_t tick) const {
+        auto deadline = next_deadline(flow);
+        if (!flow.bidirectional.pkt_count) {
+            deadline = std::min(deadline, static_cast<double>(tick) * timers_.resolution() +
+                                              active_timeout_);
+        }
+        return deadline;
+    }
+
+    // Earliest capture time at which `flow` may need to be exported.
+    inline double next_deadline(const Record &flow) const {
+        double deadline = flow.last_update_ts() + idle_timeout_;
+        if (flow.bidirectional.pkt_count) {
+            deadline =
+                std::min(deadline, flow.bidirectional.first_seen_ms + active_timeout_);
+        }
+        if (session_ends(flow)) {
+            deadline = std::min(deadline, flow.last_update_ts() + session_linger_);
+        }
+        return deadline;
+    }
+
+    inline bool session_ends(const Record &flow) const {
+        return session_linger_ >= 0 && flow.session.closed();
+    }
+
+    // Handles the timers that came due at `tick`. Entries are taken in flow creation
+    // order so the output does not depend on hash table or wheel layout. A flow whose
+    // deadline moved since it was scheduled is simply put back on the wheel.
+    template <typename Entries>
+    void expire(uint64_t tick, Entries &due) {
+        std::sort(due.begin(), due.end(), [](const auto &lhs, const auto &rhs) {
+            return lhs.value.init_id < rhs.value.init_id;
+        });
+
+        for (auto &entry : due) {
+            auto it = flow_cache_.find(entry.value.key);
+            if (it == flow_cache_.end() || it->second->init_id != entry.value.init_id) {
+                continue;
+            }
+            auto &flow = *it->second;
+            ExportPosition position{tick, ExportPosition::TIMER,
+                                    static_cast<uint64_t>(flow.init_id)};
+            auto active_tick =
+                timers_.deadline_tick(flow.bidirectional.first_seen_ms + active_timeout_);
+            auto idle_tick = timers_.deadline_tick(flow.last_update_ts() + idle_timeout_);
+
+            if (flow.bidirectional.pkt_count && active_tick <= tick) {
+                flow.exp_code = ExpirationCode::ACTIVE_TIMEOUT;
+                flow.finalize();
+                export_record(flow, position);
+                flow.sub_init_id++;
+                flow.exp_code = ExpirationCode::ALIVE;
+                flow.reset();
+            }
+            bool ended = session_ends(flow) &&
+                         timers_.deadline_tick(flow.last_update_ts() + session_linger_) <=
+                             tick;
+            if (ended || idle_tick <= tick) {
+                // A flow that was reset by an active timeout and saw no packets since
+                // has nothing left to report.
+                if (flow.bidirectional.pkt_count) {
+                    flow.exp_code =
+                        ended ? ExpirationCode::SESSION_END : ExpirationCode::IDLE_TIMEOUT;
+                    flow.finalize();
+                    export_record(flow, position);
+                } else {
+                    retire(flow, position);
+                }
+                flows_.destroy(&flow);
+                flow_cache_.erase(it);
+                continue;
+            }
+
+            auto deadline = timer_deadline(flow, tick);
+            timers_.schedule(deadline, entry.value);
+        }
+    }
+
+    // Makes room for one more flow by exporting the flow that is due to expire first,
+    // as USER_SPECIFIED. The wheel's earliest timer is only the earliest deadline if it
+    // is still current, so a timer that turns out to be early is put back on time and
+    // the search goes on, like the second chance of a CLOCK cache.
+    void evict(uint64_t seq) {
+        ScopedStage stage(stats_, Stage::EXPIRE);
+        typename TimerWheel<FlowTimer>::Entry entry;
+        while (timers_.take_earliest(entry)) {
+            auto it = flow_cache_.find(entry.value.key);
+            // The flow being created is in the index but has no record yet.
+            if (it == flow_cache_.end() || !it->second ||
+                it->second->init_id != entry.value.init_id) {
+                continue;
+            }
+            auto &flow = *it->second;
+            auto tick =
+                timers_.deadline_tick(timer_deadline(flow, timers_.current_tick()));
+            if (tick > entry.tick) {
+                timers_.schedule_tick(tick, entry.value);
+                continue;
+            }
+
+            auto position = packet_position(seq);
+            if (flow.bidirectional.pkt_count) {
+                flow.exp_code = ExpirationCode::USER_SPECIFIED;
+                flow.finalize();
+                export_record(flow, position);
+            } else {
+                retire(flow, position);
+            }
+            evicted_++;
+            if constexpr (STATS_ENABLED) {
+                if (stats_) {
+                    stats_->count_evicted();
+                }
+            }
+            flows_.destroy(&flow);
+            flow_cache_.erase(it);
+            return;
+        }
+    }
+
+    Sink &sink_;
+    double active_timeout_;
+    double idle_timeout_;
+    bool sequence_ids_;
+    int64_t next_id_{0};
+    double session_linger_{-1};
+    Sampler sampler_;
+    size_t max_flows_{0};
+    uint64_t evicted_{0};
+    static constexpr uint32_t default_sub_id_{0};
+    static constexpr size_t POOL_SLAB{1024};
+    // Records live in the pool and the hash map only indexes them, which keeps its
+    // slots small and rehashing cheap.
+    using FlowIndex =
+        absl::flat_hash_map<ServicePair, Record *, FlowKeyHash, FlowKeyEq>;
+    SlabPool<Record, POOL_SLAB> flows_;
+    FlowIndex flow_cache_;
+    size_t peak_size_{0};
+    TimerWheel<FlowTimer> timers_;
+    RuntimeStats *stats_{nullptr};
+};
+
+} // end namespace Net
+
+#endif
@@ -0,0 +1,200 @@
+#ifndef FLOWMETER_HOST_TABLE_H
+#define FLOWMETER_HOST_TABLE_H
+
+#include "absl/container/flat_hash_map.h"
+#include "tins/constants.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "flowmeter/csv_writer.h"
+#include "flowmeter/node.h"
+#include "flowmeter/service.h"
+#include "flowmeter/slab_pool.h"
+#include "flowmeter/statistic.h"
+
+namespace Net {
+
+// Running state of one host within the current interval.
+struct HostState {
+    HostKey key;
+    uint64_t udp_count{0};
+    uint64_t tcp_count{0};
+    uint64_t ip_count{0};
+    uint64_t ip6_count{0};
+    uint64_t nontransport_count{0};
+    DistinctSketch<uint16_t> inc_ports;
+    DistinctSketch<uint16_t> out_ports;
+    // Hosts are only released between intervals, so peers can point at each other.
+    DistinctSketch<HostState *> peers;
+    Statistic<double> data_rate;
+
+    explicit HostState(const HostKey &host) : key(host) {}
+};
+
+// Per-host graph features, updated incrementally as the flow table creates and exports
+// flows and written as one NetNode row per active host every `interval` seconds of
+// capture time. Intervals are aligned to multiples of `interval`; every host starts
+// afresh in each one, which keeps memory proportional to the hosts of one interval.
+class HostTable {
+  public:
+    HostTable(const std::string &path, double interval)
+        : writer_(path), interval_(interval) {
+        writer_.write_line(NetNode::column_names());
+    }
+
+    // Writes out every interval that ends at or before `timestamp`.
+    inline void advance(double timestamp) {
+        if (timestamp < window_end_) {
+            return;
+        }
+        if (!order_.empty()) {
+            export_window();
+        }
+        window_start_ = std::floor(timestamp / interval_) * interval_;
+        window_end_ = window_start_ + interval_;
+    }
+
+    // A new flow adds an edge between its endpoints. The endpoint that sent the first
+    // packet is taken as the initiator, and the destination port as the service.
+    template <typename Record>
+    void on_create(const Record &flow) {
+        const auto &pair = flow.service_pair;
+        auto &src = host(pair.src_service.ip_addr, pair.ip_version);
+        auto &dst = host(pair.dst_service.ip_addr, pair.ip_version);
+        auto port = pair.dst_service.port;
+        src.out_ports.add(mix64(port), port);
+        dst.inc_ports.add(mix64(port), port);
+        count(src, pair);
+        if (&src != &dst) {
+            count(dst, pair);
+            src.peers.add(dst.key.hash(), &dst);
+            dst.peers.add(src.key.hash(), &src);
+        }
+    }
+
+    // Exported records weight the edge with their data rate. Records of a single
+    // instant have no rate and are skipped.
+    template <typename Record>
+    void on_record(const Record &flow) {
+        const auto &stats = flow.bidirectional;
+        if (stats.duration_ms <= 0) {
+            return;
+        }
+        double rate = static_cast<double>(stats.byte_count) / stats.duration_ms;
+        const auto &pair = flow.service_pair;
+        auto &src = host(pair.src_service.ip_addr, pair.ip_version);
+        auto &dst = host(pair.dst_service.ip_addr, pair.ip_version);
+        src.data_rate.update(rate);
+        if (&src != &dst) {
+            dst.data_rate.update(rate);
+        }
+    }
+
+    // Writes out the interval in progress.
+    void finish() {
+        if (!order_.empty()) {
+            export_window();
+        }
+        writer_.close();
+    }
+
+    size_t peak_size() const { return peak_size_; }
+
+  private:
+    inline HostState &host(const IpAddress &ip_addr, uint8_t ip_version) {
+        HostKey key{ip_addr, ip_version};
+        auto [it, success] = index_.try_emplace(key, nullptr);
+        if (success) {
+            it->second = hosts_.create(key);
+            order_.push_back(it->second);
+        }
+        return *it->second;
+    }
+
+    static inline void count(HostState &state, const ServicePair &pair) {
+        switch (pair.transport_protocol()) {
+        case Tins::Constants::IP::e::PROTO_TCP:
+            state.tcp_count++;
+            break;
+        case Tins::Constants::IP::e::PROTO_UDP:
+            state.udp_count++;
+            break;
+        default:
+            state.nontransport_count++;
+            break;
+        }
+        if (pair.ip_version == ServicePair::IPv6) {
+            state.ip6_count++;
+        } else {
+            state.ip_count++;
+        }
+    }
+
+    // Hosts are written in the order they first appeared in the interval.
+    void export_window() {
+        peak_size_ = std::max(peak_size_, order_.size());
+        for (const auto *state : order_) {
+            writer_.write_row(node(*state));
+        }
+        order_.clear();
+        index_.clear();
+        hosts_.clear();
+    }
+
+    NetNode node(const HostState &state) const {
+        NetNode node;
+        node.host = state.key;
+        node.window_start = window_start_;
+        node.window_end = window_end_;
+        node.inc_port = std::llround(state.inc_ports.distinct());
+        node.out_port = std::llround(state.out_ports.distinct());
+        node.inc_pe = state.inc_ports.entropy();
+        node.out_pe = state.out_ports.entropy();
+        node.udp_count = state.udp_count;
+        node.tcp_count = state.tcp_count;
+        node.ip_count = state.ip_count;
+        node.ip6_count = state.ip6_count;
+        node.nontransport_count = state.nontransport_count;
+        node.degree = std::llround(state.peers.distinct());
+        for (const auto &peer : state.peers) {
+            node.peer_degree.update(std::round(peer.value->peers.distinct()));
+        }
+        node.data_rate = state.data_rate;
+        node.connectivity = connectivity(state);
+        return node;
+    }
+
+    // Local clustering coefficient over the sampled peers: exact while every host
+    // involved has no more than FLOWMETER_HOST_SAMPLE peers, an underestimate beyond.
+    static double connectivity(const HostState &state) {
+        const auto &peers = state.peers;
+        if (peers.size < 2) {
+            return 0;
+        }
+        uint64_t linked = 0;
+        for (const auto *a = peers.begin(); a != peers.end(); a++) {
+            for (const auto *b = a + 1; b != peers.end(); b++) {
+                linked += a->value->peers.find(b->hash) || b->value->peers.find(a->hash);
+            }
+        }
+        uint64_t pairs = static_cast<uint64_t>(peers.size) * (peers.size - 1) / 2;
+        return static_cast<double>(linked) / static_cast<double>(pairs);
+    }
+
+    CsvWriter writer_;
+    double interval_;
+    double window_start_{0};
+    double window_end_{0};
+    absl::flat_hash_map<HostKey, HostState *> index_;
+    SlabPool<HostState> hosts_;
+    // Hosts of the current interval in order of appearance.
+    std::vector<HostState *> order_;
+    size_t peak_size_{0};
+};
+
+} // end namespace Net
+
+#endif
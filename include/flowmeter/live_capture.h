@@ -0,0 +1,277 @@
+#ifndef FLOWMETER_LIVE_CAPTURE_H
+#define FLOWMETER_LIVE_CAPTURE_H
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+#include "flowmeter/dissector.h"
+
+namespace Net {
+
+// Kernel and ring counters of a live capture. The kernel counters are cumulative since
+// the socket was opened; occupancy is the share of ring blocks handed to user space
+// but not yet given back, sampled every time a block is taken.
+struct CaptureStats {
+    uint64_t packets{0};
+    uint64_t drops{0};
+    uint64_t freezes{0};
+    uint32_t blocks{0};
+    uint32_t occupied_blocks{0};
+    uint32_t peak_occupied_blocks{0};
+};
+
+// Capture from a network interface through a PACKET_MMAP TPACKET_V3 ring. The kernel
+// fills whole blocks of frames; next_batch() hands out every frame of one block as
+// RawPacket views into the ring and gives the block back on the following call, so
+// there is neither a copy nor a system call per packet. Sockets that share a
+// `fanout_group` split the traffic between them by a symmetric flow hash, which keeps
+// both directions of a flow on the same socket.
+class LiveCapture {
+  public:
+    static constexpr uint32_t DEFAULT_BLOCK_SIZE = 1 << 22;
+    static constexpr uint32_t DEFAULT_BLOCK_COUNT = 64;
+    static constexpr uint32_t FRAME_SIZE = 1 << 11;
+    static constexpr uint32_t BLOCK_TIMEOUT_MS = 50;
+    static constexpr int POLL_TIMEOUT_MS = 100;
+
+    LiveCapture(const std::string &interface, int fanout_group = -1,
+                uint32_t block_size = DEFAULT_BLOCK_SIZE,
+                uint32_t block_count = DEFAULT_BLOCK_COUNT)
+        : interface_(interface), block_size_(block_size), block_count_(block_count) {
+        fd_ = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+        if (fd_ < 0) {
+            fail("open a packet socket");
+        }
+        try {
+            setup(fanout_group);
+        } catch (...) {
+            release();
+            throw;
+        }
+    }
+
+    LiveCapture(const LiveCapture &) = delete;
+    LiveCapture &operator=(const LiveCapture &) = delete;
+
+    ~LiveCapture() { release(); }
+
+    const std::string &interface() const { return interface_; }
+
+    // Live captures have a single interface.
+    size_t interface_count() const { return 1; }
+
+    uint32_t link_type(size_t) const { return link_type_; }
+
+    // Asks next_batch() to return false at its next opportunity; safe to call from
+    // another thread or a signal handler.
+    void stop() { stopped_.store(true, std::memory_order_relaxed); }
+
+    // Replaces the contents of `batch` with the frames of the next filled block. If no
+    // block fills within POLL_TIMEOUT_MS the batch comes back empty, which lets the
+    // caller expire flows on a quiet link. Returns false once stop() was called.
+    bool next_batch(std::vector<RawPacket> &batch) {
+        batch.clear();
+        release_block();
+        if (stopped_.load(std::memory_order_relaxed)) {
+            return false;
+        }
+
+        auto *block = block_at(current_);
+        if (!block_ready(block)) {
+            pollfd pfd{fd_, POLLIN | POLLERR, 0};
+            if (poll(&pfd, 1, POLL_TIMEOUT_MS) < 0 && errno != EINTR) {
+                fail("poll");
+            }
+            if (!block_ready(block)) {
+                return !stopped_.load(std::memory_order_relaxed);
+            }
+        }
+
+        held_ = true;
+        sample_occupancy();
+        auto *frame = reinterpret_cast<uint8_t *>(block) +
+                      block->hdr.bh1.offset_to_first_pkt;
+        for (uint32_t i = 0; i < block->hdr.bh1.num_pkts; i++) {
+            auto *header = reinterpret_cast<tpacket3_hdr *>(frame);
+            if (!skip_outgoing_ || !is_outgoing(header)) {
+                batch.push_back(RawPacket{frame + header->tp_mac, header->tp_snaplen,
+                                          header->tp_len,
+                                          static_cast<double>(header->tp_sec) +
+                                              static_cast<double>(header->tp_nsec) /
+                                                  1'000'000'000,
+                                          0});
+            }
+            frame += header->tp_next_offset;
+        }
+        return true;
+    }
+
+    // Wall-clock time on the scale of packet timestamps, for expiring flows while the
+    // link is quiet.
+    double clock() const {
+        timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        return static_cast<double>(now.tv_sec) + static_cast<double>(now.tv_nsec) / 1e9;
+    }
+
+    // Reading the kernel counters resets them, so they are accumulated here.
+    CaptureStats stats() {
+        tpacket_stats_v3 kernel{};
+        socklen_t length = sizeof(kernel);
+        if (getsockopt(fd_, SOL_PACKET, PACKET_STATISTICS, &kernel, &length) == 0) {
+            stats_.packets += kernel.tp_packets;
+            stats_.drops += kernel.tp_drops;
+            stats_.freezes += kernel.tp_freeze_q_cnt;
+        }
+        return stats_;
+    }
+
+  private:
+    std::string interface_;
+    int fd_{-1};
+    uint32_t block_size_;
+    uint32_t block_count_;
+    uint8_t *ring_{nullptr};
+    size_t ring_size_{0};
+    uint32_t current_{0};
+    bool held_{false};
+    uint32_t link_type_{LINKTYPE_ETHERNET};
+    bool skip_outgoing_{false};
+    std::atomic<bool> stopped_{false};
+    CaptureStats stats_;
+
+    [[noreturn]] void fail(const std::string &what) const {
+        throw std::runtime_error("Unable to " + what + " on " + interface_ + ": " +
+                                 std::strerror(errno));
+    }
+
+    void setup(int fanout_group) {
+        int version = TPACKET_V3;
+        if (setsockopt(fd_, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+            fail("select TPACKET_V3");
+        }
+
+        tpacket_req3 request{};
+        request.tp_block_size = block_size_;
+        request.tp_block_nr = block_count_;
+        request.tp_frame_size = FRAME_SIZE;
+        request.tp_frame_nr = block_size_ / FRAME_SIZE * block_count_;
+        request.tp_retire_blk_tov = BLOCK_TIMEOUT_MS;
+        if (setsockopt(fd_, SOL_PACKET, PACKET_RX_RING, &request, sizeof(request)) < 0) {
+            fail("create the receive ring");
+        }
+        ring_size_ = static_cast<size_t>(block_size_) * block_count_;
+        void *ring = mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_LOCKED, fd_, 0);
+        if (ring == MAP_FAILED) {
+            // Locking the ring is only an optimization.
+            ring = mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        }
+        if (ring == MAP_FAILED) {
+            fail("map the receive ring");
+        }
+        ring_ = static_cast<uint8_t *>(ring);
+        stats_.blocks = block_count_;
+
+        ifreq request_if{};
+        std::strncpy(request_if.ifr_name, interface_.c_str(), IFNAMSIZ - 1);
+        if (ioctl(fd_, SIOCGIFINDEX, &request_if) < 0) {
+            fail("find the interface");
+        }
+        sockaddr_ll address{};
+        address.sll_family = AF_PACKET;
+        address.sll_protocol = htons(ETH_P_ALL);
+        address.sll_ifindex = request_if.ifr_ifindex;
+        if (bind(fd_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0) {
+            fail("bind");
+        }
+
+        if (ioctl(fd_, SIOCGIFHWADDR, &request_if) == 0) {
+            auto family = request_if.ifr_hwaddr.sa_family;
+            // Loopback frames carry an all-zero Ethernet header, and every packet is seen
+            // once leaving and once arriving; only the arriving copy is kept.
+            skip_outgoing_ = family == ARPHRD_LOOPBACK;
+            if (family != ARPHRD_ETHER && family != ARPHRD_LOOPBACK) {
+                link_type_ = LINKTYPE_RAW;
+            }
+        }
+
+        if (fanout_group >= 0) {
+            int fanout = (fanout_group & 0xFFFF) |
+                         ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+            if (setsockopt(fd_, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) < 0) {
+                fail("join fanout group " + std::to_string(fanout_group));
+            }
+        }
+    }
+
+    void release() {
+        if (ring_) {
+            munmap(ring_, ring_size_);
+            ring_ = nullptr;
+        }
+        if (fd_ >= 0) {
+            close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    inline tpacket_block_desc *block_at(uint32_t index) const {
+        auto offset = static_cast<size_t>(index) * block_size_;
+        return reinterpret_cast<tpacket_block_desc *>(ring_ + offset);
+    }
+
+    inline static bool block_ready(tpacket_block_desc *block) {
+        return __atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+               TP_STATUS_USER;
+    }
+
+    inline void release_block() {
+        if (held_) {
+            __atomic_store_n(&block_at(current_)->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                             __ATOMIC_RELEASE);
+            current_ = (current_ + 1) % block_count_;
+            held_ = false;
+        }
+    }
+
+    // Blocks are filled in ring order, so the occupied ones are those from the current
+    // block onwards that are still marked as belonging to user space.
+    inline void sample_occupancy() {
+        uint32_t occupied = 0;
+        while (occupied < block_count_ &&
+               block_ready(block_at((current_ + occupied) % block_count_))) {
+            occupied++;
+        }
+        stats_.occupied_blocks = occupied;
+        stats_.peak_occupied_blocks = std::max(stats_.peak_occupied_blocks, occupied);
+    }
+
+    inline static bool is_outgoing(const tpacket3_hdr *header) {
+        auto *link = reinterpret_cast<const sockaddr_ll *>(
+            reinterpret_cast<const uint8_t *>(header) +
+            TPACKET_ALIGN(sizeof(tpacket3_hdr)));
+        return link->sll_pkttype == PACKET_OUTGOING;
+    }
+};
+
+} // end namespace Net
+
+#endif
@@ -0,0 +1,277 @@
+#ifndef FLOWMETER_LIVE_METER_H
+#define FLOWMETER_LIVE_METER_H
+
+#include <atomic>
+#include <csignal>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "flowmeter/constants.h"
+#include "flowmeter/dissector.h"
+#include "flowmeter/features.h"
+#include "flowmeter/flow_table.h"
+#include "flowmeter/live_capture.h"
+#include "flowmeter/meter.h"
+#include "flowmeter/sharded_meter.h"
+#include "flowmeter/spsc_ring.h"
+
+namespace Net {
+
+// Meters traffic captured from a network interface until interrupted (SIGINT or
+// SIGTERM), stop() is called, or `duration` seconds have passed. With more than one
+// thread, every worker opens its own capture ring in a shared PACKET_FANOUT group, so
+// the kernel spreads flows across workers and no packet is handed between threads;
+// the calling thread only collects the exported records and writes them out.
+class LiveMeter {
+  public:
+    LiveMeter(const std::string &interface, const std::string &output_file,
+              const double &active_timeout, const double &idle_timeout,
+              const double &timer_resolution = Meter::default_timer_resolution_,
+              const uint32_t &threads = 1, const OutputFormat &format = OutputFormat::CSV,
+              const double &duration = 0,
+              const FeatureProfile &profile = FeatureProfile::FULL)
+        : interface_(interface), output_path_(output_file),
+          active_timeout_(active_timeout), idle_timeout_(idle_timeout),
+          timer_resolution_(timer_resolution), threads_(std::max<uint32_t>(threads, 1)),
+          format_(format), duration_(duration), profile_(profile) {}
+
+    void run() {
+        stopped_.store(false, std::memory_order_relaxed);
+        interrupted_.store(false, std::memory_order_relaxed);
+        evicted_.store(0);
+        struct sigaction action {};
+        struct sigaction old_int {};
+        struct sigaction old_term {};
+        action.sa_handler = [](int) {
+            interrupted_.store(true, std::memory_order_relaxed);
+        };
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGINT, &action, &old_int);
+        sigaction(SIGTERM, &action, &old_term);
+
+        try {
+            std::vector<std::unique_ptr<LiveCapture>> captures;
+            int group = threads_ > 1 ? static_cast<int>(getpid() & 0xFFFF) : -1;
+            for (uint32_t i = 0; i < threads_; i++) {
+                captures.push_back(std::make_unique<LiveCapture>(interface_, group));
+            }
+            std::cout << "Capturing on " << interface_ << " with " << threads_
+                      << (threads_ > 1 ? " workers" : " worker") << std::endl;
+
+            deadline_ = duration_ > 0 ? captures[0]->clock() + duration_ : 0;
+            auto pkt_count = with_profile(profile_, [this, &captures](auto record) {
+                using Record = typename decltype(record)::type;
+                if (format_ == OutputFormat::COLUMNAR) {
+                    ColumnarSink<Record> sink(output_path_);
+                    return meter<Record>(captures, sink);
+                }
+                CsvSink<Record> sink(output_path_);
+                return meter<Record>(captures, sink);
+            });
+            report(captures, pkt_count);
+        } catch (...) {
+            sigaction(SIGINT, &old_int, nullptr);
+            sigaction(SIGTERM, &old_term, nullptr);
+            throw;
+        }
+        sigaction(SIGINT, &old_int, nullptr);
+        sigaction(SIGTERM, &old_term, nullptr);
+    }
+
+    // Bounds the flow tables; each worker gets an equal share of `limits`.
+    void limit_flows(const FlowLimits &limits) { limits_ = limits; }
+
+    // Ends closed TCP connections early; see FlowTable::set_session_linger.
+    void end_sessions(const double &linger) { session_linger_ = linger; }
+
+    // Ends a run() in progress from another thread.
+    void stop() { stopped_.store(true, std::memory_order_relaxed); }
+
+  private:
+    template <typename Record, typename Sink>
+    uint64_t meter(std::vector<std::unique_ptr<LiveCapture>> &captures, Sink &sink) {
+        using Output = ShardOutput<Record>;
+        uint64_t pkt_count = 0;
+        if (threads_ == 1) {
+            FlowTable<Sink, Record> table(sink, active_timeout_, idle_timeout_,
+                                          timer_resolution_);
+            table.set_limits(limits_);
+            table.set_session_linger(session_linger_);
+            pkt_count = capture<Record>(*captures[0], table, 0);
+            evicted_ += table.evicted();
+            sink.close();
+            return pkt_count;
+        }
+
+        std::vector<std::unique_ptr<SpscRing<Output>>> outputs;
+        for (uint32_t i = 0; i < threads_; i++) {
+            outputs.push_back(std::make_unique<SpscRing<Output>>(output_capacity_));
+        }
+        std::vector<uint64_t> counts(threads_, 0);
+        std::vector<std::exception_ptr> errors(threads_);
+        auto stop_all = [&captures]() {
+            for (auto &capture : captures) {
+                capture->stop();
+            }
+        };
+        std::vector<std::thread> workers;
+        for (uint32_t i = 0; i < threads_; i++) {
+            workers.emplace_back([this, &captures, &outputs, &counts, &errors, &stop_all,
+                                  i]() {
+                ShardSink<Record> forward(*outputs[i]);
+                FlowTable<ShardSink<Record>, Record> table(
+                    forward, active_timeout_, idle_timeout_, timer_resolution_, true);
+                table.set_limits(limits_.split(threads_));
+                table.set_session_linger(session_linger_);
+                try {
+                    counts[i] = capture<Record>(*captures[i], table, i);
+                } catch (...) {
+                    errors[i] = std::current_exception();
+                    stop_all();
+                }
+                evicted_ += table.evicted();
+                forward.done();
+            });
+        }
+
+        auto error = collect(outputs, sink, stop_all);
+        for (auto &worker : workers) {
+            worker.join();
+        }
+        for (auto &worker_error : errors) {
+            if (!error) {
+                error = worker_error;
+            }
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        sink.close();
+        for (auto count : counts) {
+            pkt_count += count;
+        }
+        return pkt_count;
+    }
+
+    // Capture loop of one ring. Packet sequence numbers are strided by worker so that
+    // they, and the init_ids derived from them, are unique across workers.
+    template <typename Record, typename Table>
+    uint64_t capture(LiveCapture &source, Table &table, uint32_t worker) {
+        Dissector dissector(source.link_type(0));
+        std::vector<RawPacket> batch;
+        PacketDescriptor packet;
+        uint64_t pkt_count = 0;
+
+        while (source.next_batch(batch)) {
+            // Keep expiring flows on a quiet link.
+            if (batch.empty()) {
+                table.advance(source.clock());
+            }
+            for (const auto &raw : batch) {
+                auto seq = pkt_count++ * threads_ + worker;
+                table.advance(raw.timestamp);
+                if (dissector.dissect(raw, packet)) {
+                    table.process(packet.pair, PacketFeatures(packet, Record::PAYLOAD),
+                                  seq);
+                }
+            }
+            if (should_stop(source)) {
+                source.stop();
+            }
+        }
+
+        table.finish();
+        return pkt_count;
+    }
+
+    // Drains the workers' rings into `sink` in arrival order, numbering flows densely
+    // in the order their creation is seen, until every worker is done. If an item
+    // cannot be written, `stop_all` ends the captures and the rest is drained unwritten
+    // so that the workers can finish; the error is returned.
+    template <typename Output, typename Sink, typename Stop>
+    std::exception_ptr collect(std::vector<std::unique_ptr<SpscRing<Output>>> &outputs,
+                               Sink &sink, Stop &stop_all) {
+        CreationOrder ids;
+        size_t finished = 0;
+        uint32_t spins = 0;
+        std::exception_ptr error;
+        Output item;
+
+        while (finished < outputs.size()) {
+            bool idle = true;
+            for (auto &output : outputs) {
+                while (output->try_pop(item)) {
+                    idle = false;
+                    if (item.kind == Output::DONE) {
+                        finished++;
+                        continue;
+                    }
+                    if (error) {
+                        continue;
+                    }
+                    try {
+                        ids.emit(item, sink);
+                    } catch (...) {
+                        error = std::current_exception();
+                        stop_all();
+                    }
+                }
+            }
+            if (idle) {
+                SpscRing<Output>::backoff(spins);
+            } else {
+                spins = 0;
+            }
+        }
+        return error;
+    }
+
+    inline bool should_stop(const LiveCapture &source) const {
+        return stopped_.load(std::memory_order_relaxed) ||
+               interrupted_.load(std::memory_order_relaxed) ||
+               (deadline_ > 0 && source.clock() >= deadline_);
+    }
+
+    void report(std::vector<std::unique_ptr<LiveCapture>> &captures, uint64_t pkt_count) {
+        std::cout << "Metered " << pkt_count << " packets on " << interface_ << std::endl;
+        for (size_t i = 0; i < captures.size(); i++) {
+            auto stats = captures[i]->stats();
+            std::cout << "Worker " << i << ": " << stats.packets << " received, "
+                      << stats.drops << " dropped, " << stats.freezes
+                      << " ring freezes, peak ring occupancy "
+                      << stats.peak_occupied_blocks << "/" << stats.blocks << " blocks"
+                      << std::endl;
+        }
+        if (auto evicted = evicted_.load()) {
+            std::cout << "Evicted " << evicted << " flows to stay within the flow limits"
+                      << std::endl;
+        }
+    }
+
+    std::string interface_;
+    std::string output_path_;
+    double active_timeout_;
+    double idle_timeout_;
+    double timer_resolution_;
+    uint32_t threads_;
+    OutputFormat format_;
+    double duration_;
+    FeatureProfile profile_;
+    FlowLimits limits_;
+    double session_linger_{-1};
+    std::atomic<uint64_t> evicted_{0};
+    double deadline_{0};
+    std::atomic<bool> stopped_{false};
+    inline static std::atomic<bool> interrupted_{false};
+    static constexpr size_t output_capacity_{8192};
+};
+
+} // end namespace Net
+
+#endif
@@ -1,21 +1,29 @@
 #ifndef FLOWMETER_METER_H
 #define FLOWMETER_METER_H
 
-#include "absl/container/flat_hash_map.h"
 #include "tins/ethernetII.h"
 #include "tins/ip.h"
 #include "tins/ipv6.h"
 #include "tins/packet.h"
-#include "tins/sniffer.h"
 #include "tins/tcp.h"
 #include "tins/udp.h"
-#include <fstream>
+#include <algorithm>
+#include <array>
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <vector>
 
+#include "flowmeter/checkpoint.h"
+#include "flowmeter/columnar.h"
 #include "flowmeter/constants.h"
+#include "flowmeter/csv_writer.h"
+#include "flowmeter/dissector.h"
 #include "flowmeter/flow.h"
+#include "flowmeter/flow_table.h"
+#include "flowmeter/host_table.h"
+#include "flowmeter/pcap_reader.h"
+#include "flowmeter/stats.h"
 
 using high_resolution_clock = std::chrono::high_resolution_clock;
 
@@ -24,97 +32,131 @@ namespace Net {
 template <typename IpVersion, typename TransportProto>
 struct MeterImpl {};
 
-class Meter {
+// Writes every exported record as one CSV row, starting with the column header.
+template <typename Record = NetworkFlow>
+class CsvSink {
   public:
-    Meter(const std::string &input_file, const std::string &output_file,
-          const double &active_timeout, const double &idle_timeout)
-        : sniffer_(input_file), pcap_path_(input_file), csv_path_(output_file),
-          active_timeout_(active_timeout), idle_timeout_(idle_timeout) {}
+    CsvSink(const std::string &path) : writer_(path) {
+        writer_.write_line(Record::column_names());
+    }
 
-    void run() {
-        std::cout << "Processing " << pcap_path_ << std::endl;
-        auto start_time = high_resolution_clock::now();
-        auto pkt_count = 0;
-        double last_packet_ts;
-        double last_check;
-        uint64_t init_id = 0;
-        std::ofstream out_file(csv_path_);
+    inline void on_record(const Record &flow, const ExportPosition &) {
+        writer_.write_row(flow);
+    }
 
-        // TODO: create header in CSV file before starting this loop
+    inline void on_create(const Record &, const ExportPosition &) {}
 
-        while (packet_ = sniffer_.next_packet()) {
-            auto packet_ts = get_packet_timestamp(packet_);
+    inline void on_retire(const Record &, const ExportPosition &) {}
 
-            if (!pkt_count) {
-                last_packet_ts = packet_ts;
-                last_check = packet_ts;
-            }
+    void close() { writer_.close(); }
 
-            pkt_count++;
-
-            auto time_delta = packet_ts - last_check;
-
-            if (time_delta > status_increment_) {
-                if (flow_cache_.size()) {
-                    auto check_timeout = [packet_ts, &out_file, this](auto &it) {
-                        auto time_since_start =
-                            packet_ts - it.second.bidirectional.first_seen_ms;
-                        auto time_since_update =
-                            packet_ts - it.second.bidirectional.last_seen_ms;
-
-                        if (time_since_start >= this->active_timeout_) {
-                            it.second.exp_code = ExpirationCode::ACTIVE_TIMEOUT;
-                            it.second.finalize();
-                            out_file << it.second.to_string() << "\n";
-                            it.second.sub_init_id++;
-                            it.second.exp_code = ExpirationCode::ALIVE;
-                            it.second.reset();
-                            return false;
-                        } else if (time_since_update >= this->idle_timeout_) {
-                            it.second.exp_code = ExpirationCode::IDLE_TIMEOUT;
-                            it.second.finalize();
-                            out_file << it.second.to_string() << "\n";
-                            return true;
-                        }
-
-                        return false;
-                    };
-
-                    absl::erase_if(flow_cache_, check_timeout);
-                }
+    uint64_t bytes_written() const { return writer_.bytes_written(); }
 
-                last_check = packet_ts;
-            }
+  private:
+    CsvWriter writer_;
+};
 
-            ServicePair service_pair_{packet_};
+// Writes exported records to a columnar file; see columnar.h for the layout.
+template <typename Record = NetworkFlow>
+class ColumnarSink {
+  public:
+    ColumnarSink(const std::string &path) : writer_(path, Record(ServicePair(), 0, 0)) {}
 
-            if (!service_pair_) {
-                continue;
-            }
+    inline void on_record(const Record &flow, const ExportPosition &) {
+        writer_.write_row(flow);
+    }
 
-            auto [it, success] = flow_cache_.emplace(
-                service_pair_, NetworkFlow(service_pair_, init_id, default_sub_id_));
+    inline void on_create(const Record &, const ExportPosition &) {}
 
-            if (pkt_count == 1) {
-                out_file << it->second.column_names() << "\n";
-            }
+    inline void on_retire(const Record &, const ExportPosition &) {}
 
-            if (success) {
-                init_id++;
-            }
+    void close() { writer_.close(); }
 
-            it->second.update(packet_, service_pair_, packet_ts);
+    uint64_t bytes_written() const { return writer_.bytes_written(); }
 
-            last_packet_ts = packet_ts;
-        }
+  private:
+    ColumnarWriter writer_;
+};
+
+// Passes every event on to `Sink` and keeps a HostTable up to date with it.
+template <typename Sink>
+class HostSink {
+  public:
+    HostSink(Sink &sink, HostTable &hosts) : sink_(sink), hosts_(hosts) {}
+
+    template <typename Record>
+    inline void on_record(const Record &flow, const ExportPosition &position) {
+        hosts_.on_record(flow);
+        sink_.on_record(flow, position);
+    }
 
-        for (auto &[key, flow] : flow_cache_) {
-            flow.exp_code = ExpirationCode::SESSION_END;
-            out_file << flow.to_string() << "\n";
+    template <typename Record>
+    inline void on_create(const Record &flow, const ExportPosition &position) {
+        hosts_.on_create(flow);
+        sink_.on_create(flow, position);
+    }
+
+    template <typename Record>
+    inline void on_retire(const Record &flow, const ExportPosition &position) {
+        sink_.on_retire(flow, position);
+    }
+
+    void close() { sink_.close(); }
+
+    uint64_t bytes_written() const { return sink_.bytes_written(); }
+
+  private:
+    Sink &sink_;
+    HostTable &hosts_;
+};
+
+enum class OutputFormat { CSV, COLUMNAR };
+
+// Meters one capture file, or a sequence of them as if they were one: flows carry over
+// from each file into the next. With a checkpoint the flows still live at the end are
+// saved rather than exported, for a later run to resume from.
+class Meter {
+  public:
+    Meter(const std::string &input_file, const std::string &output_file,
+          const double &active_timeout, const double &idle_timeout,
+          const double &timer_resolution = default_timer_resolution_,
+          const OutputFormat &format = OutputFormat::CSV,
+          const FeatureProfile &profile = FeatureProfile::FULL,
+          const std::string &host_output_file = "",
+          const double &host_interval = default_host_interval_)
+        : Meter(std::vector<std::string>{input_file}, output_file, active_timeout,
+                idle_timeout, timer_resolution, format, profile, host_output_file,
+                host_interval) {}
+
+    // Reads the files of `input_files` in order, directories as the files in them; see
+    // capture_files().
+    Meter(const std::vector<std::string> &input_files, const std::string &output_file,
+          const double &active_timeout, const double &idle_timeout,
+          const double &timer_resolution = default_timer_resolution_,
+          const OutputFormat &format = OutputFormat::CSV,
+          const FeatureProfile &profile = FeatureProfile::FULL,
+          const std::string &host_output_file = "",
+          const double &host_interval = default_host_interval_)
+        : pcap_paths_(capture_files(input_files)), output_path_(output_file),
+          active_timeout_(active_timeout), idle_timeout_(idle_timeout),
+          timer_resolution_(timer_resolution), format_(format), profile_(profile),
+          host_path_(host_output_file), host_interval_(host_interval) {
+        if (pcap_paths_.empty()) {
+            throw std::runtime_error("No capture files to read");
         }
-        flow_cache_.clear();
+    }
 
-        out_file.close();
+    void run() {
+        auto start_time = high_resolution_clock::now();
+        auto pkt_count = with_profile(profile_, [this](auto record) {
+            using Record = typename decltype(record)::type;
+            if (format_ == OutputFormat::COLUMNAR) {
+                ColumnarSink<Record> sink(output_path_);
+                return meter<Record>(sink);
+            }
+            CsvSink<Record> sink(output_path_);
+            return meter<Record>(sink);
+        });
 
         // Display meter summary
         auto end_time = high_resolution_clock::now();
@@ -127,20 +169,259 @@ class Meter {
                   << std::endl;
         std::cout << std::setprecision(MAX_DOUBLE_PRECISION) << pkts_per_sec_
                   << " pkts/sec" << std::endl;
+        if (peak_flows_) {
+            std::cout << "Flow table peaked at " << peak_flows_ << " flows in "
+                      << table_bytes_ << " bytes, " << table_bytes_ / peak_flows_
+                      << " bytes per flow" << std::endl;
+        }
+        if (evicted_) {
+            std::cout << "Evicted " << evicted_ << " flows to stay within the flow limits"
+                      << std::endl;
+        }
+        if (peak_hosts_) {
+            std::cout << "Host table peaked at " << peak_hosts_ << " hosts per interval"
+                      << std::endl;
+        }
+    }
+
+    // Writes RuntimeStats to `path` every `interval` seconds while run() is in
+    // progress, and once more at the end. Requires a build with FLOWMETER_STATS.
+    void export_stats(const std::string &path,
+                      const StatsFormat &format = StatsFormat::JSON,
+                      const double &interval = default_stats_interval_) {
+        if constexpr (!STATS_ENABLED) {
+            throw std::runtime_error("Runtime stats need a build with FLOWMETER_STATS");
+        }
+        stats_path_ = path;
+        stats_format_ = format;
+        stats_interval_ = interval;
+    }
+
+    // Starts from the flows saved in the checkpoint at `path`, skipping the input files
+    // up to the last one the checkpoint had read, if they are among the inputs.
+    void resume(const std::string &path) { resume_path_ = path; }
+
+    // Saves the flows still live at the end to a checkpoint at `path` instead of
+    // exporting them as SESSION_END.
+    void checkpoint(const std::string &path) { checkpoint_path_ = path; }
+
+    // Meters only the packets `sampler` keeps; see Sampler.
+    void sample(const Sampler &sampler) {
+        if (!sampler.packet_rate || !sampler.flow_rate) {
+            throw std::invalid_argument("Sampling rates must be at least 1");
+        }
+        sampler_ = sampler;
     }
 
+    // Bounds the flow table; see FlowTable::set_limits.
+    void limit_flows(const FlowLimits &limits) { limits_ = limits; }
+
+    // Ends closed TCP connections early; see FlowTable::set_session_linger.
+    void end_sessions(const double &linger) { session_linger_ = linger; }
+
+    static constexpr double default_timer_resolution_{0.01};
+    static constexpr double default_host_interval_{60};
+    static constexpr double default_stats_interval_{10};
+
   private:
-    Tins::Packet packet_;
-    Tins::FileSniffer sniffer_;
-    std::string pcap_path_;
-    std::string csv_path_;
+    // Runs the whole input through a flow table feeding `sink`, and the host table when
+    // one was asked for; returns the packet count.
+    template <typename Record, typename Sink>
+    uint64_t meter(Sink &sink) {
+        if (host_path_.empty()) {
+            return meter<Record>(sink, nullptr);
+        }
+        HostTable hosts(host_path_, host_interval_);
+        HostSink<Sink> tee(sink, hosts);
+        auto pkt_count = meter<Record>(tee, &hosts);
+        hosts.finish();
+        peak_hosts_ = hosts.peak_size();
+        return pkt_count;
+    }
+
+    template <typename Record, typename Sink>
+    uint64_t meter(Sink &sink, HostTable *hosts) {
+        FlowTable<Sink, Record> table(sink, active_timeout_, idle_timeout_,
+                                      timer_resolution_);
+        table.set_limits(limits_);
+        table.set_session_linger(session_linger_);
+        table.set_sampling(sampler_);
+        CheckpointState state;
+        state.active_timeout = active_timeout_;
+        state.idle_timeout = idle_timeout_;
+        state.timer_resolution = timer_resolution_;
+        state.packet_sampling_rate = sampler_.packet_rate;
+        state.flow_sampling_rate = sampler_.flow_rate;
+        size_t first_file = 0;
+        if (!resume_path_.empty()) {
+            state = Checkpoint::load<Record>(resume_path_, table, state);
+            auto last =
+                std::find(pcap_paths_.begin(), pcap_paths_.end(), state.last_input);
+            if (last != pcap_paths_.end()) {
+                first_file = static_cast<size_t>(last - pcap_paths_.begin()) + 1;
+            }
+            std::cout << "Resumed " << table.size() << " flows from " << resume_path_
+                      << std::endl;
+        }
+        // Sequence numbers go on from those of the checkpoint.
+        uint64_t pkt_count = state.packets;
+        const uint64_t first_packet = pkt_count;
+        RuntimeStats stats;
+        std::unique_ptr<StatsWriter> stats_writer;
+        RuntimeStats *instrumented = nullptr;
+        if constexpr (STATS_ENABLED) {
+            if (!stats_path_.empty()) {
+                stats_writer = std::make_unique<StatsWriter>(stats_path_, stats_format_,
+                                                             stats_interval_);
+                instrumented = &stats;
+                table.set_stats(instrumented);
+            }
+        }
+
+        std::vector<RawPacket> batch;
+        for (size_t file = first_file; file < pcap_paths_.size(); file++) {
+            std::cout << "Processing " << pcap_paths_[file] << std::endl;
+            PcapReader reader(pcap_paths_[file]);
+            std::vector<Dissector> dissectors;
+            while (read_batch(reader, batch, instrumented)) {
+                while (dissectors.size() < reader.interface_count()) {
+                    dissectors.emplace_back(reader.link_type(dissectors.size()));
+                }
+                pkt_count = meter_batch<Record>(batch, dissectors, table, hosts, stats,
+                                                instrumented, pkt_count);
+
+                if constexpr (STATS_ENABLED) {
+                    if (stats_writer && stats_writer->due()) {
+                        stats_writer->write(sample(stats, table, sink));
+                    }
+                }
+            }
+            state.last_input = pcap_paths_[file];
+        }
+
+        peak_flows_ = table.peak_size();
+        table_bytes_ = table.memory_bytes();
+        evicted_ = table.evicted();
+        if (checkpoint_path_.empty()) {
+            table.finish();
+        } else {
+            state.packets = pkt_count;
+            Checkpoint::save<Record>(checkpoint_path_, table, state);
+            std::cout << "Saved " << table.size() << " flows to " << checkpoint_path_
+                      << std::endl;
+        }
+
+        sink.close();
+        if constexpr (STATS_ENABLED) {
+            if (stats_writer) {
+                stats_writer->write(sample(stats, table, sink));
+            }
+        }
+        return pkt_count - first_packet;
+    }
+
+    // Meters `batch`, whose first packet has sequence number `seq`; returns the
+    // sequence number after its last. Frames are dissected in place in the file mapping;
+    // libtins only builds a PDU tree for frames the fast path cannot decode.
+    template <typename Record, typename Table>
+    uint64_t meter_batch(const std::vector<RawPacket> &batch,
+                         std::vector<Dissector> &dissectors, Table &table,
+                         HostTable *hosts, RuntimeStats &stats,
+                         RuntimeStats *instrumented, uint64_t seq) {
+        std::array<PacketDescriptor, PREFETCH_BURST> packets;
+        std::array<PacketFeatures, PREFETCH_BURST> features;
+        std::array<HashedKey, PREFETCH_BURST> keys;
+        std::array<bool, PREFETCH_BURST> valid;
+
+        // A burst is dissected, its keys hashed and its flows prefetched before any of it
+        // reaches the table, so that the cache misses of a large table overlap rather
+        // than stall every packet in turn; the table reuses the hashes.
+        for (size_t begin = 0; begin < batch.size(); begin += PREFETCH_BURST) {
+            auto burst = std::min(PREFETCH_BURST, batch.size() - begin);
+            {
+                ScopedStage stage(instrumented, Stage::PARSE);
+                for (size_t i = 0; i < burst; i++) {
+                    // Sampled out packets are not even dissected, and flows that are
+                    // sampled out never reach the payload scan or the table.
+                    const auto &raw = batch[begin + i];
+                    valid[i] = sampler_.keep_packet(seq + i) &&
+                               dissectors[raw.interface].dissect(raw, packets[i]) &&
+                               sampler_.keep_flow(packets[i].pair);
+                    if (!valid[i]) {
+                        continue;
+                    }
+                    features[i] = PacketFeatures(packets[i], Record::PAYLOAD);
+                    keys[i] = HashedKey(packets[i].pair);
+                    table.prefetch(keys[i]);
+                }
+            }
+            {
+                ScopedStage stage(instrumented, Stage::LOOKUP);
+                for (size_t i = 0; i < burst; i++) {
+                    if (valid[i]) {
+                        table.prefetch_flow(keys[i]);
+                    }
+                }
+            }
+
+            for (size_t i = 0; i < burst; i++, seq++) {
+                auto timestamp = batch[begin + i].timestamp;
+                stats.count_packet(timestamp);
+                if (hosts) {
+                    hosts->advance(timestamp);
+                }
+
+                // Only flows whose deadline falls in the ticks we move across are
+                // visited.
+                table.advance(timestamp);
+                if (valid[i]) {
+                    table.process(packets[i].pair, keys[i], features[i], seq);
+                }
+            }
+        }
+        return seq;
+    }
+
+    inline bool read_batch(PcapReader &reader, std::vector<RawPacket> &batch,
+                           RuntimeStats *stats) {
+        ScopedStage stage(stats, Stage::READ);
+        return reader.next_batch(batch);
+    }
+
+    // Fills in the gauges of `stats` from the table and the sink.
+    template <typename Table, typename Sink>
+    static const RuntimeStats &sample(RuntimeStats &stats, const Table &table,
+                                      const Sink &sink) {
+        stats.table_size = table.size();
+        stats.table_capacity = table.capacity();
+        stats.table_bytes = table.memory_bytes();
+        stats.bytes_written = sink.bytes_written();
+        return stats;
+    }
+
+    std::vector<std::string> pcap_paths_;
+    std::string output_path_;
     double seconds_;
     double pkts_per_sec_;
     double active_timeout_;
     double idle_timeout_;
-    static constexpr double status_increment_{1};
-    static constexpr u_int64_t default_sub_id_{0};
-    absl::flat_hash_map<ServicePair, NetworkFlow> flow_cache_;
+    double timer_resolution_;
+    OutputFormat format_;
+    FeatureProfile profile_;
+    std::string host_path_;
+    double host_interval_;
+    std::string stats_path_;
+    StatsFormat stats_format_{StatsFormat::JSON};
+    double stats_interval_{default_stats_interval_};
+    FlowLimits limits_;
+    double session_linger_{-1};
+    Sampler sampler_;
+    std::string resume_path_;
+    std::string checkpoint_path_;
+    uint64_t evicted_{0};
+    size_t peak_flows_{0};
+    size_t table_bytes_{0};
+    size_t peak_hosts_{0};
 };
 
 } // end namespace Net
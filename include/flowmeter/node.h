@@ -1,43 +1,105 @@
 #ifndef FLOWMETER_NODE_H
 #define FLOWMETER_NODE_H
 
+#include "fmt/format.h"
 #include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <string>
+
+#include "flowmeter/distinct_sketch.h"
+#include "flowmeter/statistic.h"
+#include "flowmeter/tins_ext.h"
 
 namespace Net {
 
+// A host, identified by its IP address alone so that every flow it takes part in
+// counts towards the same node whatever the ports, MACs or VLAN.
+struct HostKey {
+    IpAddress ip_addr{};
+    uint8_t ip_version{0};
+
+    bool operator==(const HostKey &key) const {
+        return ip_version == key.ip_version && ip_addr == key.ip_addr;
+    }
+
+    // Seed-free, so that the peer samples and thus the output are the same every run.
+    inline uint64_t hash() const {
+        uint64_t lo;
+        uint64_t hi;
+        std::memcpy(&lo, ip_addr.data(), 8);
+        std::memcpy(&hi, ip_addr.data() + 8, 8);
+        return mix64(mix64(lo ^ ip_version) ^ hi);
+    }
+
+    template <typename H>
+    friend H AbslHashValue(H h, const HostKey &key) {
+        return H::combine(std::move(h), key.hash());
+    }
+};
+
+// Graph features of one host over one export interval, derived from the flows that
+// started in the interval and the flow records exported during it. Counts are exact
+// while a host has at most FLOWMETER_HOST_SAMPLE distinct peers or ports and
+// estimated from a sample of them beyond that.
 struct NetNode {
-    // counts for incoming/outgoing ports
-    uint64_t inc_port;
-    uint64_t out_port;
+    HostKey host;
+    double window_start{0};
+    double window_end{0};
+
+    // distinct ports the host was contacted on, and contacted peers on
+    uint64_t inc_port{0};
+    uint64_t out_port{0};
+
+    // pe = port entropy, in bits
+    double inc_pe{0};
+    double out_pe{0};
+
+    // flows by transport and network protocol
+    uint64_t udp_count{0};
+    uint64_t tcp_count{0};
+
+    uint64_t ip_count{0};
+    uint64_t ip6_count{0};
 
-    // pe = port entropy
-    double inc_pe;
-    double out_pe;
+    uint64_t nontransport_count{0};
 
-    uint64_t udp_count;
-    uint64_t tcp_count;
+    // distinct peers
+    uint64_t degree{0};
 
-    uint64_t ip_count;
-    uint64_t ip6_count;
+    Statistic<double> peer_degree;
 
-    uint64_t nontransport_count;
+    // bytes per second of each exported flow; edge weights-ish
+    Statistic<double> data_rate;
 
-    uint64_t degree;
+    // share of the pairs of peers that are peers of each other
+    double connectivity{0};
 
-    uint64_t min_peer_degree;
-    uint64_t max_peer_degree;
-    double mean_peer_degree;
-    double stddev_peer_degree;
+    static const std::string column_names() {
+        return "window_start,window_end,ip,ip_version,inc_port,out_port,inc_pe,out_pe,"
+               "udp_count,tcp_count,ip_count,ip6_count,nontransport_count,degree,"
+               "min_peer_degree,max_peer_degree,mean_peer_degree,stddev_peer_degree,"
+               "min_data_rate,max_data_rate,mean_data_rate,stddev_data_rate,connectivity";
+    }
 
-    // bytes per second per peer connection
-    // edge weights-ish
-    uint64_t min_data_flow;
-    uint64_t max_data_flow;
-    double mean_data_rate;
-    double stddev_data_rate;
+    template <typename OutputIt>
+    OutputIt format_to(OutputIt out) const {
+        out = fmt::format_to(out, "{},{},", window_start, window_end);
+        out = Net::format_to(out, host.ip_addr, host.ip_version);
+        out = fmt::format_to(out, ",{},{},{},{},{},{},{},{},{},{},{},", host.ip_version,
+                             inc_port, out_port, inc_pe, out_pe, udp_count, tcp_count,
+                             ip_count, ip6_count, nontransport_count, degree);
+        out = peer_degree.format_to(out);
+        *out++ = ',';
+        out = data_rate.format_to(out);
+        return fmt::format_to(out, ",{}", connectivity);
+    }
 
-    // num node pairs in neighborhood / total pairs
-    double connectivity;
+    const std::string to_string() const {
+        fmt::memory_buffer buffer;
+        format_to(std::back_inserter(buffer));
+        return fmt::to_string(buffer);
+    }
 };
 
 } // end namespace Net
@@ -0,0 +1,494 @@
+#ifndef FLOWMETER_PCAP_READER_H
+#define FLOWMETER_PCAP_READER_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "flowmeter/compression.h"
+#include "flowmeter/dissector.h"
+
+namespace Net {
+
+// Reads classic pcap (either byte order, microsecond or nanosecond timestamps) and
+// pcapng files by mapping them into memory. Packets are handed out in batches of
+// RawPacket views into the mapping, so nothing is copied or allocated per packet; the
+// views stay valid for as long as the reader is alive.
+//
+// A file compressed with gzip or zstd is instead decompressed on a DecompressThread and
+// read from a window of the decompressed stream. Its views stay valid only until the
+// next call to next_batch(), and it can only be read from start to end: seek(), resync()
+// and the offsets are meaningless for it.
+class PcapReader {
+  public:
+    static constexpr size_t DEFAULT_BATCH_SIZE = 256;
+
+    static constexpr uint32_t PCAP_MAGIC_USEC = 0xA1B2C3D4;
+    static constexpr uint32_t PCAP_MAGIC_NSEC = 0xA1B23C4D;
+    static constexpr uint32_t PCAPNG_SECTION_HEADER = 0x0A0D0D0A;
+    static constexpr uint32_t PCAPNG_BYTE_ORDER_MAGIC = 0x1A2B3C4D;
+    static constexpr uint32_t PCAPNG_INTERFACE_DESCRIPTION = 1;
+    static constexpr uint32_t PCAPNG_PACKET = 2;
+    static constexpr uint32_t PCAPNG_SIMPLE_PACKET = 3;
+    static constexpr uint32_t PCAPNG_ENHANCED_PACKET = 6;
+    static constexpr uint16_t PCAPNG_OPT_END = 0;
+    static constexpr uint16_t PCAPNG_OPT_TSRESOL = 9;
+    static constexpr uint16_t PCAPNG_OPT_TSOFFSET = 14;
+    static constexpr size_t PCAP_HEADER_SIZE = 24;
+    static constexpr size_t PCAP_RECORD_HEADER_SIZE = 16;
+    static constexpr size_t PCAPNG_BLOCK_MIN_SIZE = 12;
+    // Bounds on record lengths that resync() accepts. The snapshot length in the file
+    // header only raises the first one, since writers often leave it at zero.
+    static constexpr uint32_t MAX_SNAPLEN = 262'144;
+    static constexpr uint32_t MAX_RECORD_LENGTH = 1u << 20;
+    // Consecutive plausible record headers that resync() requires.
+    static constexpr size_t RESYNC_RECORDS = 8;
+    // Decompressed bytes a compressed file's window is topped up to, once fewer than
+    // STREAM_LOW_WATER of them are left unread.
+    static constexpr size_t STREAM_WINDOW = 8 << 20;
+    static constexpr size_t STREAM_LOW_WATER = 1 << 20;
+
+    PcapReader(const std::string &path) : path_(path) {
+        fd_ = open(path.c_str(), O_RDONLY);
+        if (fd_ < 0) {
+            throw std::runtime_error("Unable to open " + path + ": " +
+                                     std::strerror(errno));
+        }
+        struct stat st;
+        if (fstat(fd_, &st) < 0) {
+            close(fd_);
+            throw std::runtime_error("Unable to stat " + path + ": " +
+                                     std::strerror(errno));
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        uint8_t magic[4] = {};
+        auto got = pread(fd_, magic, sizeof(magic), 0);
+        auto compression =
+            compression_of_data(magic, got > 0 ? static_cast<size_t>(got) : 0);
+        if (compression != Compression::NONE) {
+            size_ = 0;
+        }
+        if (size_) {
+            void *mapping = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+            if (mapping == MAP_FAILED) {
+                close(fd_);
+                throw std::runtime_error("Unable to map " + path + ": " +
+                                         std::strerror(errno));
+            }
+            base_ = static_cast<const uint8_t *>(mapping);
+            madvise(mapping, size_, MADV_SEQUENTIAL);
+        }
+        try {
+            if (compression != Compression::NONE) {
+                stream_ = std::make_unique<DecompressThread>(path, compression);
+                buffer_.reserve(STREAM_WINDOW + DecompressThread::CHUNK_SIZE +
+                                Inflater::OUTPUT_STEP);
+                refill();
+            }
+            read_file_header();
+        } catch (...) {
+            release();
+            throw;
+        }
+    }
+
+    PcapReader(const PcapReader &) = delete;
+    PcapReader &operator=(const PcapReader &) = delete;
+
+    ~PcapReader() { release(); }
+
+    const std::string &path() const { return path_; }
+
+    bool is_pcapng() const { return pcapng_; }
+
+    bool is_compressed() const { return stream_ != nullptr; }
+
+    size_t size() const { return size_; }
+
+    // Offset of the next record or block to be read.
+    size_t offset() const { return cursor_; }
+
+    // Offset of the record that `raw`, read from a classic pcap file, came from.
+    inline size_t record_offset(const RawPacket &raw) const {
+        return static_cast<size_t>(raw.data - base_) - PCAP_RECORD_HEADER_SIZE;
+    }
+
+    // Restricts a classic pcap reader to the records that start in [begin, end). `begin`
+    // must be a record boundary, such as one returned by resync().
+    void seek(size_t begin, size_t end) {
+        cursor_ = std::max(begin, PCAP_HEADER_SIZE);
+        end_ = end;
+    }
+
+    // First record boundary of a classic pcap file at or after `offset`, or size() if
+    // there is none. Record headers carry no marker, so a boundary is taken to be the
+    // start of RESYNC_RECORDS headers in a row, or all of those up to the end of the
+    // file, that chain through their lengths and have sane lengths and timestamps.
+    size_t resync(size_t offset) const {
+        for (offset = std::max(offset, PCAP_HEADER_SIZE); offset < size_; offset++) {
+            size_t position = offset;
+            size_t records = 0;
+            uint32_t seconds = 0;
+            while (records < RESYNC_RECORDS && position < size_ &&
+                   plausible_record(position, records ? &seconds : nullptr)) {
+                seconds = read32(position);
+                position += PCAP_RECORD_HEADER_SIZE + read32(position + 8);
+                records++;
+            }
+            if (records == RESYNC_RECORDS || (records && position == size_)) {
+                return offset;
+            }
+        }
+        return size_;
+    }
+
+    // Reads the classic pcap record that starts at `offset`.
+    inline bool read_at(size_t offset, RawPacket &raw) const {
+        return offset < size_ && record_at(offset, raw);
+    }
+
+    // Interfaces seen so far. Classic pcap files have exactly one; pcapng interfaces are
+    // numbered across sections in the order their description blocks appear.
+    size_t interface_count() const { return interfaces_.size(); }
+
+    uint32_t link_type(size_t interface) const { return interfaces_[interface].link_type; }
+
+    // Replaces the contents of `batch` with up to `max_packets` packets. Returns false
+    // once the input is exhausted; a truncated trailing record ends the input.
+    bool next_batch(std::vector<RawPacket> &batch,
+                    size_t max_packets = DEFAULT_BATCH_SIZE) {
+        batch.clear();
+        if (stream_) {
+            refill();
+        }
+        RawPacket raw;
+        while (batch.size() < max_packets) {
+            if (!(pcapng_ ? next_block(raw) : next_record(raw))) {
+                // A record cut off by the end of the window ends the batch early; only
+                // with nothing read yet is the window grown, moving the data.
+                if (!batch.empty() || !stream_ || !extend()) {
+                    break;
+                }
+                continue;
+            }
+            batch.push_back(raw);
+        }
+        return !batch.empty();
+    }
+
+  private:
+    struct Interface {
+        uint32_t link_type;
+        uint64_t units_per_second;
+        int64_t offset;
+    };
+
+    std::string path_;
+    int fd_{-1};
+    const uint8_t *base_{nullptr};
+    size_t size_{0};
+    size_t cursor_{0};
+    size_t end_{SIZE_MAX};
+    uint32_t snaplen_{0};
+    bool swapped_{false};
+    bool pcapng_{false};
+    bool nanosecond_{false};
+    size_t section_base_{0};
+    double last_timestamp_{0};
+    std::vector<Interface> interfaces_;
+    std::unique_ptr<DecompressThread> stream_;
+    std::vector<uint8_t> buffer_;
+    std::vector<uint8_t> chunk_;
+
+    void release() {
+        if (stream_) {
+            stream_.reset();
+            base_ = nullptr;
+        }
+        if (base_) {
+            munmap(const_cast<uint8_t *>(base_), size_);
+            base_ = nullptr;
+        }
+        if (fd_ >= 0) {
+            close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    // Tops a compressed file's window up once little of it is left unread.
+    void refill() {
+        if (size_ - cursor_ >= STREAM_LOW_WATER) {
+            return;
+        }
+        while (size_ - cursor_ < STREAM_WINDOW && extend()) {
+        }
+    }
+
+    // Moves the unread part of a compressed file's window to its start and appends the
+    // next decompressed chunk; false at the end of the file.
+    bool extend() {
+        buffer_.erase(buffer_.begin(), buffer_.begin() + static_cast<ptrdiff_t>(cursor_));
+        cursor_ = 0;
+        bool more = stream_->next(chunk_);
+        if (more) {
+            buffer_.insert(buffer_.end(), chunk_.begin(), chunk_.end());
+        }
+        base_ = buffer_.data();
+        size_ = buffer_.size();
+        return more;
+    }
+
+    inline uint16_t read16(size_t offset) const {
+        uint16_t value;
+        std::memcpy(&value, base_ + offset, sizeof(value));
+        return swapped_ ? __builtin_bswap16(value) : value;
+    }
+
+    inline uint32_t read32(size_t offset) const {
+        uint32_t value;
+        std::memcpy(&value, base_ + offset, sizeof(value));
+        return swapped_ ? __builtin_bswap32(value) : value;
+    }
+
+    inline uint64_t read64(size_t offset) const {
+        uint64_t value;
+        std::memcpy(&value, base_ + offset, sizeof(value));
+        return swapped_ ? __builtin_bswap64(value) : value;
+    }
+
+    void read_file_header() {
+        if (size_ < sizeof(uint32_t)) {
+            throw std::runtime_error(path_ + " is not a pcap or pcapng file");
+        }
+        uint32_t magic = read32(0);
+        if (magic == PCAPNG_SECTION_HEADER) {
+            pcapng_ = true;
+            return;
+        }
+
+        for (bool swapped : {false, true}) {
+            swapped_ = swapped;
+            magic = read32(0);
+            if (magic == PCAP_MAGIC_USEC || magic == PCAP_MAGIC_NSEC) {
+                if (size_ < PCAP_HEADER_SIZE) {
+                    throw std::runtime_error(path_ + " has a truncated pcap header");
+                }
+                nanosecond_ = magic == PCAP_MAGIC_NSEC;
+                // The upper bits of the link type field carry FCS information.
+                uint64_t units = nanosecond_ ? 1'000'000'000 : 1'000'000;
+                interfaces_.push_back(Interface{read32(20) & 0xFFFF, units, 0});
+                snaplen_ = read32(16);
+                cursor_ = PCAP_HEADER_SIZE;
+                return;
+            }
+        }
+        throw std::runtime_error(path_ + " is not a pcap or pcapng file");
+    }
+
+    inline bool next_record(RawPacket &raw) {
+        if (cursor_ >= end_ || !record_at(cursor_, raw)) {
+            return false;
+        }
+        cursor_ += PCAP_RECORD_HEADER_SIZE + raw.caplen;
+        return true;
+    }
+
+    inline bool record_at(size_t offset, RawPacket &raw) const {
+        if (size_ - offset < PCAP_RECORD_HEADER_SIZE) {
+            return false;
+        }
+        uint32_t seconds = read32(offset);
+        uint32_t fraction = read32(offset + 4);
+        uint32_t caplen = read32(offset + 8);
+        uint32_t len = read32(offset + 12);
+        if (size_ - offset - PCAP_RECORD_HEADER_SIZE < caplen) {
+            return false;
+        }
+        raw.data = base_ + offset + PCAP_RECORD_HEADER_SIZE;
+        raw.caplen = caplen;
+        raw.len = len;
+        raw.timestamp = static_cast<double>(seconds) +
+                        (static_cast<double>(fraction) /
+                         (nanosecond_ ? 1'000'000'000 : 1'000'000));
+        raw.interface = 0;
+        return true;
+    }
+
+    // Whether a record header could start at `offset`: it fits in the file, its
+    // lengths fit the snapshot length and its timestamp is a valid one. With `previous`
+    // set, the timestamp must also be within a day of that second.
+    inline bool plausible_record(size_t offset, const uint32_t *previous) const {
+        if (size_ - offset < PCAP_RECORD_HEADER_SIZE) {
+            return false;
+        }
+        uint32_t seconds = read32(offset);
+        uint32_t fraction = read32(offset + 4);
+        uint32_t caplen = read32(offset + 8);
+        uint32_t len = read32(offset + 12);
+        uint32_t snaplen = std::max<uint32_t>(snaplen_, MAX_SNAPLEN);
+        return fraction < (nanosecond_ ? 1'000'000'000u : 1'000'000u) &&
+               caplen <= snaplen && caplen <= len && len <= MAX_RECORD_LENGTH &&
+               size_ - offset - PCAP_RECORD_HEADER_SIZE >= caplen &&
+               (!previous || (seconds > *previous ? seconds - *previous
+                                                  : *previous - seconds) <= 86'400);
+    }
+
+    // Walks pcapng blocks until one carries a packet.
+    inline bool next_block(RawPacket &raw) {
+        while (size_ - cursor_ >= PCAPNG_BLOCK_MIN_SIZE) {
+            uint32_t type = read32(cursor_);
+            if (type == PCAPNG_SECTION_HEADER) {
+                // The byte order magic follows the block length; the section header type
+                // reads the same in both orders, the length does not.
+                if (size_ - cursor_ < 16) {
+                    return false;
+                }
+                swapped_ = false;
+                if (read32(cursor_ + 8) != PCAPNG_BYTE_ORDER_MAGIC) {
+                    swapped_ = true;
+                    if (read32(cursor_ + 8) != PCAPNG_BYTE_ORDER_MAGIC) {
+                        return false;
+                    }
+                }
+                section_base_ = interfaces_.size();
+            }
+
+            size_t block = cursor_;
+            uint32_t length = read32(block + 4);
+            if (length < PCAPNG_BLOCK_MIN_SIZE || length % 4 || length > size_ - block) {
+                return false;
+            }
+            cursor_ += length;
+
+            switch (type) {
+            case PCAPNG_INTERFACE_DESCRIPTION:
+                add_interface(block, length);
+                break;
+            case PCAPNG_ENHANCED_PACKET:
+            case PCAPNG_PACKET:
+                if (enhanced_packet(block, length, type == PCAPNG_PACKET, raw)) {
+                    return true;
+                }
+                break;
+            case PCAPNG_SIMPLE_PACKET:
+                if (simple_packet(block, length, raw)) {
+                    return true;
+                }
+                break;
+            default:
+                break;
+            }
+        }
+        return false;
+    }
+
+    void add_interface(size_t block, uint32_t length) {
+        if (length < 20) {
+            return;
+        }
+        Interface interface{read16(block + 8), 1'000'000, 0};
+        // Options run from after the fixed fields to the trailing length word.
+        size_t option = block + 16;
+        size_t end = block + length - 4;
+        while (end - option >= 4) {
+            uint16_t code = read16(option);
+            uint16_t option_length = read16(option + 2);
+            if (code == PCAPNG_OPT_END || option_length > end - option - 4) {
+                break;
+            }
+            if (code == PCAPNG_OPT_TSRESOL && option_length >= 1) {
+                uint8_t resolution = base_[option + 4];
+                uint32_t exponent = resolution & 0x7F;
+                uint64_t base = resolution & 0x80 ? 2 : 10;
+                uint64_t units = 1;
+                for (uint32_t i = 0; i < exponent && units <= UINT64_MAX / base; i++) {
+                    units *= base;
+                }
+                interface.units_per_second = units;
+            } else if (code == PCAPNG_OPT_TSOFFSET && option_length >= 8) {
+                interface.offset = static_cast<int64_t>(read64(option + 4));
+            }
+            option += 4 + ((option_length + 3u) & ~3u);
+        }
+        interfaces_.push_back(interface);
+    }
+
+    // Enhanced packet blocks and the obsolete packet blocks share their layout except
+    // for the width of the interface id.
+    inline bool enhanced_packet(size_t block, uint32_t length, bool obsolete,
+                                RawPacket &raw) {
+        if (length < 32) {
+            return false;
+        }
+        size_t interface =
+            section_base_ + (obsolete ? read16(block + 8) : read32(block + 8));
+        uint32_t caplen = read32(block + 20);
+        if (interface >= interfaces_.size() || caplen > length - 32) {
+            return false;
+        }
+        uint64_t ticks =
+            (static_cast<uint64_t>(read32(block + 12)) << 32) | read32(block + 16);
+        const auto &info = interfaces_[interface];
+        raw.data = base_ + block + 28;
+        raw.caplen = caplen;
+        raw.len = read32(block + 24);
+        raw.timestamp = static_cast<double>(info.offset) +
+                        static_cast<double>(ticks / info.units_per_second) +
+                        (static_cast<double>(ticks % info.units_per_second) /
+                         static_cast<double>(info.units_per_second));
+        raw.interface = static_cast<uint32_t>(interface);
+        last_timestamp_ = raw.timestamp;
+        return true;
+    }
+
+    // Simple packet blocks belong to the section's first interface and have no
+    // timestamp; they are given the time of the previous packet.
+    inline bool simple_packet(size_t block, uint32_t length, RawPacket &raw) {
+        if (length < 16 || section_base_ >= interfaces_.size()) {
+            return false;
+        }
+        uint32_t len = read32(block + 8);
+        raw.data = base_ + block + 12;
+        raw.caplen = std::min<uint32_t>(len, length - 16);
+        raw.len = len;
+        raw.timestamp = last_timestamp_;
+        raw.interface = static_cast<uint32_t>(section_base_);
+        return true;
+    }
+};
+
+// Expands `paths` into the capture files to read, in order: a directory stands for the
+// regular files in it, sorted by name, which is their order when a capture tool names
+// rotated files by sequence number or time. Other paths are taken as they are.
+inline std::vector<std::string> capture_files(const std::vector<std::string> &paths) {
+    std::vector<std::string> files;
+    for (const auto &path : paths) {
+        if (!std::filesystem::is_directory(path)) {
+            files.push_back(path);
+            continue;
+        }
+        std::vector<std::string> entries;
+        for (const auto &entry : std::filesystem::directory_iterator(path)) {
+            if (entry.is_regular_file()) {
+                entries.push_back(entry.path().string());
+            }
+        }
+        std::sort(entries.begin(), entries.end());
+        files.insert(files.end(), entries.begin(), entries.end());
+    }
+    return files;
+}
+
+} // end namespace Net
+
+#endif
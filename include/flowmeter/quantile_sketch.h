@@ -0,0 +1,299 @@
+#ifndef FLOWMETER_QUANTILE_SKETCH_H
+#define FLOWMETER_QUANTILE_SKETCH_H
+
+#include "fmt/format.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <string_view>
+
+// Per-sketch footprint, overridable at build time: the number of histogram bins and
+// the number of samples a sketch keeps verbatim before spilling into them.
+#ifndef FLOWMETER_SKETCH_BINS
+#define FLOWMETER_SKETCH_BINS 64
+#endif
+#ifndef FLOWMETER_SKETCH_INLINE_SAMPLES
+#define FLOWMETER_SKETCH_INLINE_SAMPLES 8
+#endif
+
+namespace Net {
+
+// Fixed-size, mergeable quantile sketch over non-negative values. The first
+// `InlineSamples` values are stored as they are, so small flows get exact quantiles.
+// After that the sketch turns into a log-binned histogram in the manner of DDSketch:
+// bin i counts values in (gamma^(i-1), gamma^i], so any estimate is within
+// `AccuracyPermille` / 1000 of the true value. The bins form a window of `Bins`
+// consecutive indices. When the values span more than that, neighbouring bins are
+// merged pairwise, which squares gamma, as in UDDSketch. Accuracy then degrades evenly
+// over all quantiles instead of wiping out the lowest ones. Plain data with no heap
+// storage, so a flow stays trivially copyable.
+template <uint32_t Bins = FLOWMETER_SKETCH_BINS,
+          uint32_t InlineSamples = FLOWMETER_SKETCH_INLINE_SAMPLES,
+          uint32_t AccuracyPermille = 10>
+struct QuantileSketch {
+    static_assert(Bins >= 2, "A sketch needs at least two bins");
+    static_assert(AccuracyPermille > 0 && AccuracyPermille < 1000,
+                  "Relative accuracy must lie strictly between 0 and 1");
+
+    // Quantiles exported as columns, named `p<percent>_<feature>`.
+    static constexpr auto QUANTILES = std::to_array<double>({0.25, 0.5, 0.75, 0.9, 0.99});
+    static constexpr auto COLUMNS =
+        std::to_array<std::string_view>({"p25", "p50", "p75", "p90", "p99"});
+
+    static constexpr double ALPHA = AccuracyPermille / 1000.0;
+    static constexpr double GAMMA = (1 + ALPHA) / (1 - ALPHA);
+    // Values at or below this are counted as zero.
+    static constexpr double MIN_VALUE = 1e-9;
+
+    uint64_t count = 0;
+    uint64_t zero_count = 0;
+    // Index of bins[0] and range of the non-empty bins.
+    int32_t offset = 0;
+    int32_t min_index = 0;
+    int32_t max_index = 0;
+    // Number of pairwise merges so far; bins are GAMMA^(2^level) wide.
+    uint8_t level = 0;
+    // Whether any bin is non-empty, which makes the index range above meaningful.
+    bool binned = false;
+    // Samples while count <= InlineSamples, bins afterwards.
+    union {
+        std::array<uint32_t, Bins> bins{};
+        std::array<double, InlineSamples> samples;
+    };
+
+    inline void reset() { *this = QuantileSketch(); }
+
+    inline void update(double value) {
+        count++;
+        if (count == 1) {
+            samples = {};
+        }
+        if (count <= InlineSamples) {
+            samples[count - 1] = value;
+            return;
+        }
+        if (count == InlineSamples + 1) {
+            spill();
+        }
+        insert(value);
+    }
+
+    // Folds `other` in, as if its values had been added to this sketch.
+    void merge(const QuantileSketch &other) {
+        if (other.count <= InlineSamples) {
+            for (uint64_t i = 0; i < other.count; i++) {
+                update(other.samples[i]);
+            }
+            return;
+        }
+        if (count <= InlineSamples) {
+            auto own = *this;
+            *this = other;
+            for (uint64_t i = 0; i < own.count; i++) {
+                count++;
+                insert(own.samples[i]);
+            }
+            return;
+        }
+        auto coarser = other;
+        while (coarser.level < level) {
+            coarser.collapse();
+        }
+        while (level < coarser.level) {
+            collapse();
+        }
+        count += coarser.count;
+        zero_count += coarser.zero_count;
+        if (!coarser.binned) {
+            return;
+        }
+        for (int32_t index = coarser.min_index; index <= coarser.max_index; index++) {
+            if (auto n = coarser.bins[index - coarser.offset]) {
+                // Inserting may have collapsed this sketch further.
+                auto target = index;
+                for (auto l = coarser.level; l < level; l++) {
+                    target = halve(target);
+                }
+                insert_index(target, n);
+            }
+        }
+    }
+
+    // Value of rank floor(q * (count - 1)) in sorted order; exact while the samples are
+    // inline, within the sketch's relative error of the true value afterwards.
+    double quantile(double q) const {
+        if (!count) {
+            return 0;
+        }
+        auto rank = static_cast<uint64_t>(q * static_cast<double>(count - 1));
+        if (count <= InlineSamples) {
+            auto sorted = samples;
+            std::nth_element(sorted.begin(), sorted.begin() + rank,
+                             sorted.begin() + count);
+            return sorted[rank];
+        }
+        uint64_t seen = zero_count;
+        if (seen > rank) {
+            return 0;
+        }
+        for (int32_t index = min_index; index <= max_index; index++) {
+            seen += bins[index - offset];
+            if (seen > rank) {
+                return value_of(index);
+            }
+        }
+        return value_of(max_index);
+    }
+
+    // Number of values at or below `value`, to within one bin; for building histograms.
+    uint64_t rank(double value) const {
+        if (count <= InlineSamples) {
+            return static_cast<uint64_t>(
+                std::count_if(samples.begin(), samples.begin() + count,
+                              [value](double sample) { return sample <= value; }));
+        }
+        uint64_t seen = zero_count;
+        if (value <= MIN_VALUE || !binned) {
+            return seen;
+        }
+        auto last = std::min(index_of(value), max_index);
+        for (int32_t index = min_index; index <= last; index++) {
+            seen += bins[index - offset];
+        }
+        return seen;
+    }
+
+    // Current relative accuracy, which coarsens by squaring gamma on every collapse.
+    double accuracy() const {
+        auto gamma = gamma_of(level);
+        return (gamma - 1) / (gamma + 1);
+    }
+
+    template <typename F>
+    void visit(F &&f) const {
+        for (auto q : QUANTILES) {
+            f(quantile(q));
+        }
+    }
+
+    template <typename OutputIt>
+    OutputIt format_to(OutputIt out) const {
+        for (size_t i = 0; i < QUANTILES.size(); i++) {
+            if (i) {
+                *out++ = ',';
+            }
+            out = fmt::format_to(out, "{}", quantile(QUANTILES[i]));
+        }
+        return out;
+    }
+
+  private:
+    // ln(GAMMA) = 2 atanh(ALPHA), summed as a series so that it is a constant
+    // expression and usable during static initialization.
+    static constexpr double LOG_GAMMA = [] {
+        double term = ALPHA;
+        double sum = 0;
+        for (uint32_t k = 1; term > 1e-18; k += 2) {
+            sum += term / k;
+            term *= ALPHA * ALPHA;
+        }
+        return 2 * sum;
+    }();
+
+    static inline double gamma_of(uint8_t level) {
+        return std::exp(LOG_GAMMA * static_cast<double>(1ULL << level));
+    }
+
+    inline int32_t index_of(double value) const {
+        auto width = LOG_GAMMA * static_cast<double>(1ULL << level);
+        return static_cast<int32_t>(std::ceil(std::log(value) / width));
+    }
+
+    // Midpoint estimate of bin `index`, off by at most the accuracy from any member.
+    inline double value_of(int32_t index) const {
+        auto gamma = gamma_of(level);
+        return 2 * std::pow(gamma, index) / (gamma + 1);
+    }
+
+    // Moves the inline samples into the bins.
+    inline void spill() {
+        auto inline_samples = samples;
+        bins = {};
+        for (auto sample : inline_samples) {
+            insert(sample);
+        }
+    }
+
+    // Bins a value already included in `count`.
+    inline void insert(double value) {
+        if (value <= MIN_VALUE) {
+            zero_count++;
+            return;
+        }
+        insert_index(index_of(value), 1);
+    }
+
+    // Adds `n` values to bin `index`. The caller has already added them to `count`.
+    void insert_index(int32_t index, uint32_t n) {
+        if (!binned) {
+            binned = true;
+            offset = index - static_cast<int32_t>(Bins / 2);
+            min_index = max_index = index;
+        } else {
+            while (std::max(max_index, index) - std::min(min_index, index) >=
+                   static_cast<int32_t>(Bins)) {
+                collapse();
+                index = halve(index);
+            }
+            if (index < offset) {
+                move_window(index);
+            } else if (index >= offset + static_cast<int32_t>(Bins)) {
+                move_window(index - static_cast<int32_t>(Bins) + 1);
+            }
+            min_index = std::min(min_index, index);
+            max_index = std::max(max_index, index);
+        }
+        bins[index - offset] += n;
+    }
+
+    // Index of the bin that holds bin `index` after a collapse: ceil(index / 2).
+    static inline int32_t halve(int32_t index) { return (index + 1) >> 1; }
+
+    // Merges neighbouring bins pairwise, doubling their logarithmic width.
+    void collapse() {
+        level++;
+        if (!binned) {
+            return;
+        }
+        auto old = bins;
+        auto old_offset = offset;
+        auto old_min = min_index;
+        auto old_max = max_index;
+        min_index = halve(min_index);
+        max_index = halve(max_index);
+        offset = std::min(offset, min_index);
+        if (max_index >= offset + static_cast<int32_t>(Bins)) {
+            offset = max_index - static_cast<int32_t>(Bins) + 1;
+        }
+        bins = {};
+        for (int32_t index = old_min; index <= old_max; index++) {
+            bins[halve(index) - offset] += old[index - old_offset];
+        }
+    }
+
+    // Slides the window to start at `new_offset`; every non-empty bin must still fit.
+    void move_window(int32_t new_offset) {
+        auto old = bins;
+        bins = {};
+        for (int32_t index = min_index; index <= max_index; index++) {
+            bins[index - new_offset] = old[index - offset];
+        }
+        offset = new_offset;
+    }
+};
+
+} // end namespace Net
+
+#endif
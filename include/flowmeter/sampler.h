@@ -0,0 +1,37 @@
+#ifndef FLOWMETER_SAMPLER_H
+#define FLOWMETER_SAMPLER_H
+
+#include <cstdint>
+
+#include "flowmeter/distinct_sketch.h"
+#include "flowmeter/service.h"
+
+namespace Net {
+
+// Chooses the packets a meter looks at when it has to trade accuracy for throughput.
+// Packet sampling keeps every `packet_rate`-th packet by sequence number, so per-flow
+// counts shrink by about that factor. Flow sampling keeps the flows whose canonical
+// pair hashes into one of `flow_rate` buckets: a kept flow sees all of its packets and
+// its features stay exact, and the same flows are kept on every run and every meter.
+// Records carry both rates, for downstream to scale counts back up.
+struct Sampler {
+    uint32_t packet_rate{1};
+    uint32_t flow_rate{1};
+
+    inline bool samples() const { return packet_rate > 1 || flow_rate > 1; }
+
+    inline bool keep_packet(uint64_t seq) const { return seq % packet_rate == 0; }
+
+    // Remixed so that the kept flows do not line up with the flows a ShardedMeter
+    // assigns to one worker, which it picks with the plain hash.
+    inline bool keep_flow(const ServicePair &pair) const {
+        return flow_rate <= 1 ||
+               mix64(pair.canonical().hash() ^ FLOW_SALT) % flow_rate == 0;
+    }
+
+    static constexpr uint64_t FLOW_SALT = 0x5EED5A3B1E5F10A7ULL;
+};
+
+} // end namespace Net
+
+#endif
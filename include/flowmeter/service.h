@@ -1,7 +1,7 @@
 #ifndef FLOWMETER_SERVICEH
 #define FLOWMETER_SERVICEH
 
-#include "fmt/core.h"
+#include "fmt/format.h"
 #include "tins/constants.h"
 #include "tins/dot1q.h"
 #include "tins/ethernetII.h"
@@ -12,230 +12,244 @@
 #include "tins/tcp.h"
 #include "tins/udp.h"
 #include <array>
+#include <cstring>
 #include <sstream>
+#include <type_traits>
 
 #include "flowmeter/tins_ext.h"
 
 namespace Net {
 
+// One endpoint of a flow. The layout is fixed-size and free of padding so that a
+// Service can be copied, compared and hashed as plain bytes.
 struct Service {
-    std::string mac_addr;
-    std::string ip_addr;
-    uint16_t port;
-
-    Service(std::string mac_address, std::string ip_address, uint16_t port_num)
-        : mac_addr(mac_address), ip_addr(ip_address), port(port_num) {}
-
-    Service(Service &rhs) : mac_addr(rhs.mac_addr), ip_addr(rhs.ip_addr), port(rhs.port) {}
-
-    Service(const Service &rhs)
-        : mac_addr(rhs.mac_addr), ip_addr(rhs.ip_addr), port(rhs.port) {}
+    IpAddress ip_addr{};
+    MacAddress mac_addr{};
+    uint16_t port{0};
 
     Service() = default;
 
-    const std::string to_string() const {
-        std::stringstream ss;
-        ss << mac_addr << "," << ip_addr << "," << port;
-        return ss.str();
-    }
-
-    bool operator>(const Service &service) const {
-        if (port > service.port) {
-            return true;
-        } else if (port < service.port) {
-            return false;
-        }
-
-        if (ip_addr > service.ip_addr) {
-            return true;
-        } else if (ip_addr < service.ip_addr) {
-            return false;
-        }
-
-        if (mac_addr > service.mac_addr) {
-            return true;
-        } else if (mac_addr < service.mac_addr) {
-            return false;
+    Service(const IpAddress &ip_address, const MacAddress &mac_address, uint16_t port_num)
+        : ip_addr(ip_address), mac_addr(mac_address), port(port_num) {}
+
+    // Orders endpoints by comparing the address words as integers. The order is only
+    // used to canonicalize a pair, so it need not match any textual ordering.
+    inline int compare(const Service &service) const {
+        uint64_t lhs[3];
+        uint64_t rhs[3];
+        words(lhs);
+        service.words(rhs);
+        for (auto i = 0; i < 3; i++) {
+            if (lhs[i] != rhs[i]) {
+                return lhs[i] < rhs[i] ? -1 : 1;
+            }
         }
-
-        return false;
+        return 0;
     }
 
-    bool operator<=(const Service &service) const { return !operator>(service); }
+    bool operator<(const Service &service) const { return compare(service) < 0; }
 
-    bool operator<(const Service &service) const {
-        if (port < service.port) {
-            return true;
-        } else if (port > service.port) {
-            return false;
-        }
+    bool operator>(const Service &service) const { return compare(service) > 0; }
 
-        if (ip_addr < service.ip_addr) {
-            return true;
-        } else if (ip_addr > service.ip_addr) {
-            return false;
-        }
+    bool operator<=(const Service &service) const { return compare(service) <= 0; }
 
-        if (mac_addr < service.mac_addr) {
-            return true;
-        } else if (mac_addr > service.mac_addr) {
-            return false;
-        }
+    bool operator>=(const Service &service) const { return compare(service) >= 0; }
 
-        return false;
+    bool operator==(const Service &service) const {
+        return std::memcmp(this, &service, sizeof(Service)) == 0;
     }
 
-    bool operator>=(const Service &service) const { return !operator<(service); }
+    bool operator!=(const Service &service) const { return !operator==(service); }
 
-    bool operator==(const Service &service) const {
-        return (port == service.port) && (ip_addr == service.ip_addr) &&
-               (mac_addr == service.mac_addr);
+    template <typename H>
+    friend H AbslHashValue(H h, const Service &service) {
+        return H::combine_contiguous(std::move(h),
+                                     reinterpret_cast<const uint8_t *>(&service),
+                                     sizeof(Service));
     }
 
-    bool operator!=(const Service &service) const {
-        return (mac_addr != service.mac_addr) || (ip_addr != service.ip_addr) ||
-               (port != service.port);
+    const std::string to_string(uint8_t ip_version) const {
+        std::stringstream ss;
+        ss << mac_addr.to_string() << "," << Net::to_string(ip_addr, ip_version) << ","
+           << port;
+        return ss.str();
     }
 
-    template <typename H>
-    friend H AbslHashValue(H h, const Service &service) {
-        return H::combine(std::move(h), service.mac_addr, service.ip_addr, service.port);
+  private:
+    inline void words(uint64_t (&out)[3]) const {
+        uint64_t mac_word = 0;
+        std::memcpy(&out[0], ip_addr.data(), 8);
+        std::memcpy(&out[1], ip_addr.data() + 8, 8);
+        std::memcpy(&mac_word, &mac_addr, sizeof(MacAddress));
+        out[2] = (mac_word << 16) | port;
     }
 };
 
+static_assert(sizeof(Service) == ADDR_SIZE + MacAddress::address_size + sizeof(uint16_t),
+              "Service must not contain padding");
+
+// Binary flow key. `src_service` and `dst_service` are in the order the packet was
+// observed; `canonical()` yields the direction-independent key used for flow lookup.
 class ServicePair {
   public:
-    std::string src_mac;
-    std::string dst_mac;
-    std::string src_addr;
-    std::string dst_addr;
-    uint8_t ip_version;
     Service src_service;
     Service dst_service;
-    Service l_service;
-    Service r_service;
-    uint8_t vlan_id{0};
-    uint16_t src_port;
-    uint16_t dst_port;
-    Tins::Constants::IP::e transport_proto{};
+    uint16_t vlan_id{0};
+    uint8_t transport_proto{0};
+    uint8_t ip_version{0};
     static constexpr uint8_t IPv4 = 4;
     static constexpr uint8_t IPv6 = 6;
 
-    ServicePair(Tins::Packet &pkt) {
-        if (eth_pdu_ptr_ = pkt.pdu()->find_pdu<Tins::EthernetII>()) {
-            src_mac = eth_pdu_ptr_->src_addr().to_string();
-            dst_mac = eth_pdu_ptr_->dst_addr().to_string();
-
-            if (ipv6_pdu_ptr_ = eth_pdu_ptr_->find_pdu<Tins::IPv6>()) {
-                src_addr = ipv6_pdu_ptr_->src_addr().to_string();
-                dst_addr = ipv6_pdu_ptr_->dst_addr().to_string();
-                ip_version = IPv6;
-            } else if (ip_pdu_ptr_ = eth_pdu_ptr_->find_pdu<Tins::IP>()) {
-                src_addr = ip_pdu_ptr_->src_addr().to_string();
-                dst_addr = ip_pdu_ptr_->dst_addr().to_string();
-                ip_version = IPv4;
-            } else {
-                initialized_ = false;
-                return;
-            }
-
-            if (tcp_pdu_ptr_ = eth_pdu_ptr_->find_pdu<Tins::TCP>()) {
-                src_port = tcp_pdu_ptr_->sport();
-                dst_port = tcp_pdu_ptr_->dport();
-                transport_proto = Tins::Constants::IP::e::PROTO_TCP;
-            } else if (udp_pdu_ptr_ = eth_pdu_ptr_->find_pdu<Tins::UDP>()) {
-                src_port = udp_pdu_ptr_->sport();
-                dst_port = udp_pdu_ptr_->dport();
-                transport_proto = Tins::Constants::IP::e::PROTO_UDP;
-            } else {
-                initialized_ = false;
-                return;
-            }
-
-            src_service = Service(src_mac, src_addr, src_port);
-            dst_service = Service(dst_mac, dst_addr, dst_port);
+    ServicePair() = default;
 
-            l_service = src_service < dst_service ? src_service : dst_service;
-            r_service = dst_service < src_service ? dst_service : src_service;
+    ServicePair(Tins::Packet &pkt) : ServicePair(*pkt.pdu()) {}
 
-            initialized_ = true;
-
-            if (dot1q_pdu_ptr_ = eth_pdu_ptr_->find_pdu<Tins::Dot1Q>()) {
-                vlan_id = dot1q_pdu_ptr_->id();
-            }
-        } else {
-            initialized_ = false;
+    explicit ServicePair(Tins::PDU &pdu) {
+        if (auto *eth_pdu_ptr = pdu.find_pdu<Tins::EthernetII>()) {
+            from_pdu(*eth_pdu_ptr);
         }
     }
 
-    ServicePair(Service &source, Service &dest, uint8_t vlan,
-                Tins::Constants::IP::e transport)
-        : src_service(source), dst_service(dest), l_service(l_service),
-          r_service(r_service), vlan_id(vlan), transport_proto(transport) {}
+    ServicePair(const Service &source, const Service &dest, uint16_t vlan,
+                Tins::Constants::IP::e transport, uint8_t version)
+        : src_service(source), dst_service(dest), vlan_id(vlan),
+          transport_proto(static_cast<uint8_t>(transport)), ip_version(version) {}
 
-    ServicePair(const ServicePair &pair)
-        : src_service(pair.src_service), dst_service(pair.dst_service),
-          l_service(pair.l_service), r_service(pair.r_service), vlan_id(pair.vlan_id),
-          transport_proto(pair.transport_proto), ip_version(pair.ip_version) {}
+    inline void reset() { *this = ServicePair(); }
 
-    ServicePair(ServicePair &pair)
-        : src_service(pair.src_service), dst_service(pair.dst_service),
-          l_service(pair.l_service), r_service(pair.r_service), vlan_id(pair.vlan_id),
-          transport_proto(pair.transport_proto), ip_version(pair.ip_version) {}
+    const Tins::Constants::IP::e transport_protocol() const {
+        return static_cast<Tins::Constants::IP::e>(transport_proto);
+    }
+
+    // True when the packet travels from the higher to the lower endpoint.
+    inline bool reversed() const { return dst_service < src_service; }
 
-    void reset() {
-        eth_pdu_ptr_ = nullptr;
-        tcp_pdu_ptr_ = nullptr;
-        udp_pdu_ptr_ = nullptr;
-        ipv6_pdu_ptr_ = nullptr;
-        ip_pdu_ptr_ = nullptr;
-        dot1q_pdu_ptr_ = nullptr;
-        initialized_ = false;
+    inline ServicePair canonical() const {
+        if (!reversed()) {
+            return *this;
+        }
+        ServicePair pair(*this);
+        pair.src_service = dst_service;
+        pair.dst_service = src_service;
+        return pair;
     }
 
-    const Tins::Constants::IP::e transport_protocol() const { return transport_proto; }
+    // Seed-free 64-bit hash over the raw key bytes. Stable across runs and processes.
+    inline uint64_t hash() const {
+        constexpr uint64_t mul = 0x9E3779B97F4A7C15ULL;
+        const auto *bytes = reinterpret_cast<const uint8_t *>(this);
+        uint64_t h = sizeof(ServicePair);
+        size_t i = 0;
+        for (; i + 8 <= sizeof(ServicePair); i += 8) {
+            uint64_t word;
+            std::memcpy(&word, bytes + i, 8);
+            h = (h ^ word) * mul;
+            h ^= h >> 29;
+        }
+        uint64_t tail = 0;
+        std::memcpy(&tail, bytes + i, sizeof(ServicePair) - i);
+        h = (h ^ tail) * mul;
+        h ^= h >> 32;
+        h *= 0xD6E8FEB86659FD93ULL;
+        h ^= h >> 32;
+        return h;
+    }
 
     template <typename H>
     friend H AbslHashValue(H h, const ServicePair &pair) {
-        return H::combine(std::move(h), pair.l_service, pair.r_service, pair.vlan_id,
-                          pair.transport_proto);
+        return H::combine(std::move(h), pair.hash());
     }
 
-    operator bool() const { return initialized_; }
+    operator bool() const { return ip_version != 0; }
 
-    const bool valid() const { return initialized_; }
+    const bool valid() const { return ip_version != 0; }
 
     bool operator==(const ServicePair &pair) const {
-        return (l_service == pair.l_service) && (r_service == pair.r_service) &&
-               (transport_proto == pair.transport_proto) && (vlan_id == vlan_id);
+        return std::memcmp(this, &pair, sizeof(ServicePair)) == 0;
     }
 
     bool operator!=(const ServicePair &pair) const { return !((*this) == pair); }
 
-    const std::string column_names() const {
+    static const std::string column_names() {
         return "src_mac,dst_mac,src_ip,dst_ip,sport,dport,transport_proto,vlan_id,ip_"
                "version";
     }
 
+    template <typename F>
+    void visit(F &&f) const {
+        f(src_service.mac_addr);
+        f(dst_service.mac_addr);
+        f(src_service.ip_addr);
+        f(dst_service.ip_addr);
+        f(src_service.port);
+        f(dst_service.port);
+        f(transport_proto);
+        f(vlan_id);
+        f(ip_version);
+    }
+
+    template <typename OutputIt>
+    OutputIt format_to(OutputIt out) const {
+        out = Net::format_to(out, src_service.mac_addr);
+        *out++ = ',';
+        out = Net::format_to(out, dst_service.mac_addr);
+        *out++ = ',';
+        out = Net::format_to(out, src_service.ip_addr, ip_version);
+        *out++ = ',';
+        out = Net::format_to(out, dst_service.ip_addr, ip_version);
+        return fmt::format_to(out, ",{},{},{},{},{}", src_service.port, dst_service.port,
+                              transport_proto, vlan_id, ip_version);
+    }
+
     const std::string to_string() const {
-        std::stringstream ss;
-        ss << src_service.mac_addr << "," << dst_service.mac_addr << ","
-           << src_service.ip_addr << "," << dst_service.ip_addr << "," << src_service.port
-           << "," << dst_service.port << "," << transport_proto << ","
-           << fmt::format("{}", vlan_id) << "," << fmt::format("{}", ip_version);
-        return ss.str();
+        fmt::memory_buffer buffer;
+        format_to(std::back_inserter(buffer));
+        return fmt::to_string(buffer);
     }
 
   private:
-    Tins::EthernetII *eth_pdu_ptr_{nullptr};
-    Tins::TCP *tcp_pdu_ptr_{nullptr};
-    Tins::UDP *udp_pdu_ptr_{nullptr};
-    Tins::IPv6 *ipv6_pdu_ptr_{nullptr};
-    Tins::IP *ip_pdu_ptr_{nullptr};
-    Tins::Dot1Q *dot1q_pdu_ptr_{nullptr};
-    bool initialized_{false};
+    // Slow path: extracts the key from an already dissected libtins PDU tree.
+    inline void from_pdu(Tins::EthernetII &eth_pdu) {
+        src_service.mac_addr = eth_pdu.src_addr();
+        dst_service.mac_addr = eth_pdu.dst_addr();
+
+        if (auto *ipv6_pdu_ptr = eth_pdu.find_pdu<Tins::IPv6>()) {
+            to_bytes(ipv6_pdu_ptr->src_addr(), src_service.ip_addr);
+            to_bytes(ipv6_pdu_ptr->dst_addr(), dst_service.ip_addr);
+            ip_version = IPv6;
+        } else if (auto *ip_pdu_ptr = eth_pdu.find_pdu<Tins::IP>()) {
+            to_bytes(ip_pdu_ptr->src_addr(), src_service.ip_addr);
+            to_bytes(ip_pdu_ptr->dst_addr(), dst_service.ip_addr);
+            ip_version = IPv4;
+        } else {
+            reset();
+            return;
+        }
+
+        if (auto *tcp_pdu_ptr = eth_pdu.find_pdu<Tins::TCP>()) {
+            src_service.port = tcp_pdu_ptr->sport();
+            dst_service.port = tcp_pdu_ptr->dport();
+            transport_proto = Tins::Constants::IP::e::PROTO_TCP;
+        } else if (auto *udp_pdu_ptr = eth_pdu.find_pdu<Tins::UDP>()) {
+            src_service.port = udp_pdu_ptr->sport();
+            dst_service.port = udp_pdu_ptr->dport();
+            transport_proto = Tins::Constants::IP::e::PROTO_UDP;
+        } else {
+            reset();
+            return;
+        }
+
+        if (auto *dot1q_pdu_ptr = eth_pdu.find_pdu<Tins::Dot1Q>()) {
+            vlan_id = dot1q_pdu_ptr->id();
+        }
+    }
 };
 
+static_assert(std::is_trivially_copyable_v<ServicePair>,
+              "ServicePair is a flat hash map key and must stay trivially copyable");
+static_assert(sizeof(ServicePair) == 2 * sizeof(Service) + 4,
+              "ServicePair must not contain padding");
+
 } // end namespace Net
 
 #endif
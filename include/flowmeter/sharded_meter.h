@@ -0,0 +1,395 @@
+#ifndef FLOWMETER_SHARDED_METER_H
+#define FLOWMETER_SHARDED_METER_H
+
+#include "absl/container/flat_hash_map.h"
+#include <atomic>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <pthread.h>
+#include <sched.h>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "flowmeter/constants.h"
+#include "flowmeter/dissector.h"
+#include "flowmeter/features.h"
+#include "flowmeter/flow_table.h"
+#include "flowmeter/meter.h"
+#include "flowmeter/pcap_reader.h"
+#include "flowmeter/spsc_ring.h"
+
+namespace Net {
+
+// Reader to worker. SYNC carries the current tick in `tick` and the sequence number of
+// the next packet in `seq`; it is broadcast to every worker whenever the tick changes
+// and every `sync_interval_` packets, so that all shards share one clock and the merge
+// stage always hears from every shard.
+struct ShardInput {
+    enum Kind : uint8_t { PACKET, SYNC, END };
+
+    Kind kind{PACKET};
+    uint64_t tick{0};
+    uint64_t seq{0};
+    ServicePair pair;
+    PacketFeatures features;
+};
+
+// Worker to merge stage. Items from one worker arrive in ExportPosition order; a
+// WATERMARK promises that nothing earlier than its position will follow.
+template <typename Record = NetworkFlow>
+struct ShardOutput {
+    enum Kind : uint8_t { RECORD, CREATE, RETIRE, WATERMARK, DONE };
+
+    Kind kind{WATERMARK};
+    ExportPosition position;
+    int64_t flow_id{0};
+    std::optional<Record> flow;
+};
+
+// FlowTable sink of a worker: forwards everything to the merge stage.
+template <typename Record = NetworkFlow>
+class ShardSink {
+  public:
+    using Output = ShardOutput<Record>;
+
+    ShardSink(SpscRing<Output> &out) : out_(out) {}
+
+    inline void on_record(const Record &flow, const ExportPosition &position) {
+        out_.push(Output{Output::RECORD, position, flow.init_id, flow});
+    }
+
+    inline void on_create(const Record &flow, const ExportPosition &position) {
+        out_.push(Output{Output::CREATE, position, flow.init_id, std::nullopt});
+    }
+
+    inline void on_retire(const Record &flow, const ExportPosition &position) {
+        out_.push(Output{Output::RETIRE, position, flow.init_id, std::nullopt});
+    }
+
+    inline void watermark(const ExportPosition &position) {
+        out_.push(Output{Output::WATERMARK, position, 0, std::nullopt});
+    }
+
+    inline void done() {
+        ExportPosition end{ExportPosition::END_OF_INPUT, ExportPosition::PACKET,
+                           ExportPosition::END_OF_INPUT};
+        out_.push(Output{Output::DONE, end, 0, std::nullopt});
+    }
+
+  private:
+    SpscRing<Output> &out_;
+};
+
+// Pins `thread` to the `index`-th entry of `cpus`, if there are any.
+inline void pin_thread(pthread_t thread, const std::vector<int> &cpus, size_t index) {
+    if (cpus.empty()) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus[index % cpus.size()], &set);
+    if (pthread_setaffinity_np(thread, sizeof(set), &set)) {
+        std::cerr << "Unable to pin thread to CPU " << cpus[index % cpus.size()]
+                  << std::endl;
+    }
+}
+
+// Last stage of a merge: renumbers init_id in creation order as the merged events go
+// by, which is how a serial table numbers its flows, and writes the records to a sink.
+class CreationOrder {
+  public:
+    template <typename Output, typename Sink>
+    inline void emit(Output &item, Sink &sink) {
+        switch (item.kind) {
+        case Output::CREATE:
+            ids_[item.flow_id] = next_id_++;
+            break;
+        case Output::RETIRE:
+            ids_.erase(item.flow_id);
+            break;
+        case Output::RECORD: {
+            auto id = ids_.find(item.flow_id);
+            if (id == ids_.end()) {
+                throw std::logic_error("Record for flow " + std::to_string(item.flow_id) +
+                                       " arrived without its creation event");
+            }
+            item.flow->init_id = id->second;
+            sink.on_record(*item.flow, item.position);
+            if (item.flow->exp_code != ExpirationCode::ACTIVE_TIMEOUT) {
+                ids_.erase(id);
+            }
+            item.flow.reset();
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+  private:
+    absl::flat_hash_map<int64_t, int64_t> ids_;
+    int64_t next_id_{0};
+};
+
+// Parallel counterpart of Meter. A reader thread dissects packets and computes their
+// features, then hands each one to the worker that owns its flow, chosen by the hash
+// of the canonical ServicePair so that both directions land on the same shard. Every
+// worker runs its own FlowTable and expiration wheel. The calling thread merges the
+// workers' output back into a single stream ordered by ExportPosition and renumbers
+// init_id in creation order, so the file is identical to a serial run for any number
+// of workers as long as the flow tables are not bounded; see limit_flows().
+class ShardedMeter {
+  public:
+    ShardedMeter(const std::string &input_file, const std::string &output_file,
+                 const double &active_timeout, const double &idle_timeout,
+                 const double &timer_resolution, const uint32_t &threads,
+                 const std::vector<int> &cpus = {},
+                 const OutputFormat &format = OutputFormat::CSV,
+                 const FeatureProfile &profile = FeatureProfile::FULL)
+        : pcap_path_(input_file), output_path_(output_file),
+          active_timeout_(active_timeout), idle_timeout_(idle_timeout),
+          timer_resolution_(timer_resolution), threads_(std::max<uint32_t>(threads, 1)),
+          cpus_(cpus), format_(format), profile_(profile) {}
+
+    void run() {
+        std::cout << "Processing " << pcap_path_ << " on " << threads_ << " workers"
+                  << std::endl;
+        auto start_time = high_resolution_clock::now();
+        evicted_.store(0);
+        PcapReader reader(pcap_path_);
+        auto pkt_count = with_profile(profile_, [this, &reader](auto record) {
+            using Record = typename decltype(record)::type;
+            if (format_ == OutputFormat::COLUMNAR) {
+                ColumnarSink<Record> sink(output_path_);
+                return pipeline<Record>(reader, sink);
+            }
+            CsvSink<Record> sink(output_path_);
+            return pipeline<Record>(reader, sink);
+        });
+
+        // Display meter summary
+        auto end_time = high_resolution_clock::now();
+        auto nanosecs =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - start_time)
+                .count();
+        seconds_ = nanosecs / 1'000'000'000.0;
+        pkts_per_sec_ = pkt_count / seconds_;
+        std::cout << "Read " << pkt_count << " packets in " << seconds_ << " seconds"
+                  << std::endl;
+        std::cout << std::setprecision(MAX_DOUBLE_PRECISION) << pkts_per_sec_
+                  << " pkts/sec" << std::endl;
+        if (auto evicted = evicted_.load()) {
+            std::cout << "Evicted " << evicted << " flows to stay within the flow limits"
+                      << std::endl;
+        }
+    }
+
+    // Bounds the flow tables; each worker gets an equal share of `limits` and evicts
+    // within it, so unlike the rest of the output, evictions depend on the worker count.
+    void limit_flows(const FlowLimits &limits) { limits_ = limits; }
+
+    // Ends closed TCP connections early; see FlowTable::set_session_linger.
+    void end_sessions(const double &linger) { session_linger_ = linger; }
+
+  private:
+    // Runs the reader and worker threads, merging their output into `sink` on the
+    // calling thread; returns the packet count.
+    template <typename Record, typename Sink>
+    uint64_t pipeline(PcapReader &reader, Sink &sink) {
+        using Output = ShardOutput<Record>;
+        uint64_t pkt_count = 0;
+        std::vector<std::unique_ptr<SpscRing<ShardInput>>> inputs;
+        std::vector<std::unique_ptr<SpscRing<Output>>> outputs;
+        for (uint32_t i = 0; i < threads_; i++) {
+            inputs.push_back(std::make_unique<SpscRing<ShardInput>>(input_capacity_));
+            outputs.push_back(std::make_unique<SpscRing<Output>>(output_capacity_));
+        }
+
+        std::vector<std::thread> workers;
+        for (uint32_t i = 0; i < threads_; i++) {
+            workers.emplace_back([this, &inputs, &outputs, i]() {
+                work<Record>(*inputs[i], *outputs[i]);
+            });
+            pin(workers.back().native_handle(), i + 1);
+        }
+
+        std::exception_ptr error;
+        std::thread reader_thread([this, &reader, &inputs, &pkt_count, &error]() {
+            pkt_count = read<Record>(reader, inputs, error);
+        });
+        pin(reader_thread.native_handle(), 0);
+        pin(pthread_self(), threads_ + 1);
+
+        merge(outputs, sink);
+
+        reader_thread.join();
+        for (auto &worker : workers) {
+            worker.join();
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        sink.close();
+        return pkt_count;
+    }
+
+    // Feeds the workers until the capture ends or fails to read; a read error is left in
+    // `error` and the workers are still told to finish, so that the pipeline drains.
+    template <typename Record>
+    uint64_t read(PcapReader &reader,
+                  std::vector<std::unique_ptr<SpscRing<ShardInput>>> &inputs,
+                  std::exception_ptr &error) {
+        std::vector<Dissector> dissectors;
+        std::vector<RawPacket> batch;
+        // The timer wheel is only used here for its tick arithmetic.
+        TimerWheel<int> clock(timer_resolution_);
+        PacketDescriptor packet;
+        uint64_t pkt_count = 0;
+        uint64_t current_tick = 0;
+
+        auto broadcast = [&inputs](ShardInput::Kind kind, uint64_t tick, uint64_t seq) {
+            for (auto &input : inputs) {
+                ShardInput message;
+                message.kind = kind;
+                message.tick = tick;
+                message.seq = seq;
+                input->push(std::move(message));
+            }
+        };
+
+        try {
+            while (reader.next_batch(batch)) {
+                while (dissectors.size() < reader.interface_count()) {
+                    dissectors.emplace_back(reader.link_type(dissectors.size()));
+                }
+
+                for (const auto &raw : batch) {
+                    auto seq = pkt_count++;
+                    auto tick = clock.tick_of(raw.timestamp);
+
+                    if (!seq || tick > current_tick || !(seq % sync_interval_)) {
+                        current_tick = std::max(current_tick, tick);
+                        broadcast(ShardInput::SYNC, current_tick, seq);
+                    }
+
+                    if (!dissectors[raw.interface].dissect(raw, packet)) {
+                        continue;
+                    }
+
+                    ShardInput message;
+                    message.kind = ShardInput::PACKET;
+                    message.seq = seq;
+                    message.pair = packet.pair;
+                    message.features = PacketFeatures(packet, Record::PAYLOAD);
+                    inputs[packet.pair.canonical().hash() % inputs.size()]->push(
+                        std::move(message));
+                }
+            }
+        } catch (...) {
+            error = std::current_exception();
+        }
+
+        broadcast(ShardInput::END, current_tick, pkt_count);
+        return pkt_count;
+    }
+
+    template <typename Record>
+    void work(SpscRing<ShardInput> &input, SpscRing<ShardOutput<Record>> &output) {
+        ShardSink<Record> sink(output);
+        FlowTable<ShardSink<Record>, Record> table(sink, active_timeout_, idle_timeout_,
+                                                   timer_resolution_, true);
+        table.set_limits(limits_.split(threads_));
+        table.set_session_linger(session_linger_);
+        ShardInput message;
+
+        while (true) {
+            input.pop(message);
+            if (message.kind == ShardInput::PACKET) {
+                table.process(message.pair, message.features, message.seq);
+            } else if (message.kind == ShardInput::SYNC) {
+                table.advance_tick(message.tick);
+                sink.watermark(
+                    ExportPosition{message.tick, ExportPosition::PACKET, message.seq});
+            } else {
+                evicted_ += table.evicted();
+                table.finish();
+                sink.done();
+                return;
+            }
+        }
+    }
+
+    // k-way merge of the worker streams. An item can be written once every worker has
+    // something queued, because each stream is ordered and the smallest head is then
+    // known to be the smallest item overall.
+    template <typename Output, typename Sink>
+    void merge(std::vector<std::unique_ptr<SpscRing<Output>>> &outputs, Sink &sink) {
+        const size_t shards = outputs.size();
+        std::vector<Output> heads(shards);
+        std::vector<bool> ready(shards, false);
+        CreationOrder ids;
+        uint32_t spins = 0;
+
+        while (true) {
+            bool waiting = false;
+            for (size_t i = 0; i < shards; i++) {
+                if (!ready[i]) {
+                    ready[i] = outputs[i]->try_pop(heads[i]);
+                    waiting |= !ready[i];
+                }
+            }
+            if (waiting) {
+                SpscRing<Output>::backoff(spins);
+                continue;
+            }
+            spins = 0;
+
+            size_t next = 0;
+            for (size_t i = 1; i < shards; i++) {
+                if (heads[i].position < heads[next].position) {
+                    next = i;
+                }
+            }
+
+            auto &item = heads[next];
+            if (item.kind == Output::DONE) {
+                // DONE sorts after everything, so every other shard is finished too.
+                return;
+            }
+            ids.emit(item, sink);
+            ready[next] = false;
+        }
+    }
+
+    void pin(pthread_t thread, size_t index) const { pin_thread(thread, cpus_, index); }
+
+    std::string pcap_path_;
+    std::string output_path_;
+    double seconds_;
+    double pkts_per_sec_;
+    double active_timeout_;
+    double idle_timeout_;
+    double timer_resolution_;
+    uint32_t threads_;
+    std::vector<int> cpus_;
+    OutputFormat format_;
+    FeatureProfile profile_;
+    FlowLimits limits_;
+    double session_linger_{-1};
+    std::atomic<uint64_t> evicted_{0};
+    // Each packet yields at most a couple of output items, so an output ring several
+    // times the sync interval can always absorb what a worker produces between two
+    // watermarks and the pipeline cannot stall on itself.
+    static constexpr uint64_t sync_interval_{1024};
+    static constexpr size_t input_capacity_{4096};
+    static constexpr size_t output_capacity_{8 * sync_interval_};
+};
+
+} // end namespace Net
+
+#endif
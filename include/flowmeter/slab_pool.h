@@ -0,0 +1,84 @@
+#ifndef FLOWMETER_SLAB_POOL_H
+#define FLOWMETER_SLAB_POOL_H
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace Net {
+
+// Fixed-size object pool. Objects live in slabs of `SLAB_SIZE` slots that are never
+// moved or returned to the allocator while the pool exists, so pointers stay valid as
+// the pool grows and creating or destroying an object in steady state is a free-list
+// push or pop. Released slots are reused most recent first, while still cache-warm.
+template <typename T, size_t SLAB_SIZE = 1024>
+class SlabPool {
+    static_assert(std::is_trivially_destructible_v<T>,
+                  "SlabPool never runs destructors, so T must not need one");
+
+  public:
+    SlabPool() = default;
+    SlabPool(const SlabPool &) = delete;
+    SlabPool &operator=(const SlabPool &) = delete;
+
+    template <typename... Args>
+    inline T *create(Args &&...args) {
+        Slot *slot = free_;
+        if (slot) {
+            free_ = slot->next;
+        } else {
+            if (used_ == slabs_.size() * SLAB_SIZE) {
+                slabs_.push_back(std::make_unique_for_overwrite<Slot[]>(SLAB_SIZE));
+            }
+            slot = &slabs_[used_ / SLAB_SIZE][used_ % SLAB_SIZE];
+            used_++;
+        }
+        size_++;
+        return ::new (static_cast<void *>(slot->storage)) T(std::forward<Args>(args)...);
+    }
+
+    inline void destroy(T *object) {
+        auto *slot = reinterpret_cast<Slot *>(object);
+        slot->next = free_;
+        free_ = slot;
+        size_--;
+    }
+
+    // Releases every object at once but keeps the slabs for reuse.
+    void clear() {
+        free_ = nullptr;
+        used_ = 0;
+        size_ = 0;
+    }
+
+    // Makes room for `count` objects up front.
+    void reserve(size_t count) {
+        while (slabs_.size() * SLAB_SIZE < count) {
+            slabs_.push_back(std::make_unique_for_overwrite<Slot[]>(SLAB_SIZE));
+        }
+    }
+
+    size_t size() const { return size_; }
+
+    size_t capacity() const { return slabs_.size() * SLAB_SIZE; }
+
+    size_t memory_bytes() const { return capacity() * sizeof(Slot); }
+
+  private:
+    union Slot {
+        Slot *next;
+        alignas(T) std::byte storage[sizeof(T)];
+    };
+
+    std::vector<std::unique_ptr<Slot[]>> slabs_;
+    Slot *free_{nullptr};
+    size_t used_{0};
+    size_t size_{0};
+};
+
+} // end namespace Net
+
+#endif
@@ -0,0 +1,518 @@
+#ifndef FLOWMETER_SPLIT_METER_H
+#define FLOWMETER_SPLIT_METER_H
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "flowmeter/constants.h"
+#include "flowmeter/dissector.h"
+#include "flowmeter/features.h"
+#include "flowmeter/flow_table.h"
+#include "flowmeter/meter.h"
+#include "flowmeter/pcap_reader.h"
+#include "flowmeter/sharded_meter.h"
+
+namespace Net {
+
+// A packet as a range table saw it: where its record starts, the tick the table's clock
+// was on when it arrived and what the table was given for it.
+struct RangePacket {
+    uint64_t offset;
+    uint64_t tick;
+    ServicePair pair;
+    PacketFeatures features;
+};
+
+// The packets that went into the first flow a range table created under one key, up to
+// the point where that flow left the table.
+struct RangeHead {
+    int64_t init_id{0};
+    bool open{true};
+    std::vector<RangePacket> packets;
+};
+
+// Head flows of a range, by canonical pair.
+struct RangeHeads {
+    absl::flat_hash_map<ServicePair, RangeHead> index;
+    size_t open{0};
+
+    inline void close(const ServicePair &key, int64_t init_id) {
+        auto it = index.find(key);
+        if (it != index.end() && it->second.init_id == init_id && it->second.open) {
+            it->second.open = false;
+            open--;
+        }
+    }
+};
+
+// A flow still in a table, with the tick its timer is due on.
+template <typename Record = NetworkFlow>
+struct PendingFlow {
+    Record flow;
+    uint64_t tick;
+};
+
+// What metering one byte range on its own leaves for the stitch stage.
+template <typename Record = NetworkFlow>
+struct RangeResult {
+    // CREATE, RECORD and RETIRE items, in ExportPosition order.
+    std::vector<ShardOutput<Record>> events;
+    // Flows still in the table once the range was read.
+    std::vector<PendingFlow<Record>> alive;
+    RangeHeads heads;
+    uint64_t packets{0};
+    double first_timestamp{0};
+    double last_timestamp{0};
+    // Whether a packet was stamped earlier than the one before it.
+    bool reordered{false};
+    uint64_t last_tick{0};
+    // Offset of the first record past the range.
+    size_t end_offset{0};
+    std::exception_ptr error;
+};
+
+// FlowTable sink of a range: keeps every event and, given `heads`, closes the head of a
+// key once its flow leaves the table.
+template <typename Record = NetworkFlow>
+class RangeSink {
+  public:
+    using Output = ShardOutput<Record>;
+
+    RangeSink(std::vector<Output> &events, RangeHeads *heads = nullptr)
+        : events_(events), heads_(heads) {}
+
+    inline void on_record(const Record &flow, const ExportPosition &position) {
+        events_.push_back(Output{Output::RECORD, position, flow.init_id, flow});
+        if (flow.exp_code != ExpirationCode::ACTIVE_TIMEOUT) {
+            close(flow);
+        }
+    }
+
+    inline void on_create(const Record &flow, const ExportPosition &position) {
+        events_.push_back(Output{Output::CREATE, position, flow.init_id, std::nullopt});
+    }
+
+    inline void on_retire(const Record &flow, const ExportPosition &position) {
+        events_.push_back(Output{Output::RETIRE, position, flow.init_id, std::nullopt});
+        close(flow);
+    }
+
+  private:
+    std::vector<Output> &events_;
+    RangeHeads *heads_;
+
+    inline void close(const Record &flow) {
+        if (heads_ && heads_->open) {
+            heads_->close(flow.service_pair.canonical(), flow.init_id);
+        }
+    }
+};
+
+// Meters one large classic pcap file on several cores by splitting it into byte ranges
+// of about `split_size` bytes, each resynchronized to a record boundary and run through
+// a FlowTable of its own, from an empty table and with the byte offset of a packet's
+// record as its sequence number.
+//
+// The calling thread stitches the ranges together in file order. A flow that is still
+// alive at the end of one range is carried into the next, where the range's own table
+// has started a fresh flow under the same key instead. Statistics cannot be merged
+// after the fact without changing the output, since the active timeout of the carried
+// flow cuts the packets at different places and floating point sums depend on their
+// order, so the packets that the fresh flow took are replayed on top of the carried one
+// and the fresh flow is dropped. Once a flow has left the table on an idle timeout,
+// which happens at the same tick in both tables because it only depends on the last
+// packet, everything the range reported after it stands as is. If the capture steps
+// back in time within a range or across its start, that range is metered again on the
+// calling thread on top of the carried flows, since none of this holds then.
+//
+// Flows keep their ids through all of this, so the merged events are renumbered in
+// creation order as in ShardedMeter, and the output is identical to a serial run.
+class SplitMeter {
+  public:
+    SplitMeter(const std::string &input_file, const std::string &output_file,
+               const double &active_timeout, const double &idle_timeout,
+               const double &timer_resolution, const uint32_t &threads,
+               const uint64_t &split_size = default_split_size_,
+               const std::vector<int> &cpus = {},
+               const OutputFormat &format = OutputFormat::CSV,
+               const FeatureProfile &profile = FeatureProfile::FULL)
+        : pcap_path_(input_file), output_path_(output_file),
+          active_timeout_(active_timeout), idle_timeout_(idle_timeout),
+          timer_resolution_(timer_resolution), threads_(std::max<uint32_t>(threads, 1)),
+          split_size_(std::max<uint64_t>(split_size, 1)), cpus_(cpus), format_(format),
+          profile_(profile) {}
+
+    void run() {
+        PcapReader reader(pcap_path_);
+        if (reader.is_compressed()) {
+            throw std::runtime_error(pcap_path_ + " is compressed; only an uncompressed "
+                                                  "file can be split");
+        }
+        if (reader.is_pcapng()) {
+            throw std::runtime_error(pcap_path_ +
+                                     " is a pcapng file; only classic pcap can be split");
+        }
+        auto ranges = split(reader);
+        std::cout << "Processing " << pcap_path_ << " in " << ranges.size()
+                  << " ranges on " << threads_ << " workers" << std::endl;
+        auto start_time = high_resolution_clock::now();
+        auto pkt_count = with_profile(profile_, [this, &reader, &ranges](auto record) {
+            using Record = typename decltype(record)::type;
+            if (format_ == OutputFormat::COLUMNAR) {
+                ColumnarSink<Record> sink(output_path_);
+                return pipeline<Record>(reader, ranges, sink);
+            }
+            CsvSink<Record> sink(output_path_);
+            return pipeline<Record>(reader, ranges, sink);
+        });
+
+        // Display meter summary
+        auto end_time = high_resolution_clock::now();
+        auto nanosecs =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - start_time)
+                .count();
+        seconds_ = nanosecs / 1'000'000'000.0;
+        pkts_per_sec_ = pkt_count / seconds_;
+        std::cout << "Read " << pkt_count << " packets in " << seconds_ << " seconds"
+                  << std::endl;
+        std::cout << std::setprecision(MAX_DOUBLE_PRECISION) << pkts_per_sec_
+                  << " pkts/sec" << std::endl;
+    }
+
+    static constexpr uint64_t default_split_size_{64 << 20};
+
+  private:
+    using Range = std::pair<size_t, size_t>;
+
+    // Flows carried from one range into the next, and the clock of a serial table at
+    // that point.
+    template <typename Record>
+    struct Carry {
+        std::vector<PendingFlow<Record>> flows;
+        uint64_t tick{0};
+        double timestamp{0};
+        bool started{false};
+    };
+
+    // Record boundaries about `split_size_` bytes apart. The last range is open-ended
+    // so that it takes whatever the reader would.
+    std::vector<Range> split(const PcapReader &reader) const {
+        std::vector<size_t> starts{reader.offset()};
+        for (size_t at = starts.front() + split_size_; at < reader.size();
+             at += split_size_) {
+            auto start = reader.resync(at);
+            if (start > starts.back() && start < reader.size()) {
+                starts.push_back(start);
+            }
+        }
+        std::vector<Range> ranges;
+        for (size_t i = 0; i < starts.size(); i++) {
+            ranges.emplace_back(starts[i],
+                                i + 1 < starts.size() ? starts[i + 1] : SIZE_MAX);
+        }
+        return ranges;
+    }
+
+    // Meters the ranges on the worker threads, at most a few ahead of the stitch stage
+    // so that memory stays bounded, and stitches them into `sink` on the calling
+    // thread; returns the packet count.
+    template <typename Record, typename Sink>
+    uint64_t pipeline(PcapReader &reader, const std::vector<Range> &ranges, Sink &sink) {
+        const size_t count = ranges.size();
+        const size_t window = 2 * threads_;
+        std::vector<std::optional<RangeResult<Record>>> results(count);
+        std::mutex mutex;
+        std::condition_variable changed;
+        size_t next = 0;
+        size_t consumed = 0;
+        bool stop = false;
+
+        std::vector<std::thread> workers;
+        for (uint32_t i = 0; i < threads_; i++) {
+            workers.emplace_back([&, this]() {
+                while (true) {
+                    size_t index;
+                    {
+                        std::unique_lock lock(mutex);
+                        changed.wait(lock, [&]() {
+                            return stop || next == count || next < consumed + window;
+                        });
+                        if (stop || next == count) {
+                            return;
+                        }
+                        index = next++;
+                    }
+                    RangeResult<Record> result;
+                    try {
+                        meter_range<Record>(ranges[index], result);
+                    } catch (...) {
+                        result.error = std::current_exception();
+                    }
+                    {
+                        std::lock_guard lock(mutex);
+                        results[index] = std::move(result);
+                    }
+                    changed.notify_all();
+                }
+            });
+            pin_thread(workers.back().native_handle(), cpus_, i);
+        }
+        pin_thread(pthread_self(), cpus_, threads_);
+
+        auto join = [&]() {
+            for (auto &worker : workers) {
+                worker.join();
+            }
+        };
+
+        uint64_t pkt_count = 0;
+        try {
+            Dissector dissector(reader.link_type(0));
+            Carry<Record> carry;
+            CreationOrder ids;
+            for (size_t i = 0; i < count; i++) {
+                RangeResult<Record> result;
+                {
+                    std::unique_lock lock(mutex);
+                    changed.wait(lock, [&]() { return results[i].has_value(); });
+                    result = std::move(*results[i]);
+                    results[i].reset();
+                    consumed = i + 1;
+                }
+                changed.notify_all();
+
+                if (result.error) {
+                    std::rethrow_exception(result.error);
+                }
+                if (i + 1 < count && result.end_offset != ranges[i + 1].first) {
+                    throw std::runtime_error("Unable to split " + pcap_path_ +
+                                             " on record boundaries");
+                }
+                pkt_count += result.packets;
+                stitch<Record>(reader, dissector, ranges[i], result, carry, ids, sink);
+            }
+
+            // Whatever is left ends with the input, as in FlowTable::finish.
+            std::vector<ShardOutput<Record>> events;
+            RangeSink<Record> tail(events);
+            FlowTable<RangeSink<Record>, Record> table(tail, active_timeout_,
+                                                       idle_timeout_, timer_resolution_,
+                                                       true);
+            for (const auto &pending : carry.flows) {
+                table.adopt(pending.flow, pending.tick);
+            }
+            table.finish();
+            for (auto &item : events) {
+                ids.emit(item, sink);
+            }
+        } catch (...) {
+            {
+                std::lock_guard lock(mutex);
+                stop = true;
+            }
+            changed.notify_all();
+            join();
+            throw;
+        }
+        join();
+        sink.close();
+        return pkt_count;
+    }
+
+    // Meters one range from an empty table. Unless the capture steps back in time, a
+    // flow carried in from the previous range last saw a packet no later than this
+    // range's first one, so it is gone once the clock reaches `cutoff`; until then the
+    // packets of the first flow under every key are kept, in case that flow turns out
+    // to continue a carried one.
+    template <typename Record>
+    void meter_range(const Range &range, RangeResult<Record> &result) const {
+        PcapReader reader(pcap_path_);
+        reader.seek(range.first, range.second);
+        Dissector dissector(reader.link_type(0));
+        RangeSink<Record> sink(result.events, &result.heads);
+        FlowTable<RangeSink<Record>, Record> table(sink, active_timeout_, idle_timeout_,
+                                                   timer_resolution_, true);
+        auto &heads = result.heads;
+        uint64_t cutoff = 0;
+        std::vector<RawPacket> batch;
+        PacketDescriptor packet;
+
+        while (reader.next_batch(batch)) {
+            for (const auto &raw : batch) {
+                auto seq = reader.record_offset(raw);
+                table.advance(raw.timestamp);
+                auto tick = table.current_tick();
+                if (!result.packets++) {
+                    result.first_timestamp = raw.timestamp;
+                    result.last_timestamp = raw.timestamp;
+                    cutoff = static_cast<uint64_t>(
+                        std::ceil((raw.timestamp + idle_timeout_) / timer_resolution_));
+                }
+                result.reordered |= raw.timestamp < result.last_timestamp;
+                result.last_timestamp = std::max(result.last_timestamp, raw.timestamp);
+                if (!dissector.dissect(raw, packet)) {
+                    continue;
+                }
+                auto features = PacketFeatures(packet, Record::PAYLOAD);
+
+                RangeHead *head = nullptr;
+                if (tick < cutoff) {
+                    // The first packet under a key always creates the head flow.
+                    auto [it, fresh] = heads.index.try_emplace(packet.pair.canonical());
+                    if (fresh) {
+                        it->second.init_id = static_cast<int64_t>(seq);
+                        heads.open++;
+                    }
+                    head = &it->second;
+                } else if (heads.open) {
+                    auto it = heads.index.find(packet.pair.canonical());
+                    head = it != heads.index.end() ? &it->second : nullptr;
+                }
+                if (head && head->open) {
+                    head->packets.push_back(RangePacket{seq, tick, packet.pair, features});
+                }
+                table.process(packet.pair, features, seq);
+            }
+        }
+
+        result.end_offset = reader.offset();
+        result.last_tick = table.current_tick();
+        result.alive.reserve(table.size());
+        table.for_each([&result](const Record &flow, uint64_t tick) {
+            result.alive.push_back(PendingFlow<Record>{flow, tick});
+        });
+    }
+
+    // Continues the carried flows through `result` as a serial table would have, and
+    // writes the range's events with the corrections merged in.
+    template <typename Record, typename Sink>
+    void stitch(PcapReader &reader, Dissector &dissector, const Range &range,
+                RangeResult<Record> &result, Carry<Record> &carry, CreationOrder &ids,
+                Sink &sink) const {
+        if (!result.packets) {
+            return;
+        }
+        std::vector<ShardOutput<Record>> events;
+        RangeSink<Record> replay(events);
+        FlowTable<RangeSink<Record>, Record> table(replay, active_timeout_, idle_timeout_,
+                                                   timer_resolution_, true);
+        if (carry.started) {
+            table.advance_tick(carry.tick);
+        }
+        for (const auto &pending : carry.flows) {
+            table.adopt(pending.flow, pending.tick);
+        }
+
+        if (result.reordered ||
+            (carry.started && result.first_timestamp < carry.timestamp)) {
+            reader.seek(range.first, range.second);
+            std::vector<RawPacket> batch;
+            PacketDescriptor packet;
+            while (reader.next_batch(batch)) {
+                for (const auto &raw : batch) {
+                    table.advance(raw.timestamp);
+                    if (dissector.dissect(raw, packet)) {
+                        table.process(packet.pair, PacketFeatures(packet, Record::PAYLOAD),
+                                      reader.record_offset(raw));
+                    }
+                }
+            }
+            result.events.clear();
+            result.alive.clear();
+        } else {
+            // Packets of the range's head flows under the carried keys, in file order.
+            absl::flat_hash_map<ServicePair, int64_t> carried;
+            std::vector<const RangePacket *> packets;
+            for (const auto &pending : carry.flows) {
+                auto key = pending.flow.service_pair.canonical();
+                auto it = result.heads.index.find(key);
+                if (it != result.heads.index.end()) {
+                    carried[key] = pending.flow.init_id;
+                    for (const auto &packet : it->second.packets) {
+                        packets.push_back(&packet);
+                    }
+                }
+            }
+            std::sort(packets.begin(), packets.end(),
+                      [](const auto *lhs, const auto *rhs) {
+                          return lhs->offset < rhs->offset;
+                      });
+
+            absl::flat_hash_set<int64_t> dropped;
+            for (const auto *entry : packets) {
+                table.advance_tick(entry->tick);
+                // A carried flow that expired before the head flow started leaves the
+                // head flow as it is.
+                auto key = entry->pair.canonical();
+                if (!table.contains(key, carried[key])) {
+                    continue;
+                }
+                auto seq = static_cast<int64_t>(entry->offset);
+                if (result.heads.index[key].init_id == seq) {
+                    dropped.insert(seq);
+                }
+                table.process(entry->pair, entry->features, entry->offset);
+            }
+
+            if (!dropped.empty()) {
+                std::erase_if(result.events, [&dropped](const auto &item) {
+                    return dropped.contains(item.flow_id);
+                });
+                std::erase_if(result.alive, [&dropped](const auto &pending) {
+                    return dropped.contains(pending.flow.init_id);
+                });
+            }
+        }
+        table.advance_tick(result.last_tick);
+
+        // Both streams are in ExportPosition order.
+        auto lhs = events.begin();
+        auto rhs = result.events.begin();
+        while (lhs != events.end() || rhs != result.events.end()) {
+            if (rhs == result.events.end() ||
+                (lhs != events.end() && lhs->position < rhs->position)) {
+                ids.emit(*lhs++, sink);
+            } else {
+                ids.emit(*rhs++, sink);
+            }
+        }
+
+        carry.flows = std::move(result.alive);
+        table.for_each([&carry](const Record &flow, uint64_t tick) {
+            carry.flows.push_back(PendingFlow<Record>{flow, tick});
+        });
+        carry.tick = table.current_tick();
+        carry.timestamp = std::max(carry.timestamp, result.last_timestamp);
+        carry.started = true;
+    }
+
+    std::string pcap_path_;
+    std::string output_path_;
+    double seconds_;
+    double pkts_per_sec_;
+    double active_timeout_;
+    double idle_timeout_;
+    double timer_resolution_;
+    uint32_t threads_;
+    uint64_t split_size_;
+    std::vector<int> cpus_;
+    OutputFormat format_;
+    FeatureProfile profile_;
+};
+
+} // end namespace Net
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef FLOWMETER_SPSC_RING_H
+#define FLOWMETER_SPSC_RING_H
+
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace Net {
+
+// Fixed rather than std::hardware_destructive_interference_size, whose value depends on
+// the tuning flags a translation unit happens to be built with.
+inline constexpr size_t CACHE_LINE_SIZE = 64;
+
+// Bounded lock-free queue for exactly one producer thread and one consumer thread.
+// Each side keeps a private copy of the other side's index and only reloads the shared
+// atomic when that copy says the ring is full (producer) or empty (consumer), so in
+// steady state a push or pop touches a single shared cache line.
+template <typename T>
+class SpscRing {
+  public:
+    SpscRing(size_t capacity)
+        : mask_(std::bit_ceil(std::max<size_t>(capacity, 2)) - 1), slots_(mask_ + 1) {}
+
+    SpscRing(const SpscRing &) = delete;
+    SpscRing &operator=(const SpscRing &) = delete;
+
+    inline bool try_push(T &&value) {
+        auto tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_cache_ > mask_) {
+            head_cache_ = head_.load(std::memory_order_acquire);
+            if (tail - head_cache_ > mask_) {
+                return false;
+            }
+        }
+        slots_[tail & mask_] = std::move(value);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Blocks by spinning, then yielding, until there is room.
+    inline void push(T &&value) {
+        uint32_t spins = 0;
+        while (!try_push(std::move(value))) {
+            backoff(spins);
+        }
+    }
+
+    inline bool try_pop(T &value) {
+        auto head = head_.load(std::memory_order_relaxed);
+        if (head == tail_cache_) {
+            tail_cache_ = tail_.load(std::memory_order_acquire);
+            if (head == tail_cache_) {
+                return false;
+            }
+        }
+        value = std::move(slots_[head & mask_]);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    inline void pop(T &value) {
+        uint32_t spins = 0;
+        while (!try_pop(value)) {
+            backoff(spins);
+        }
+    }
+
+    size_t capacity() const { return mask_ + 1; }
+
+    static inline void backoff(uint32_t &spins) {
+        if (++spins < spin_limit_) {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        } else {
+            std::this_thread::yield();
+        }
+    }
+
+  private:
+    static constexpr uint32_t spin_limit_ = 256;
+    const size_t mask_;
+    std::vector<T> slots_;
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> head_{0};
+    size_t tail_cache_{0};
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail_{0};
+    size_t head_cache_{0};
+};
+
+} // end namespace Net
+
+#endif
@@ -1,27 +1,25 @@
 #ifndef FLOWMETER_STATISTIC_H
 #define FLOWMETER_STATISTIC_H
 
+#include "fmt/format.h"
+#include <iterator>
 #include <limits>
-#include <sstream>
 #include <string>
 
 #include "flowmeter/constants.h"
 
 namespace Net {
 
+// Running summary of one per-packet feature. Column names live in the static schema of
+// Flow, so a Statistic is plain data.
 template <typename T>
 struct Statistic {
-    std::string name;
-    std::string header;
     T min = std::numeric_limits<T>::max();
     T max = std::numeric_limits<T>::min();
     T count = 0;
     double mean = 0;
     double stddev = 0;
 
-    Statistic(std::string header_name, std::string stat_name)
-        : header(header_name), name(stat_name) {}
-
     inline void reset() {
         min = std::numeric_limits<T>::max();
         max = std::numeric_limits<T>::min();
@@ -39,24 +37,25 @@ struct Statistic {
         stddev += (val - tmp_mean) * (val - mean);
     }
 
-    const std::string column_names() const {
-        std::stringstream ss;
-        ss << header << "_min_" << name << "," << header << "_max_" << name << ","
-           << header << "_mean_" << name << "," << header << "_stddev_" << name;
-        return ss.str();
+    // Calls `f` with each value, in column order.
+    template <typename F>
+    void visit(F &&f) const {
+        f(min);
+        f(max);
+        f(mean);
+        f(stddev);
+    }
+
+    // Doubles are written in their shortest form that reads back to the same value.
+    template <typename OutputIt>
+    OutputIt format_to(OutputIt out) const {
+        return fmt::format_to(out, "{},{},{},{}", min, max, mean, stddev);
     }
 
     const std::string to_string() const {
-        std::stringstream ss;
-        if constexpr (std::is_same<T, double>()) {
-            ss << std::setprecision(MAX_DOUBLE_PRECISION) << min << ","
-               << std::setprecision(MAX_DOUBLE_PRECISION) << max << ",";
-        } else {
-            ss << min << "," << max << ",";
-        }
-        ss << std::setprecision(MAX_DOUBLE_PRECISION) << mean << ","
-           << std::setprecision(MAX_DOUBLE_PRECISION) << stddev;
-        return ss.str();
+        fmt::memory_buffer buffer;
+        format_to(std::back_inserter(buffer));
+        return fmt::to_string(buffer);
     }
 };
 
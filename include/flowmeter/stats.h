@@ -0,0 +1,283 @@
+#ifndef FLOWMETER_STATS_H
+#define FLOWMETER_STATS_H
+
+#include "fmt/format.h"
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "flowmeter/csv_writer.h"
+#include "flowmeter/flow.h"
+
+// Runtime instrumentation is compiled in only when FLOWMETER_STATS is non-zero; without
+// it every counter and timer below is an empty inline function.
+#ifndef FLOWMETER_STATS
+#define FLOWMETER_STATS 0
+#endif
+
+namespace Net {
+
+inline constexpr bool STATS_ENABLED = FLOWMETER_STATS != 0;
+
+enum class Stage : uint8_t { READ, PARSE, LOOKUP, UPDATE, EXPIRE, EXPORT, NONE };
+
+inline constexpr size_t STAGE_COUNT = static_cast<size_t>(Stage::NONE);
+inline constexpr std::array<std::string_view, STAGE_COUNT> STAGE_NAMES = {
+    "read", "parse", "lookup", "update", "expire", "export"};
+
+inline constexpr size_t EXPIRATION_CODE_COUNT = ExpirationCode::USER_SPECIFIED + 1;
+inline constexpr std::array<std::string_view, EXPIRATION_CODE_COUNT> EXPIRATION_NAMES = {
+    "uninitialized", "alive", "active_timeout", "idle_timeout", "session_end",
+    "user_specified"};
+
+// Time stamp counter on x86, a monotonic nanosecond clock elsewhere.
+inline uint64_t cycle_count() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1'000'000'000 +
+           static_cast<uint64_t>(now.tv_nsec);
+#endif
+}
+
+// Counters of one metering thread. Stage cycles are exclusive: entering a stage pauses
+// the one it is nested in, so the export of a record during expiration is charged to
+// export alone and the stages add up to the instrumented time.
+struct RuntimeStats {
+    std::array<uint64_t, STAGE_COUNT> cycles{};
+    uint64_t packets{0};
+    uint64_t flows_created{0};
+    // Flows that ended with a record, by the record's ExpirationCode.
+    std::array<uint64_t, EXPIRATION_CODE_COUNT> flows_expired{};
+    // Flows dropped without a record after an active timeout left them empty.
+    uint64_t flows_retired{0};
+    // Flows pushed out of a full table, included in the two counters above.
+    uint64_t flows_evicted{0};
+    // Sampled when the stats are written.
+    uint64_t table_size{0};
+    uint64_t table_capacity{0};
+    uint64_t table_bytes{0};
+    uint64_t bytes_written{0};
+    double capture_time{0};
+
+    inline void enter(Stage stage) {
+        if constexpr (STATS_ENABLED) {
+            auto now = cycle_count();
+            if (active_ != Stage::NONE) {
+                cycles[static_cast<size_t>(active_)] += now - mark_;
+            }
+            stack_[depth_++] = active_;
+            active_ = stage;
+            mark_ = now;
+        }
+    }
+
+    inline void leave() {
+        if constexpr (STATS_ENABLED) {
+            auto now = cycle_count();
+            cycles[static_cast<size_t>(active_)] += now - mark_;
+            active_ = stack_[--depth_];
+            mark_ = now;
+        }
+    }
+
+    inline void count_packet(double timestamp) {
+        if constexpr (STATS_ENABLED) {
+            packets++;
+            capture_time = timestamp;
+        }
+    }
+
+    inline void count_created() {
+        if constexpr (STATS_ENABLED) {
+            flows_created++;
+        }
+    }
+
+    inline void count_expired(ExpirationCode code) {
+        if constexpr (STATS_ENABLED) {
+            flows_expired[code]++;
+        }
+    }
+
+    inline void count_retired() {
+        if constexpr (STATS_ENABLED) {
+            flows_retired++;
+        }
+    }
+
+    inline void count_evicted() {
+        if constexpr (STATS_ENABLED) {
+            flows_evicted++;
+        }
+    }
+
+    double load_factor() const {
+        return table_capacity ? static_cast<double>(table_size) / table_capacity : 0;
+    }
+
+  private:
+    static constexpr size_t MAX_DEPTH = 8;
+    Stage active_{Stage::NONE};
+    uint64_t mark_{0};
+    std::array<Stage, MAX_DEPTH> stack_{};
+    size_t depth_{0};
+};
+
+// Charges the enclosing scope to `stage`. `stats` may be null, for tables that are not
+// instrumented.
+class ScopedStage {
+  public:
+    inline ScopedStage(RuntimeStats *stats, Stage stage) : stats_(stats) {
+        if constexpr (STATS_ENABLED) {
+            if (stats_) {
+                stats_->enter(stage);
+            }
+        }
+    }
+
+    inline ~ScopedStage() {
+        if constexpr (STATS_ENABLED) {
+            if (stats_) {
+                stats_->leave();
+            }
+        }
+    }
+
+    ScopedStage(const ScopedStage &) = delete;
+    ScopedStage &operator=(const ScopedStage &) = delete;
+
+  private:
+    RuntimeStats *stats_;
+};
+
+enum class StatsFormat { PROMETHEUS, JSON };
+
+// Writes RuntimeStats every `interval` seconds of wall-clock time. The Prometheus text
+// format replaces the file each time, through a rename so that a scraper never sees a
+// partial file, as node_exporter's textfile collector expects. JSON appends one line
+// per snapshot.
+class StatsWriter {
+  public:
+    StatsWriter(const std::string &path, StatsFormat format, double interval)
+        : path_(path), format_(format),
+          interval_(std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+              std::chrono::duration<double>(interval))),
+          next_(std::chrono::steady_clock::now() + interval_) {
+        if (format_ == StatsFormat::JSON) {
+            // Flushed after every line, so each snapshot reaches the file at once.
+            lines_ = std::make_unique<CsvWriter>(path_, 0);
+        }
+    }
+
+    // Whether the next snapshot is due; cheap enough to ask once per batch.
+    inline bool due() const { return std::chrono::steady_clock::now() >= next_; }
+
+    void write(const RuntimeStats &stats) {
+        next_ = std::chrono::steady_clock::now() + interval_;
+        if (format_ == StatsFormat::JSON) {
+            lines_->write_line(json(stats));
+            return;
+        }
+        auto temporary = path_ + ".tmp";
+        {
+            CsvWriter out(temporary);
+            out.write_line(prometheus(stats));
+        }
+        if (std::rename(temporary.c_str(), path_.c_str()) != 0) {
+            throw std::runtime_error("Unable to replace " + path_);
+        }
+    }
+
+    static std::string prometheus(const RuntimeStats &stats) {
+        fmt::memory_buffer out;
+        auto it = std::back_inserter(out);
+        auto metric = [&it](std::string_view name, std::string_view type,
+                            std::string_view help) {
+            fmt::format_to(it, "# HELP flowmeter_{} {}\n# TYPE flowmeter_{} {}\n", name,
+                           help, name, type);
+        };
+        metric("stage_cycles_total", "counter",
+               "Cycles spent in each metering stage, exclusive of nested stages.");
+        for (size_t i = 0; i < STAGE_COUNT; i++) {
+            fmt::format_to(it, "flowmeter_stage_cycles_total{{stage=\"{}\"}} {}\n",
+                           STAGE_NAMES[i], stats.cycles[i]);
+        }
+        metric("packets_total", "counter", "Packets read.");
+        fmt::format_to(it, "flowmeter_packets_total {}\n", stats.packets);
+        metric("flows_created_total", "counter", "Flows added to the flow table.");
+        fmt::format_to(it, "flowmeter_flows_created_total {}\n", stats.flows_created);
+        metric("flows_expired_total", "counter", "Flow records exported, by reason.");
+        for (auto code : {ACTIVE_TIMEOUT, IDLE_TIMEOUT, SESSION_END, USER_SPECIFIED}) {
+            fmt::format_to(it, "flowmeter_flows_expired_total{{reason=\"{}\"}} {}\n",
+                           EXPIRATION_NAMES[code], stats.flows_expired[code]);
+        }
+        metric("flows_retired_total", "counter", "Flows dropped without a record.");
+        fmt::format_to(it, "flowmeter_flows_retired_total {}\n", stats.flows_retired);
+        metric("flows_evicted_total", "counter", "Flows pushed out of a full flow table.");
+        fmt::format_to(it, "flowmeter_flows_evicted_total {}\n", stats.flows_evicted);
+        metric("flow_table_size", "gauge", "Flows in the flow table.");
+        fmt::format_to(it, "flowmeter_flow_table_size {}\n", stats.table_size);
+        metric("flow_table_load_factor", "gauge", "Occupied share of the index slots.");
+        fmt::format_to(it, "flowmeter_flow_table_load_factor {}\n", stats.load_factor());
+        metric("flow_table_bytes", "gauge", "Memory held by the flow table.");
+        fmt::format_to(it, "flowmeter_flow_table_bytes {}\n", stats.table_bytes);
+        metric("output_bytes_total", "counter", "Bytes written to the flow output.");
+        fmt::format_to(it, "flowmeter_output_bytes_total {}\n", stats.bytes_written);
+        metric("capture_time_seconds", "gauge", "Timestamp of the latest packet.");
+        fmt::format_to(it, "flowmeter_capture_time_seconds {}", stats.capture_time);
+        return fmt::to_string(out);
+    }
+
+    static std::string json(const RuntimeStats &stats) {
+        fmt::memory_buffer out;
+        auto it = std::back_inserter(out);
+        auto wall = std::chrono::duration<double>(
+                        std::chrono::system_clock::now().time_since_epoch())
+                        .count();
+        fmt::format_to(it, "{{\"time\":{},\"capture_time\":{},\"packets\":{},", wall,
+                       stats.capture_time, stats.packets);
+        fmt::format_to(it, "\"cycles\":{{");
+        for (size_t i = 0; i < STAGE_COUNT; i++) {
+            fmt::format_to(it, "{}\"{}\":{}", i ? "," : "", STAGE_NAMES[i],
+                           stats.cycles[i]);
+        }
+        fmt::format_to(it, "}},\"flows_created\":{},\"flows_expired\":{{",
+                       stats.flows_created);
+        bool first = true;
+        for (auto code : {ACTIVE_TIMEOUT, IDLE_TIMEOUT, SESSION_END, USER_SPECIFIED}) {
+            fmt::format_to(it, "{}\"{}\":{}", first ? "" : ",", EXPIRATION_NAMES[code],
+                           stats.flows_expired[code]);
+            first = false;
+        }
+        fmt::format_to(it,
+                       "}},\"flows_retired\":{},\"flows_evicted\":{},\"table_size\":{},"
+                       "\"table_load_factor\":{},\"table_bytes\":{},"
+                       "\"bytes_written\":{}}}",
+                       stats.flows_retired, stats.flows_evicted, stats.table_size,
+                       stats.load_factor(), stats.table_bytes, stats.bytes_written);
+        return fmt::to_string(out);
+    }
+
+  private:
+    std::string path_;
+    StatsFormat format_;
+    std::chrono::steady_clock::duration interval_;
+    std::chrono::steady_clock::time_point next_;
+    std::unique_ptr<CsvWriter> lines_;
+};
+
+} // end namespace Net
+
+#endif
@@ -0,0 +1,243 @@
+#ifndef FLOWMETER_TIMER_WHEEL_H
+#define FLOWMETER_TIMER_WHEEL_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace Net {
+
+// Hierarchical timing wheel keyed on capture time. Time is divided into ticks of
+// `resolution` seconds; four levels of 256 slots cover 2^32 ticks, and anything further
+// out waits in an overflow list. Advancing only visits slots that hold entries, so the
+// cost is proportional to the number of timers that come due rather than to the number
+// of timers outstanding.
+template <typename T>
+class TimerWheel {
+  public:
+    static constexpr uint32_t LEVELS = 4;
+    static constexpr uint32_t SLOT_BITS = 8;
+    static constexpr uint32_t SLOTS = 1u << SLOT_BITS;
+    static constexpr uint64_t SLOT_MASK = SLOTS - 1;
+
+    struct Entry {
+        uint64_t tick;
+        T value;
+    };
+
+    TimerWheel(double resolution) : resolution_(resolution) {}
+
+    double resolution() const { return resolution_; }
+
+    // Tick containing `timestamp`; the wheel is advanced to this when a packet arrives.
+    inline uint64_t tick_of(double timestamp) const {
+        return static_cast<uint64_t>(std::floor(timestamp / resolution_));
+    }
+
+    // First tick at or after `deadline`; a timer scheduled here fires no earlier than
+    // the deadline and at most one resolution later.
+    inline uint64_t deadline_tick(double deadline) const {
+        return static_cast<uint64_t>(std::ceil(deadline / resolution_));
+    }
+
+    uint64_t current_tick() const { return current_; }
+
+    size_t size() const { return size_; }
+
+    bool empty() const { return size_ == 0; }
+
+    // Starts the clock at `tick` if nothing has been scheduled yet.
+    inline void start(uint64_t tick) {
+        if (!started_) {
+            current_ = tick;
+            started_ = true;
+        }
+    }
+
+    inline void schedule(double deadline, const T &value) {
+        schedule_tick(deadline_tick(deadline), value);
+    }
+
+    inline void schedule_tick(uint64_t tick, const T &value) {
+        if (tick <= current_) {
+            tick = current_ + 1;
+        }
+        insert(Entry{tick, value});
+        size_++;
+    }
+
+    // Moves the clock to `target`, calling `fire(tick, entries)` once for every tick that
+    // has timers due, in increasing tick order. Entries may be rescheduled from inside
+    // the callback.
+    template <typename F>
+    void advance(uint64_t target, F &&fire) {
+        while (current_ < target) {
+            uint64_t next = current_ + 1;
+
+            // Jump over spans in which the lower levels are empty.
+            uint32_t level = 0;
+            while (level < LEVELS && !counts_[level]) {
+                level++;
+            }
+            if (level == LEVELS && overflow_.empty()) {
+                current_ = target;
+                return;
+            }
+            if (level > 0) {
+                uint64_t span = uint64_t{1} << (SLOT_BITS * level);
+                next = std::min(target, (current_ | (span - 1)) + 1);
+            }
+
+            current_ = next;
+            cascade();
+
+            auto &slot = levels_[0][current_ & SLOT_MASK];
+            if (slot.empty()) {
+                continue;
+            }
+            due_.clear();
+            due_.swap(slot);
+            counts_[0] -= due_.size();
+            size_ -= due_.size();
+            fire(current_, due_);
+        }
+    }
+
+    // Removes the entry with the earliest tick into `out`, or returns false if the wheel
+    // is empty. Looks at no more than one slot range per level, plus the overflow list.
+    bool take_earliest(Entry &out) {
+        std::vector<Entry> *best_slot = nullptr;
+        size_t best_index = 0;
+        uint32_t best_level = LEVELS;
+        auto consider = [&](std::vector<Entry> &slot, uint32_t level) {
+            for (size_t i = 0; i < slot.size(); i++) {
+                if (!best_slot || slot[i].tick < (*best_slot)[best_index].tick) {
+                    best_slot = &slot;
+                    best_index = i;
+                    best_level = level;
+                }
+            }
+        };
+        for (uint32_t level = 0; level < LEVELS; level++) {
+            if (!counts_[level]) {
+                continue;
+            }
+            // Every entry of a level lies in one of the next SLOTS spans of that level,
+            // so the first occupied slot after the clock holds its earliest entries.
+            uint64_t base = current_ >> (SLOT_BITS * level);
+            for (uint64_t i = 1; i <= SLOTS; i++) {
+                auto &slot = levels_[level][(base + i) & SLOT_MASK];
+                if (!slot.empty()) {
+                    consider(slot, level);
+                    break;
+                }
+            }
+        }
+        consider(overflow_, LEVELS);
+        if (!best_slot) {
+            return false;
+        }
+        out = (*best_slot)[best_index];
+        (*best_slot)[best_index] = best_slot->back();
+        best_slot->pop_back();
+        if (best_level < LEVELS) {
+            counts_[best_level]--;
+        }
+        size_--;
+        return true;
+    }
+
+    // Hands every entry to `fn` without removing it.
+    template <typename F>
+    void for_each(F &&fn) const {
+        for (const auto &level : levels_) {
+            for (const auto &slot : level) {
+                for (const auto &entry : slot) {
+                    fn(entry);
+                }
+            }
+        }
+        for (const auto &entry : overflow_) {
+            fn(entry);
+        }
+    }
+
+    // Removes every entry, handing each to `fn`.
+    template <typename F>
+    void drain(F &&fn) {
+        for (auto &level : levels_) {
+            for (auto &slot : level) {
+                for (auto &entry : slot) {
+                    fn(entry);
+                }
+                slot.clear();
+            }
+        }
+        for (auto &entry : overflow_) {
+            fn(entry);
+        }
+        overflow_.clear();
+        counts_.fill(0);
+        size_ = 0;
+    }
+
+  private:
+    double resolution_;
+    uint64_t current_{0};
+    bool started_{false};
+    size_t size_{0};
+    std::array<std::array<std::vector<Entry>, SLOTS>, LEVELS> levels_;
+    std::array<size_t, LEVELS> counts_{};
+    std::vector<Entry> overflow_;
+    std::vector<Entry> due_;
+
+    inline void insert(const Entry &entry) {
+        uint64_t delta = entry.tick - current_;
+        for (uint32_t level = 0; level < LEVELS; level++) {
+            if (delta < (uint64_t{1} << (SLOT_BITS * (level + 1)))) {
+                levels_[level][(entry.tick >> (SLOT_BITS * level)) & SLOT_MASK].push_back(
+                    entry);
+                counts_[level]++;
+                return;
+            }
+        }
+        overflow_.push_back(entry);
+    }
+
+    // Redistributes the higher-level slots that the clock has just entered, highest
+    // level first so that entries can fall through more than one level.
+    inline void cascade() {
+        if (!(current_ & SLOT_MASK)) {
+            if (!(current_ & ((uint64_t{1} << (SLOT_BITS * LEVELS)) - 1))) {
+                std::vector<Entry> pending;
+                pending.swap(overflow_);
+                for (auto &entry : pending) {
+                    insert(entry);
+                }
+            }
+            for (uint32_t level = LEVELS - 1; level > 0; level--) {
+                uint64_t span_mask = (uint64_t{1} << (SLOT_BITS * level)) - 1;
+                if (current_ & span_mask) {
+                    continue;
+                }
+                auto &slot = levels_[level][(current_ >> (SLOT_BITS * level)) & SLOT_MASK];
+                if (slot.empty()) {
+                    continue;
+                }
+                std::vector<Entry> pending;
+                pending.swap(slot);
+                counts_[level] -= pending.size();
+                for (auto &entry : pending) {
+                    insert(entry);
+                }
+            }
+        }
+    }
+};
+
+} // end namespace Net
+
+#endif
@@ -1,11 +1,15 @@
 #ifndef FLOWMETER_TINS_EXT_H
 #define FLOWMETER_TINS_EXT_H
 
+#include "fmt/format.h"
+#include "tins/hw_address.h"
 #include "tins/ip_address.h"
 #include "tins/ipv6_address.h"
+#include <arpa/inet.h>
 #include <array>
 #include <cstdint>
 #include <cstring>
+#include <string>
 #include <vector>
 
 namespace Net {
@@ -15,12 +19,15 @@ namespace Net {
 typedef std::array<uint8_t, ADDR_SIZE> IpAddress;
 typedef Tins::HWAddress<6> MacAddress;
 
-void to_bytes(Tins::IPv4Address addr, IpAddress &addr_arr) {
-    auto int_addr = uint32_t(addr);
+// Addresses are stored in network byte order; IPv4 occupies the first four bytes and
+// the remainder is zeroed so that keys compare and hash byte-wise.
+inline void to_bytes(Tins::IPv4Address addr, IpAddress &addr_arr) {
+    auto int_addr = htonl(uint32_t(addr));
+    addr_arr.fill(0);
     std::memcpy(addr_arr.data(), &int_addr, 4);
 }
 
-void to_bytes(Tins::IPv6Address addr, IpAddress &addr_arr) {
+inline void to_bytes(Tins::IPv6Address addr, IpAddress &addr_arr) {
     auto i = 0;
     for (auto byte : addr) {
         addr_arr[i] = static_cast<uint8_t>(byte);
@@ -28,6 +35,45 @@ void to_bytes(Tins::IPv6Address addr, IpAddress &addr_arr) {
     }
 }
 
+inline Tins::IPv4Address to_ipv4_address(const IpAddress &addr_arr) {
+    uint32_t int_addr;
+    std::memcpy(&int_addr, addr_arr.data(), 4);
+    return Tins::IPv4Address(ntohl(int_addr));
+}
+
+inline Tins::IPv6Address to_ipv6_address(const IpAddress &addr_arr) {
+    return Tins::IPv6Address(addr_arr.data());
+}
+
+inline std::string to_string(const IpAddress &addr_arr, uint8_t ip_version) {
+    if (ip_version == 6) {
+        return to_ipv6_address(addr_arr).to_string();
+    }
+    return to_ipv4_address(addr_arr).to_string();
+}
+
+// Allocation-free counterparts of the to_string() calls above, for the record writer.
+template <typename OutputIt>
+inline OutputIt format_to(OutputIt out, const MacAddress &mac_addr) {
+    static constexpr char digits[] = "0123456789abcdef";
+    auto i = 0;
+    for (auto byte : mac_addr) {
+        if (i++) {
+            *out++ = ':';
+        }
+        *out++ = digits[static_cast<uint8_t>(byte) >> 4];
+        *out++ = digits[static_cast<uint8_t>(byte) & 0x0F];
+    }
+    return out;
+}
+
+template <typename OutputIt>
+inline OutputIt format_to(OutputIt out, const IpAddress &addr_arr, uint8_t ip_version) {
+    char text[INET6_ADDRSTRLEN];
+    inet_ntop(ip_version == 6 ? AF_INET6 : AF_INET, addr_arr.data(), text, sizeof(text));
+    return fmt::format_to(out, "{}", static_cast<const char *>(text));
+}
+
 } // end namespace Net
 
 #endif
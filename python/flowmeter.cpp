@@ -1,16 +1,398 @@
 #include <cstdint>
+#include <memory>
+#include <mutex>
+#include <flowmeter/buffer_meter.h>
+#include <flowmeter/columnar.h>
+#include <flowmeter/flow_stream.h>
+#include <flowmeter/live_meter.h>
 #include <flowmeter/meter.h>
+#include <flowmeter/sharded_meter.h>
+#include <flowmeter/split_meter.h>
+#include <pybind11/numpy.h>
 #include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
+#include <stdexcept>
 #include <string>
+#include <vector>
 
 namespace Net {
 
+// NumPy dtype of a column; byte columns become two-dimensional uint8 arrays.
+inline pybind11::dtype column_dtype(const ColumnSpec &spec) {
+    switch (spec.type) {
+    case ColumnType::UINT16:
+        return pybind11::dtype::of<uint16_t>();
+    case ColumnType::UINT32:
+        return pybind11::dtype::of<uint32_t>();
+    case ColumnType::UINT64:
+        return pybind11::dtype::of<uint64_t>();
+    case ColumnType::INT64:
+        return pybind11::dtype::of<int64_t>();
+    case ColumnType::FLOAT64:
+        return pybind11::dtype::of<double>();
+    default:
+        return pybind11::dtype::of<uint8_t>();
+    }
+}
+
+// Read-only array over `rows` values of a column that live in the reader's mapping;
+// `base` keeps the mapping alive for as long as the array is.
+inline pybind11::array column_array(const ColumnSpec &spec, const uint8_t *data,
+                                    uint64_t rows, pybind11::handle base) {
+    std::vector<pybind11::ssize_t> shape{static_cast<pybind11::ssize_t>(rows)};
+    std::vector<pybind11::ssize_t> strides{spec.width};
+    if (spec.type == ColumnType::BYTES) {
+        shape.push_back(spec.width);
+        strides.push_back(1);
+    }
+    pybind11::array array(column_dtype(spec), shape, strides, data, base);
+    array.attr("setflags")(pybind11::arg("write") = false);
+    return array;
+}
+
+inline pybind11::dict chunk_columns(pybind11::object self, size_t index) {
+    const auto &reader = self.cast<const ColumnarReader &>();
+    if (index >= reader.chunks().size()) {
+        throw pybind11::index_error("chunk index out of range");
+    }
+    const auto &chunk = reader.chunks()[index];
+    pybind11::dict columns;
+    for (size_t i = 0; i < reader.columns().size(); i++) {
+        const auto &spec = reader.columns()[i];
+        columns[pybind11::str(spec.name)] =
+            column_array(spec, chunk.columns[i], chunk.rows, self);
+    }
+    return columns;
+}
+
+// A whole column as one zero-copy array per chunk, in file order. The writer cuts files
+// into chunks, so joining them into one array would copy the column; callers that want
+// that copy can make it with numpy.concatenate.
+inline pybind11::list column_chunks(pybind11::object self, const std::string &name) {
+    const auto &reader = self.cast<const ColumnarReader &>();
+    auto column = reader.find(name);
+    if (column == reader.columns().size()) {
+        throw pybind11::key_error(name);
+    }
+    const auto &spec = reader.columns()[column];
+    pybind11::list parts;
+    for (const auto &chunk : reader.chunks()) {
+        parts.append(column_array(spec, chunk.columns[column], chunk.rows, self));
+    }
+    return parts;
+}
+
+// NumPy structured dtype matching the RowBuffer layout for `specs`.
+inline pybind11::dtype record_dtype(const std::vector<ColumnSpec> &specs) {
+    RowBuffer layout(specs);
+    pybind11::list names;
+    pybind11::list formats;
+    pybind11::list offsets;
+    for (size_t i = 0; i < specs.size(); i++) {
+        const auto &spec = specs[i];
+        names.append(pybind11::str(spec.name));
+        if (spec.type == ColumnType::BYTES) {
+            formats.append(pybind11::dtype("(" + std::to_string(spec.width) + ",)u1"));
+        } else {
+            formats.append(column_dtype(spec));
+        }
+        offsets.append(pybind11::int_(layout.offsets()[i]));
+    }
+    return pybind11::dtype(names, formats, offsets,
+                           static_cast<pybind11::ssize_t>(layout.itemsize()));
+}
+
+// Structured array that takes ownership of `rows`, so the records are never copied.
+inline pybind11::array owned_records(std::unique_ptr<RowBuffer> rows,
+                                     const pybind11::dtype &dtype) {
+    auto *data = rows->data();
+    auto size = static_cast<pybind11::ssize_t>(rows->size());
+    auto itemsize = static_cast<pybind11::ssize_t>(rows->itemsize());
+    pybind11::capsule owner(rows.release(),
+                            [](void *buffer) { delete static_cast<RowBuffer *>(buffer); });
+    return pybind11::array(dtype, {size}, {itemsize}, data, owner);
+}
+
+// Meters the next batch with the GIL released and returns it as a structured array.
+inline pybind11::array next_records(FlowStream &stream, const pybind11::dtype &dtype,
+                                    size_t batch_size) {
+    auto rows = std::make_unique<RowBuffer>(stream.columns());
+    rows->reserve(batch_size);
+    bool more;
+    {
+        pybind11::gil_scoped_release release;
+        more = stream.next_batch(*rows, batch_size);
+    }
+    if (!more) {
+        throw pybind11::stop_iteration();
+    }
+    return owned_records(std::move(rows), dtype);
+}
+
+// Claims an object that is used without the GIL for the length of one call. A second
+// Python thread using the same object meanwhile gets a RuntimeError instead of racing
+// the first.
+inline std::unique_lock<std::mutex> claim(std::mutex &mutex, const std::string &name) {
+    std::unique_lock lock(mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        throw std::runtime_error(name + " is already in use");
+    }
+    return lock;
+}
+
+// Python-side state of a FlowStream. Each call claims `mutex`, so one stream is only
+// ever advanced by one thread, but separate streams run in parallel since each batch is
+// metered without the GIL.
+struct FlowStreamIterator {
+    FlowStreamIterator(const std::string &input_file, double active_timeout,
+                       double idle_timeout, double timer_resolution, size_t batch_size)
+        : stream(input_file, active_timeout, idle_timeout, timer_resolution),
+          batch_size(batch_size), dtype(record_dtype(stream.columns())) {}
+
+    FlowStream stream;
+    size_t batch_size;
+    pybind11::dtype dtype;
+    mutable std::mutex mutex;
+};
+
+// Python-side state of a BufferMeter; each call claims `mutex`.
+struct BufferMeterState {
+    BufferMeterState(double active_timeout, double idle_timeout, double timer_resolution,
+                     uint32_t link_type)
+        : meter(active_timeout, idle_timeout, timer_resolution, link_type),
+          dtype(record_dtype(meter.columns())) {}
+
+    BufferMeter meter;
+    pybind11::dtype dtype;
+    mutable std::mutex mutex;
+};
+
+template <typename T>
+using InputArray =
+    pybind11::array_t<T, pybind11::array::c_style | pybind11::array::forcecast>;
+
+// Meters one batch of packets straight out of `data`, which can be any contiguous
+// buffer such as bytes or a NumPy array. The GIL is released while metering, so `data`
+// must not be changed by another thread meanwhile. Returns the records that expired.
+inline pybind11::array ingest_packets(BufferMeterState &state,
+                                      const pybind11::buffer &data,
+                                      const InputArray<uint64_t> &offsets,
+                                      const InputArray<uint32_t> &lengths,
+                                      const InputArray<double> &timestamps) {
+    auto buffer = data.request();
+    bool contiguous = buffer.ndim <= 1 && (buffer.ndim == 0 || buffer.shape[0] <= 1 ||
+                                           buffer.strides[0] == buffer.itemsize);
+    if (!contiguous) {
+        throw pybind11::value_error("The packet buffer must be one contiguous block");
+    }
+    if (offsets.ndim() != 1 || lengths.ndim() != 1 || timestamps.ndim() != 1 ||
+        lengths.size() != offsets.size() || timestamps.size() != offsets.size()) {
+        throw pybind11::value_error(
+            "offsets, lengths and timestamps must be one-dimensional and equally long");
+    }
+    auto lock = claim(state.mutex, "BufferMeter");
+    auto rows = std::make_unique<RowBuffer>(state.meter.columns());
+    {
+        pybind11::gil_scoped_release release;
+        state.meter.ingest(static_cast<const uint8_t *>(buffer.ptr),
+                           static_cast<size_t>(buffer.size * buffer.itemsize),
+                           offsets.data(), lengths.data(), timestamps.data(),
+                           static_cast<size_t>(offsets.size()), *rows);
+    }
+    return owned_records(std::move(rows), state.dtype);
+}
+
 PYBIND11_MODULE(flowmeter, m) {
     m.doc() = "A python module to evaluate IP-based flows";
+    pybind11::enum_<OutputFormat>(m, "OutputFormat")
+        .value("CSV", OutputFormat::CSV)
+        .value("COLUMNAR", OutputFormat::COLUMNAR);
+    pybind11::enum_<FeatureProfile>(m, "FeatureProfile")
+        .value("FULL", FeatureProfile::FULL)
+        .value("HEADERS", FeatureProfile::HEADERS)
+        .value("TIMING", FeatureProfile::TIMING)
+        .value("COUNTS", FeatureProfile::COUNTS)
+        .value("QUANTILES", FeatureProfile::QUANTILES);
+    pybind11::enum_<StatsFormat>(m, "StatsFormat")
+        .value("PROMETHEUS", StatsFormat::PROMETHEUS)
+        .value("JSON", StatsFormat::JSON);
+    m.attr("STATS_ENABLED") = STATS_ENABLED;
+    pybind11::class_<Sampler>(m, "Sampler")
+        .def(pybind11::init([](uint32_t packet_rate, uint32_t flow_rate) {
+                 return Sampler{packet_rate, flow_rate};
+             }),
+             pybind11::arg("packet_rate") = 1, pybind11::arg("flow_rate") = 1)
+        .def_readwrite("packet_rate", &Sampler::packet_rate)
+        .def_readwrite("flow_rate", &Sampler::flow_rate);
+    pybind11::class_<FlowLimits>(m, "FlowLimits")
+        .def(pybind11::init([](size_t max_flows, size_t max_bytes) {
+                 return FlowLimits{max_flows, max_bytes};
+             }),
+             pybind11::arg("max_flows") = 0, pybind11::arg("max_bytes") = 0)
+        .def_readwrite("max_flows", &FlowLimits::max_flows)
+        .def_readwrite("max_bytes", &FlowLimits::max_bytes);
     pybind11::class_<Meter>(m, "Meter")
         .def(pybind11::init<const std::string &, const std::string &, const double &,
                             const double &>())
-        .def("run", &Meter::run);
+        .def(pybind11::init<const std::string &, const std::string &, const double &,
+                            const double &, const double &>())
+        .def(pybind11::init<const std::string &, const std::string &, const double &,
+                            const double &, const double &, const OutputFormat &>())
+        .def(pybind11::init<const std::string &, const std::string &, const double &,
+                            const double &, const double &, const OutputFormat &,
+                            const FeatureProfile &>())
+        .def(pybind11::init<const std::string &, const std::string &, const double &,
+                            const double &, const double &, const OutputFormat &,
+                            const FeatureProfile &, const std::string &, const double &>(),
+             pybind11::arg("input_file"), pybind11::arg("output_file"),
+             pybind11::arg("active_timeout"), pybind11::arg("idle_timeout"),
+             pybind11::arg("timer_resolution") = Meter::default_timer_resolution_,
+             pybind11::arg("format") = OutputFormat::CSV,
+             pybind11::arg("features") = FeatureProfile::FULL,
+             pybind11::arg("host_output_file") = "",
+             pybind11::arg("host_interval") = Meter::default_host_interval_)
+        .def(pybind11::init<const std::vector<std::string> &, const std::string &,
+                            const double &, const double &, const double &,
+                            const OutputFormat &, const FeatureProfile &,
+                            const std::string &, const double &>(),
+             pybind11::arg("input_files"), pybind11::arg("output_file"),
+             pybind11::arg("active_timeout"), pybind11::arg("idle_timeout"),
+             pybind11::arg("timer_resolution") = Meter::default_timer_resolution_,
+             pybind11::arg("format") = OutputFormat::CSV,
+             pybind11::arg("features") = FeatureProfile::FULL,
+             pybind11::arg("host_output_file") = "",
+             pybind11::arg("host_interval") = Meter::default_host_interval_)
+        .def("export_stats", &Meter::export_stats, pybind11::arg("path"),
+             pybind11::arg("format") = StatsFormat::JSON,
+             pybind11::arg("interval") = Meter::default_stats_interval_)
+        .def("limit_flows", &Meter::limit_flows, pybind11::arg("limits"))
+        .def("end_sessions", &Meter::end_sessions, pybind11::arg("linger"))
+        .def("sample", &Meter::sample, pybind11::arg("sampler"))
+        .def("resume", &Meter::resume, pybind11::arg("path"))
+        .def("checkpoint", &Meter::checkpoint, pybind11::arg("path"))
+        .def("run", &Meter::run, pybind11::call_guard<pybind11::gil_scoped_release>());
+    pybind11::class_<ShardedMeter>(m, "ShardedMeter")
+        .def(pybind11::init<const std::string &, const std::string &, const double &,
+                            const double &, const double &, const uint32_t &,
+                            const std::vector<int> &, const OutputFormat &,
+                            const FeatureProfile &>(),
+             pybind11::arg("input_file"), pybind11::arg("output_file"),
+             pybind11::arg("active_timeout"), pybind11::arg("idle_timeout"),
+             pybind11::arg("timer_resolution"), pybind11::arg("threads"),
+             pybind11::arg("cpus") = std::vector<int>{},
+             pybind11::arg("format") = OutputFormat::CSV,
+             pybind11::arg("features") = FeatureProfile::FULL)
+        .def("limit_flows", &ShardedMeter::limit_flows, pybind11::arg("limits"))
+        .def("end_sessions", &ShardedMeter::end_sessions, pybind11::arg("linger"))
+        .def("run", &ShardedMeter::run,
+             pybind11::call_guard<pybind11::gil_scoped_release>());
+    pybind11::class_<SplitMeter>(m, "SplitMeter")
+        .def(pybind11::init<const std::string &, const std::string &, const double &,
+                            const double &, const double &, const uint32_t &,
+                            const uint64_t &, const std::vector<int> &,
+                            const OutputFormat &, const FeatureProfile &>(),
+             pybind11::arg("input_file"), pybind11::arg("output_file"),
+             pybind11::arg("active_timeout"), pybind11::arg("idle_timeout"),
+             pybind11::arg("timer_resolution"), pybind11::arg("threads"),
+             pybind11::arg("split_size") = SplitMeter::default_split_size_,
+             pybind11::arg("cpus") = std::vector<int>{},
+             pybind11::arg("format") = OutputFormat::CSV,
+             pybind11::arg("features") = FeatureProfile::FULL)
+        .def("run", &SplitMeter::run,
+             pybind11::call_guard<pybind11::gil_scoped_release>());
+    pybind11::class_<LiveMeter>(m, "LiveMeter")
+        .def(pybind11::init<const std::string &, const std::string &, const double &,
+                            const double &, const double &, const uint32_t &,
+                            const OutputFormat &, const double &,
+                            const FeatureProfile &>(),
+             pybind11::arg("interface"), pybind11::arg("output_file"),
+             pybind11::arg("active_timeout"), pybind11::arg("idle_timeout"),
+             pybind11::arg("timer_resolution") = Meter::default_timer_resolution_,
+             pybind11::arg("threads") = 1, pybind11::arg("format") = OutputFormat::CSV,
+             pybind11::arg("duration") = 0.0,
+             pybind11::arg("features") = FeatureProfile::FULL)
+        .def("limit_flows", &LiveMeter::limit_flows, pybind11::arg("limits"))
+        .def("end_sessions", &LiveMeter::end_sessions, pybind11::arg("linger"))
+        .def("run", &LiveMeter::run, pybind11::call_guard<pybind11::gil_scoped_release>())
+        .def("stop", &LiveMeter::stop);
+    // Iterating a FlowStream yields exported flows as NumPy structured arrays of about
+    // `batch_size` records, with one field per output column.
+    pybind11::class_<FlowStreamIterator>(m, "FlowStream")
+        .def(pybind11::init<const std::string &, double, double, double, size_t>(),
+             pybind11::arg("input_file"), pybind11::arg("active_timeout") = 120.0,
+             pybind11::arg("idle_timeout") = 5.0,
+             pybind11::arg("timer_resolution") = Meter::default_timer_resolution_,
+             pybind11::arg("batch_size") = 4096)
+        .def("__iter__", [](pybind11::object self) { return self; })
+        .def("__next__",
+             [](FlowStreamIterator &iterator) {
+                 auto lock = claim(iterator.mutex, "FlowStream");
+                 return next_records(iterator.stream, iterator.dtype, iterator.batch_size);
+             })
+        .def_property_readonly("dtype",
+                               [](const FlowStreamIterator &iterator) {
+                                   return iterator.dtype;
+                               })
+        .def_property_readonly("packet_count", [](const FlowStreamIterator &iterator) {
+            auto lock = claim(iterator.mutex, "FlowStream");
+            return iterator.stream.packet_count();
+        });
+    // A BufferMeter meters packets handed over from Python in batches and returns the
+    // flows each batch expired, in the same structured arrays as a FlowStream.
+    pybind11::class_<BufferMeterState>(m, "BufferMeter")
+        .def(pybind11::init<double, double, double, uint32_t>(),
+             pybind11::arg("active_timeout") = 120.0, pybind11::arg("idle_timeout") = 5.0,
+             pybind11::arg("timer_resolution") = Meter::default_timer_resolution_,
+             pybind11::arg("link_type") = static_cast<uint32_t>(LINKTYPE_ETHERNET))
+        .def("ingest", &ingest_packets, pybind11::arg("data"), pybind11::arg("offsets"),
+             pybind11::arg("lengths"), pybind11::arg("timestamps"))
+        .def("finish",
+             [](BufferMeterState &state) {
+                 auto lock = claim(state.mutex, "BufferMeter");
+                 auto rows = std::make_unique<RowBuffer>(state.meter.columns());
+                 {
+                     pybind11::gil_scoped_release release;
+                     state.meter.finish(*rows);
+                 }
+                 return owned_records(std::move(rows), state.dtype);
+             })
+        .def_property_readonly("dtype",
+                               [](const BufferMeterState &state) { return state.dtype; })
+        .def_property_readonly("packet_count",
+                               [](const BufferMeterState &state) {
+                                   auto lock = claim(state.mutex, "BufferMeter");
+                                   return state.meter.packet_count();
+                               })
+        .def_property_readonly("flow_count", [](const BufferMeterState &state) {
+            auto lock = claim(state.mutex, "BufferMeter");
+            return state.meter.flow_count();
+        });
+    pybind11::class_<ColumnarReader>(m, "ColumnarReader")
+        .def(pybind11::init<const std::string &>())
+        .def_property_readonly("columns",
+                               [](const ColumnarReader &reader) {
+                                   std::vector<std::string> names;
+                                   for (const auto &spec : reader.columns()) {
+                                       names.push_back(spec.name);
+                                   }
+                                   return names;
+                               })
+        .def_property_readonly("num_rows", &ColumnarReader::rows)
+        .def_property_readonly("num_chunks",
+                               [](const ColumnarReader &reader) {
+                                   return reader.chunks().size();
+                               })
+        .def("chunk", &chunk_columns, "Columns of one chunk as zero-copy NumPy arrays")
+        .def("column", &column_chunks,
+             "One column as a list of zero-copy NumPy arrays, one per chunk")
+        .def("to_dict", [](pybind11::object self) {
+            const auto &reader = self.cast<const ColumnarReader &>();
+            pybind11::dict columns;
+            for (const auto &spec : reader.columns()) {
+                columns[pybind11::str(spec.name)] = column_chunks(self, spec.name);
+            }
+            return columns;
+        });
 }
 
 } // end namespace Net
@@ -1,25 +1,243 @@
 #include "CLI/CLI.hpp"
+#include <filesystem>
 #include <string>
+#include <vector>
 
+#include "flowmeter/live_meter.h"
 #include "flowmeter/meter.h"
+#include "flowmeter/sharded_meter.h"
+#include "flowmeter/split_meter.h"
 
 auto main(int argc, char **argv) -> int {
     CLI::App app{"A program to evaluate IP-based flows"};
 
-    std::string pcap_path;
+    std::vector<std::string> pcap_paths;
+    std::string interface;
+    double duration{0};
     std::string csv_path;
     double active_timeout{120};
     double idle_timeout{5};
-    app.add_option("-i,--input-path", pcap_path, "Path to .pcap/.pcapng file")->required();
-    app.add_option("-o,--output-path", csv_path, "Path to output .csv file")->required();
+    double timer_resolution{0.01};
+    uint32_t threads{1};
+    std::vector<int> cpus;
+    uint64_t split_size{0};
+    Net::FlowLimits limits;
+    size_t max_memory{0};
+    double session_linger{-1};
+    std::string checkpoint_path;
+    Net::Sampler sampler;
+    std::string resume_path;
+    std::string output_format{"csv"};
+    std::string features{"full"};
+    std::string host_path;
+    double host_interval{Net::Meter::default_host_interval_};
+    std::string stats_path;
+    std::string stats_format{"json"};
+    double stats_interval{Net::Meter::default_stats_interval_};
+    auto input =
+        app.add_option("-i,--input-path", pcap_paths,
+                       "Paths to .pcap/.pcapng files, optionally gzip or zstd compressed, "
+                       "or directories of them, metered in order as one capture");
+    auto live = app.add_option("--interface", interface,
+                               "Network interface to capture from instead of a file");
+    input->excludes(live);
+    live->excludes(input);
+    app.add_option("--duration", duration,
+                   "Seconds to capture from --interface for; 0 runs until interrupted")
+        ->capture_default_str()
+        ->check(CLI::NonNegativeNumber);
+    app.add_option("-o,--output-path", csv_path,
+                   "Path to output file; a .gz or .zst extension compresses it")
+        ->required();
     app.add_option("--active-timeout", active_timeout,
                    "Active timeout duration in seconds")
         ->capture_default_str();
     app.add_option("--idle_timeout", idle_timeout, "Idle timeout duration in seconds")
         ->capture_default_str();
+    app.add_option("--timer-resolution", timer_resolution,
+                   "Granularity of flow expiration in seconds")
+        ->capture_default_str();
+    app.add_option("--threads", threads,
+                   "Number of flow table worker threads, or of capture rings when live")
+        ->capture_default_str()
+        ->check(CLI::PositiveNumber);
+    app.add_option("--split-size", split_size,
+                   "With --threads greater than 1, split a classic pcap file into byte "
+                   "ranges of this many MiB metered in parallel, instead of sharding "
+                   "flows over the workers; 0 disables")
+        ->capture_default_str();
+    app.add_option("--max-flows", limits.max_flows,
+                   "Most flows to keep in the flow table; beyond it the flow due to "
+                   "expire first is exported early; 0 is unbounded. Files need one "
+                   "thread, since evicting within each worker's share would make the "
+                   "output depend on the thread count; live, it is shared out over the "
+                   "capture rings")
+        ->capture_default_str();
+    app.add_option("--max-memory", max_memory,
+                   "MiB the flow table may use, enforced like --max-flows and allocated "
+                   "up front; 0 is unbounded")
+        ->capture_default_str();
+    app.add_option("--session-linger", session_linger,
+                   "Export a TCP flow as session_end this many seconds after its "
+                   "connection closed with FINs or an RST, or after the last late packet "
+                   "since; negative leaves closed connections to the timeouts")
+        ->capture_default_str();
+    app.add_option("--sample-packets", sampler.packet_rate,
+                   "Meter one packet in this many, by position in the capture")
+        ->capture_default_str()
+        ->check(CLI::PositiveNumber);
+    app.add_option("--sample-flows", sampler.flow_rate,
+                   "Meter one flow in this many, chosen by a hash of its endpoints so "
+                   "that kept flows see all of their packets")
+        ->capture_default_str()
+        ->check(CLI::PositiveNumber);
+    app.add_option("--checkpoint", checkpoint_path,
+                   "Save the flows still live at the end to this file instead of "
+                   "exporting them, for --resume");
+    app.add_option("--resume", resume_path,
+                   "Start from the flows saved with --checkpoint, skipping the input "
+                   "files that were read before it");
+    app.add_option("--cpus", cpus,
+                   "CPUs to pin the reader, workers and writer to, in that order");
+    app.add_option("--output-format", output_format,
+                   "Output file format: csv, or columnar for typed binary columns")
+        ->capture_default_str()
+        ->check(CLI::IsMember({"csv", "columnar"}));
+    app.add_option("--features", features,
+                   "Feature set: full; headers (no payload scan); timing (inter-arrival "
+                   "times); counts (packet and byte counts); quantiles (full plus packet "
+                   "size and inter-arrival time quantiles)")
+        ->capture_default_str()
+        ->check(CLI::IsMember({"full", "headers", "timing", "counts", "quantiles"}));
+    app.add_option("--host-output", host_path,
+                   "Path to write per-host graph features to, one row per host and "
+                   "interval");
+    app.add_option("--host-interval", host_interval,
+                   "Seconds of capture time covered by each row of --host-output")
+        ->capture_default_str()
+        ->check(CLI::PositiveNumber);
+    app.add_option("--stats-output", stats_path,
+                   "Path to write runtime stats to periodically; needs a build with "
+                   "FLOWMETER_STATS");
+    app.add_option("--stats-format", stats_format,
+                   "Runtime stats format: json (one line per snapshot) or prometheus "
+                   "(text format, replaced on every snapshot)")
+        ->capture_default_str()
+        ->check(CLI::IsMember({"json", "prometheus"}));
+    app.add_option("--stats-interval", stats_interval,
+                   "Wall-clock seconds between runtime stats snapshots")
+        ->capture_default_str()
+        ->check(CLI::PositiveNumber);
     CLI11_PARSE(app, argc, argv);
+    if (pcap_paths.empty() && interface.empty()) {
+        std::cerr << "One of --input-path or --interface is required" << std::endl;
+        return 1;
+    }
+    if (!stats_path.empty() && !Net::STATS_ENABLED) {
+        std::cerr << "--stats-output needs a build with FLOWMETER_STATS" << std::endl;
+        return 1;
+    }
+    if (!stats_path.empty() && (threads > 1 || !interface.empty())) {
+        std::cerr << "--stats-output is only supported when reading a file with one "
+                     "thread"
+                  << std::endl;
+        return 1;
+    }
+    if (!host_path.empty() && (threads > 1 || !interface.empty())) {
+        std::cerr << "--host-output is only supported when reading a file with one thread"
+                  << std::endl;
+        return 1;
+    }
+    bool several_files =
+        pcap_paths.size() > 1 ||
+        (pcap_paths.size() == 1 && std::filesystem::is_directory(pcap_paths[0]));
+    if ((several_files || !checkpoint_path.empty() || !resume_path.empty()) &&
+        threads > 1) {
+        std::cerr << "Several input files, --checkpoint and --resume are only supported "
+                     "with one thread"
+                  << std::endl;
+        return 1;
+    }
+    if (sampler.samples() && (threads > 1 || !interface.empty())) {
+        std::cerr << "--sample-packets and --sample-flows are only supported when reading "
+                     "files with one thread"
+                  << std::endl;
+        return 1;
+    }
+    if ((!checkpoint_path.empty() || !resume_path.empty()) && !interface.empty()) {
+        std::cerr << "--checkpoint and --resume are only supported when reading files"
+                  << std::endl;
+        return 1;
+    }
+    if ((limits.max_flows || max_memory) && threads > 1 && interface.empty()) {
+        std::cerr << "--max-flows and --max-memory are only supported when reading files "
+                     "with one thread"
+                  << std::endl;
+        return 1;
+    }
+    if (split_size && (threads < 2 || !interface.empty())) {
+        std::cerr << "--split-size is only supported when reading a file with more than "
+                     "one thread"
+                  << std::endl;
+        return 1;
+    }
+    if (session_linger >= 0 && split_size) {
+        std::cerr << "--session-linger cannot be used with --split-size" << std::endl;
+        return 1;
+    }
+    limits.max_bytes = max_memory << 20;
+
+    auto format =
+        output_format == "columnar" ? Net::OutputFormat::COLUMNAR : Net::OutputFormat::CSV;
+    auto profile = features == "headers" ? Net::FeatureProfile::HEADERS
+                   : features == "timing" ? Net::FeatureProfile::TIMING
+                   : features == "counts" ? Net::FeatureProfile::COUNTS
+                   : features == "quantiles" ? Net::FeatureProfile::QUANTILES
+                                             : Net::FeatureProfile::FULL;
+
+    if (!interface.empty()) {
+        Net::LiveMeter meter(interface, csv_path, active_timeout, idle_timeout,
+                             timer_resolution, threads, format, duration, profile);
+        meter.limit_flows(limits);
+        meter.end_sessions(session_linger);
+        meter.run();
+        return 0;
+    }
+
+    if (split_size) {
+        Net::SplitMeter meter(pcap_paths[0], csv_path, active_timeout, idle_timeout,
+                              timer_resolution, threads, split_size << 20, cpus, format,
+                              profile);
+        meter.run();
+        return 0;
+    }
+
+    if (threads > 1) {
+        Net::ShardedMeter meter(pcap_paths[0], csv_path, active_timeout, idle_timeout,
+                                timer_resolution, threads, cpus, format, profile);
+        meter.limit_flows(limits);
+        meter.end_sessions(session_linger);
+        meter.run();
+        return 0;
+    }
 
-    Net::Meter meter(pcap_path, csv_path, active_timeout, idle_timeout);
+    Net::Meter meter(pcap_paths, csv_path, active_timeout, idle_timeout, timer_resolution,
+                     format, profile, host_path, host_interval);
+    meter.limit_flows(limits);
+    meter.end_sessions(session_linger);
+    meter.sample(sampler);
+    if (!resume_path.empty()) {
+        meter.resume(resume_path);
+    }
+    if (!checkpoint_path.empty()) {
+        meter.checkpoint(checkpoint_path);
+    }
+    if (!stats_path.empty()) {
+        meter.export_stats(stats_path,
+                           stats_format == "prometheus" ? Net::StatsFormat::PROMETHEUS
+                                                        : Net::StatsFormat::JSON,
+                           stats_interval);
+    }
 
     meter.run();
 }
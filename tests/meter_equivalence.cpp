@@ -0,0 +1,96 @@
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "flowmeter/meter.h"
+#include "flowmeter/sharded_meter.h"
+#include "flowmeter/split_meter.h"
+#include "synthetic_traffic.h"
+
+// Meters one synthetic capture serially, sharded over several workers and split into
+// byte ranges, and checks that every parallel run writes exactly the serial output.
+// The ranges are small, so that many flows cross from one range into the next, and
+// some packets are stamped early, so that the clock also goes backwards across them.
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr double ACTIVE_TIMEOUT = 10;
+constexpr double IDLE_TIMEOUT = 2;
+constexpr double TIMER_RESOLUTION = 0.01;
+constexpr uint64_t SPLIT_SIZE = 256 << 10;
+
+std::string read_file(const fs::path &path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+// Whether `path` holds the same bytes as `expected`; reports the first difference.
+bool same_output(const std::string &name, const fs::path &path,
+                 const std::string &expected) {
+    auto actual = read_file(path);
+    if (actual == expected) {
+        std::cout << name << ": identical to the serial run" << std::endl;
+        return true;
+    }
+    size_t at = 0;
+    while (at < actual.size() && at < expected.size() && actual[at] == expected[at]) {
+        at++;
+    }
+    std::cerr << name << ": differs from the serial run at byte " << at << " ("
+              << actual.size() << " bytes against " << expected.size() << ")"
+              << std::endl;
+    return false;
+}
+
+} // namespace
+
+auto main() -> int {
+    Net::TrafficProfile profile;
+    profile.flows = 5'000;
+    profile.max_lifetime = 20;
+    profile.span = 40;
+    profile.skew_share = 0.01;
+    profile.max_skew = 1;
+    Net::SyntheticTraffic traffic(profile);
+
+    auto directory =
+        fs::temp_directory_path() / ("flowmeter_equivalence_" + std::to_string(getpid()));
+    fs::create_directories(directory);
+    auto pcap = (directory / "traffic.pcap").string();
+    traffic.write_pcap(pcap);
+
+    auto serial = directory / "serial.csv";
+    Net::Meter(pcap, serial.string(), ACTIVE_TIMEOUT, IDLE_TIMEOUT, TIMER_RESOLUTION).run();
+    auto expected = read_file(serial);
+
+    bool same = true;
+    for (uint32_t threads : {2u, 3u}) {
+        auto name = "sharded over " + std::to_string(threads);
+        auto path = directory / ("sharded_" + std::to_string(threads) + ".csv");
+        Net::ShardedMeter(pcap, path.string(), ACTIVE_TIMEOUT, IDLE_TIMEOUT,
+                          TIMER_RESOLUTION, threads)
+            .run();
+        same = same_output(name, path, expected) && same;
+
+        name = "split over " + std::to_string(threads);
+        path = directory / ("split_" + std::to_string(threads) + ".csv");
+        Net::SplitMeter(pcap, path.string(), ACTIVE_TIMEOUT, IDLE_TIMEOUT, TIMER_RESOLUTION,
+                        threads, SPLIT_SIZE)
+            .run();
+        same = same_output(name, path, expected) && same;
+    }
+
+    if (same) {
+        fs::remove_all(directory);
+        return 0;
+    }
+    std::cerr << "Outputs kept in " << directory << std::endl;
+    return 1;
+}